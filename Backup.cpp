@@ -26,6 +26,9 @@
 #ifndef WIN64
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define _strdup strdup
 #endif
 
 using namespace std;
@@ -149,9 +152,14 @@ bool Kangaroo::LoadWork(string &fileName) {
 
   ::printf("Loading: %s\n",fileName.c_str());
 
+  uint32_t version;
+  bool isPart = false;
+
   if(!clientMode) {
 
-    fRead = ReadHeader(fileName,NULL,HEADW);
+    // Partitioned work file (-wpart), no kangaroos
+    isPart = IsDir(fileName) == 1;
+    fRead = ReadHeader(isPart ? fileName + "/header" : fileName,&version,HEADW);
     if(fRead == NULL)
       return false;
 
@@ -182,19 +190,48 @@ bool Kangaroo::LoadWork(string &fileName) {
     ::printf("\033[1;35m[Keys]\033[0m  %d\n", (int)keysToSearch.size());
 
     // Read hashTable
-    hashTable.LoadTable(fRead);
+    if(isPart) {
+      hashTable.Reset();
+      if(!LoadPartWork(fileName,(version & VERSION_PACKED) != 0))
+        return false;
+    } else if(!hashTable.LoadTable(fRead,(version & VERSION_PACKED) != 0)) {
+      ::printf("LoadWork: %s is corrupted\n",fileName.c_str());
+      fclose(fRead);
+      fRead = NULL;
+      return false;
+    }
+
+    // DP received after the last snapshot
+    ReplayJournal(fileName);
 
   } else {
 
     // In client mode, config come from the server, file has only kangaroo
-    fRead = ReadHeader(fileName,NULL,HEADK);
+    fRead = ReadHeader(fileName,&version,HEADK);
     if(fRead == NULL)
       return false;
 
+    // DP already acknowledged by the server after this backup
+    LoadAck(fileName);
+
   }
 
   // Read number of walk
-  fread(&nbLoadedWalk,sizeof(uint64_t),1,fRead);
+  if(!isPart)
+    fread(&nbLoadedWalk,sizeof(uint64_t),1,fRead);
+
+  // Compact kangaroos: distance width
+  loadWalkDBytes = 0;
+  if((version & VERSION_KCOMPACT) && nbLoadedWalk > 0) {
+    uint8_t dBytes = 0;
+    ::fread(&dBytes,1,1,fRead);
+    if(dBytes == 0 || dBytes > 32) {
+      ::printf("LoadWork: invalid compact kangaroo header, kangaroos ignored\n");
+      nbLoadedWalk = 0;
+    } else {
+      loadWalkDBytes = dBytes;
+    }
+  }
 
   double t1 = Timer::get_tick();
 
@@ -205,6 +242,93 @@ bool Kangaroo::LoadWork(string &fileName) {
 
 // ----------------------------------------------------------------------------
 
+// Compact kangaroo record: x (32 bytes), flags (1 byte), |distance| (dBytes bytes)
+#define WALK_ODD  0x1  // y is odd
+#define WALK_NEG  0x2  // negative distance
+
+static void GetWalkDistance(Int *d,Int *mag,bool *neg) {
+
+  // Same convention as HashTable::Convert
+  mag->Set(d);
+  *neg = (d->bits64[3] > 0x7FFFFFFFFFFFFFFFULL);
+  if(*neg)
+    mag->ModNegK1order();
+
+}
+
+// y = sqrt(x^3+7) with the given parity (p = 3 mod 4)
+static bool ComputeY(Int *x,bool odd,Int *y) {
+
+  Int s;
+  Int r;
+  s.ModSquareK1(x);
+  r.ModMulK1(&s,x);
+  r.ModAdd(7);
+
+  Int e(Int::GetFieldCharacteristic());
+  e.AddOne();
+  e.ShiftR(2);
+
+  y->SetInt32(1);
+  for(int i = e.GetBitLength() - 1; i >= 0; i--) {
+    y->ModSquareK1(y);
+    if(e.GetBit(i))
+      y->ModMulK1(&r);
+  }
+
+  s.ModSquareK1(y);
+  if(!s.IsEqual(&r))
+    return false;
+
+  if(y->IsOdd() != odd)
+    y->ModNeg();
+
+  return true;
+
+}
+
+#ifdef WIN64
+DWORD WINAPI _decodeWalkThread(LPVOID lpParam) {
+#else
+void *_decodeWalkThread(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->DecodeWalks(p);
+  p->isRunning = false;
+  return 0;
+}
+
+void Kangaroo::DecodeWalks(TH_PARAM *p) {
+
+  int recSize = 33 + loadWalkDBytes;
+  uint64_t nbWrong = 0;
+
+  for(uint64_t i = p->walkStart; i < p->walkStart + p->nbKangaroo; i++) {
+
+    uint8_t *rec = walkBuff + i * recSize;
+    Int *x = p->px + i;
+    Int *y = p->py + i;
+    Int *d = p->distance + i;
+
+    x->SetInt32(0);
+    memcpy(x->bits64,rec,32);
+    d->SetInt32(0);
+    memcpy(d->bits64,rec + 33,loadWalkDBytes);
+    if(rec[32] & WALK_NEG)
+      d->ModNegK1order();
+
+    if(!ComputeY(x,rec[32] & WALK_ODD,y)) {
+      // Not on the curve, will be replaced
+      x->SetInt32(0);
+      nbWrong++;
+    }
+
+  }
+
+  p->walkWrong = nbWrong;
+
+}
+
 void Kangaroo::FetchWalks(uint64_t nbWalk,Int *x,Int *y,Int *d) {
 
   // Read Kangaroos
@@ -212,7 +336,57 @@ void Kangaroo::FetchWalks(uint64_t nbWalk,Int *x,Int *y,Int *d) {
 
   ::printf("Fetch kangaroos: %.0f\n",(double)nbWalk);
 
-  for(n = 0; n < (int64_t)nbWalk && nbLoadedWalk>0; n++) {
+  if(loadWalkDBytes > 0) {
+
+    // Bulk read, points are decompressed by several threads
+    n = (int64_t)nbWalk;
+    if(n > nbLoadedWalk) n = nbLoadedWalk;
+    int recSize = 33 + loadWalkDBytes;
+    walkBuff = (uint8_t *)malloc((size_t)n * recSize);
+    n = (int64_t)::fread(walkBuff,recSize,(size_t)n,fRead);
+    nbLoadedWalk -= n;
+
+    int nbThread = Timer::getCoreNumber();
+    if(nbThread > n) nbThread = (int)n;
+    if(nbThread < 1) nbThread = 1;
+    TH_PARAM *params = (TH_PARAM *)malloc(nbThread * sizeof(TH_PARAM));
+    THREAD_HANDLE *thHandles = (THREAD_HANDLE *)malloc(nbThread * sizeof(THREAD_HANDLE));
+    memset(params,0,nbThread * sizeof(TH_PARAM));
+
+    int64_t stride = n / nbThread;
+    for(int i = 0; i < nbThread; i++) {
+      params[i].obj = this;
+      params[i].threadId = i;
+      params[i].isRunning = true;
+      params[i].walkStart = (uint64_t)(i * stride);
+      params[i].nbKangaroo = (i == nbThread - 1) ? (uint64_t)(n - i * stride) : (uint64_t)stride;
+      params[i].px = x;
+      params[i].py = y;
+      params[i].distance = d;
+      thHandles[i] = LaunchThread(_decodeWalkThread,params + i);
+    }
+    JoinThreads(thHandles,nbThread);
+    FreeHandles(thHandles,nbThread);
+
+    // Replace invalid kangaroos
+    uint64_t nbWrong = 0;
+    for(int i = 0; i < nbThread; i++)
+      nbWrong += params[i].walkWrong;
+    if(nbWrong > 0) {
+      ::printf("Fetch kangaroos: %.0f invalid kangaroos replaced\n",(double)nbWrong);
+      for(int64_t i = 0; i < n; i++)
+        if(x[i].IsZero())
+          CreateHerd(1,&x[i],&y[i],&d[i],TAME);
+    }
+
+    free(params);
+    free(thHandles);
+    free(walkBuff);
+    walkBuff = NULL;
+
+  }
+
+  for(; n < (int64_t)nbWalk && nbLoadedWalk>0; n++) {
     ::fread(&x[n].bits64,32,1,fRead); x[n].bits64[4] = 0;
     ::fread(&y[n].bits64,32,1,fRead); y[n].bits64[4] = 0;
     ::fread(&d[n].bits64,32,1,fRead); d[n].bits64[4] = 0;
@@ -280,6 +454,10 @@ bool Kangaroo::SaveHeader(string fileName,FILE* f,int type,uint64_t totalCount,d
   // Header
   uint32_t head = type;
   uint32_t version = 0;
+  if(saveKangaroo && compactKangaroo)
+    version |= VERSION_KCOMPACT;
+  if(packTable)
+    version |= VERSION_PACKED;
   if(::fwrite(&head,sizeof(uint32_t),1,f) != 1) {
     ::printf("SaveHeader: Cannot write to %s\n",fileName.c_str());
     ::printf("%s\n",::strerror(errno));
@@ -312,40 +490,122 @@ void  Kangaroo::SaveWork(string fileName,FILE *f,int type,uint64_t totalCount,do
     return;
 
   // Save hash table
-  hashTable.SaveTable(f);
+  if(packTable)
+    hashTable.SaveTable(f,packTable);
+  else
+    DumpTable(fileName,f);
+
+}
+
+// Unpacked hashtable: the offset of each partition is known from nbItem, partitions are
+// serialized by the partition workers and written at their offset (see HashTable::WriteTable)
+bool Kangaroo::DumpTable(string fileName,FILE *f) {
+
+  if(fflush(f) != 0) {
+    ::printf("\nSaveWork: Cannot write to %s\n",fileName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    return false;
+  }
+
+  dumpOffset.resize(MERGE_PART + 1);
+  dumpOffset[0] = FTell(f);
+  for(int p = 0; p < MERGE_PART; p++)
+    dumpOffset[p + 1] = dumpOffset[p] + hashTable.GetTableSize(p * H_PER_PART,(p + 1) * H_PER_PART);
+#ifdef WIN64
+  dumpFd = _fileno(f);
+#else
+  dumpFd = fileno(f);
+#endif
+
+  int nbThread = Timer::getCoreNumber();
+  if(nbThread > MERGE_PART) nbThread = MERGE_PART;
+  if(nbThread < 1) nbThread = 1;
+
+  TH_PARAM job;
+  memset(&job,0,sizeof(TH_PARAM));
+  job.partJob = PART_DUMP;
+  RunPartWorkers(nbThread,&job);
+
+  // Continue after the table
+  FSeek(f,dumpOffset[MERGE_PART]);
+
+  if(job.ioFailed) {
+    ::printf("\nSaveWork: Cannot write to %s\n",fileName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    return false;
+  }
+
+  return true;
 
 }
 
 void Kangaroo::SaveServerWork() {
 
+  // Called from the server thread or from a solver thread which already owns ghMutex
+  if(useJournal && journalSegment < JOURNAL_SNAPSHOT) {
+    AppendJournal(0,0,false);
+    return;
+  }
+
+  // A pending background save would overwrite this one
+  WaitBackgroundSave(true);
+
   saveRequest = true;
 
   double t0 = Timer::get_tick();
 
   string fileName = workFile;
-  if(splitWorkfile)
+  string saveName = workFile;
+  if(splitWorkfile) {
+    // Written as <file>.tmp and renamed when complete, the merge daemon (-wmdaemon)
+    // must never see a partial split file or partition directory
     fileName = workFile + "_" + Timer::getTS();
-
-  FILE *f = fopen(fileName.c_str(),"wb");
-  if(f == NULL) {
-    ::printf("\nSaveWork: Cannot open %s for writing\n",fileName.c_str());
-    ::printf("%s\n",::strerror(errno));
-    saveRequest = false;
-    return;
+    saveName = fileName + ".tmp";
   }
 
-  SaveWork(fileName,f,HEADW,0,0);
+  uint64_t size = 0;
 
-  uint64_t totalWalk = 0;
-  ::fwrite(&totalWalk,sizeof(uint64_t),1,f);
+  if(savePart) {
 
-  uint64_t size = FTell(f);
-  fclose(f);
+    if(!SavePartWork(saveName,&size)) {
+      saveRequest = false;
+      return;
+    }
 
-  if(splitWorkfile)
+  } else {
+
+    FILE *f = fopen(saveName.c_str(),"wb");
+    if(f == NULL) {
+      ::printf("\nSaveWork: Cannot open %s for writing\n",fileName.c_str());
+      ::printf("%s\n",::strerror(errno));
+      saveRequest = false;
+      return;
+    }
+
+    SaveWork(saveName,f,HEADW,0,0);
+
+    uint64_t totalWalk = 0;
+    ::fwrite(&totalWalk,sizeof(uint64_t),1,f);
+
+    size = FTell(f);
+    fclose(f);
+
+  }
+
+  if(splitWorkfile) {
+    if(rename(saveName.c_str(),fileName.c_str()) != 0) {
+      ::printf("\nSaveWork: Cannot rename %s to %s\n",saveName.c_str(),fileName.c_str());
+      ::printf("%s\n",::strerror(errno));
+    }
     hashTable.Reset();
+  }
+
+  if(useJournal)
+    ResetJournal(false);
 
   double t1 = Timer::get_tick();
+  lastSavePause = t1 - t0;
+  totalSavePause += lastSavePause;
 
   char *ctimeBuff;
   time_t now = time(NULL);
@@ -356,48 +616,105 @@ void Kangaroo::SaveServerWork() {
 
 }
 
-void Kangaroo::SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,int nbThread) {
+// ----------------------------------------------------------------------------
+// Partitioned server work file (-wpart): partName is a directory in the layout of
+// -wpartcreate, a header and MERGE_PART files of H_PER_PART buckets. Partitions
+// are written by the partition workers (see RunPartWorkers).
 
-  LOCK(saveMutex);
+bool Kangaroo::SavePartition(TH_PARAM *p) {
 
-  double t0 = Timer::get_tick();
+  string partName = string(p->part1Name);
+  p->ioFailed = true;
 
-  // Wait that all threads blocks before saving works
-  saveRequest = true;
-  int timeout = wtimeout;
-  while(!isWaiting(threads) && timeout>0) {
-    Timer::SleepMillis(50);
-    timeout -= 50;
-  }
+  for(uint32_t part = p->hStart; part < p->hStop; part++) {
+
+    FILE *f = OpenPart(partName,"wb",part,true);
+    if(f == NULL)
+      return false;
+
+    hashTable.SaveTable(f,part * H_PER_PART,(part + 1) * H_PER_PART,false,packTable);
+    bool ok = fflush(f) == 0 && !ferror(f);
+    p->ioSize += FTell(f);
+    if(fclose(f) != 0 || !ok) {
+      ::printf("\nSaveWork: Cannot write to %s\n",GetPartName(partName,part,true).c_str());
+      return false;
+    }
+
+    string oldName = GetPartName(partName,part,true);
+    string newName = GetPartName(partName,part,false);
+    remove(newName.c_str());
+    rename(oldName.c_str(),newName.c_str());
 
-  if(timeout<=0) {
-    // Thread blocked or ended !
-    if(!endOfSearch)
-      ::printf("\nSaveWork timeout !\n");
-    UNLOCK(saveMutex);
-    return;
   }
 
-  string fileName = workFile;
-  if(splitWorkfile)
-    fileName = workFile + "_" + Timer::getTS();
+  p->ioFailed = false;
+  return true;
 
-  // Save
-  FILE *f = fopen(fileName.c_str(),"wb");
+}
+
+bool Kangaroo::SavePartWork(string partName,uint64_t *size) {
+
+  ::printf("\nSaveWork: %s",partName.c_str());
+
+#ifdef WIN64
+  CreateDirectory(partName.c_str(),NULL);
+#else
+  mkdir(partName.c_str(),S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+#endif
+
+  string hName = partName + "/header";
+  FILE *f = fopen(hName.c_str(),"wb");
   if(f == NULL) {
-    ::printf("\nSaveWork: Cannot open %s for writing\n",fileName.c_str());
+    ::printf("\nSaveWork: Cannot open %s for writing\n",hName.c_str());
     ::printf("%s\n",::strerror(errno));
-    UNLOCK(saveMutex);
-    return;
+    return false;
   }
+  if(!SaveHeader(hName,f,HEADW,0,0)) {
+    fclose(f);
+    return false;
+  }
+  *size = FTell(f);
+  fclose(f);
 
-  if (clientMode) {
-    SaveHeader(fileName,f,HEADK,totalCount,totalTime);
-    ::printf("\nSaveWork (Kangaroo): %s",fileName.c_str());
-  } else {
-    SaveWork(fileName,f,HEADW,totalCount,totalTime);
+  int nbThread = Timer::getCoreNumber();
+  if(nbThread > MERGE_PART) nbThread = MERGE_PART;
+  if(nbThread < 1) nbThread = 1;
+
+  TH_PARAM job;
+  memset(&job,0,sizeof(TH_PARAM));
+  job.partJob = PART_SAVE;
+  job.part1Name = _strdup(partName.c_str());
+  RunPartWorkers(nbThread,&job);
+  free(job.part1Name);
+  *size += job.ioSize;
+  bool ok = !job.ioFailed;
+
+  ::printf(" [%d threads] ",nbThread);
+  return ok;
+
+}
+
+// Load a partitioned work file (hashtable only)
+bool Kangaroo::LoadPartWork(string partName,bool packed) {
+
+  for(int part = 0; part < MERGE_PART; part++) {
+    FILE *f = OpenPart(partName,"rb",part);
+    if(f == NULL)
+      return false;
+    bool ok = hashTable.LoadTable(f,part * H_PER_PART,(part + 1) * H_PER_PART,packed);
+    fclose(f);
+    if(!ok) {
+      ::printf("LoadWork: %s is corrupted\n",GetPartName(partName,part,false).c_str());
+      return false;
+    }
   }
 
+  return true;
+
+}
+
+void Kangaroo::SaveWalks(FILE *f,TH_PARAM *threads,int nbThread,bool printPoint) {
+
   uint64_t totalWalk = 0;
 
   if(saveKangaroo) {
@@ -410,13 +727,63 @@ void Kangaroo::SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,i
     uint64_t point = totalWalk / 16;
     uint64_t pointPrint = 0;
 
+    if(compactKangaroo) {
+
+      if(totalWalk == 0)
+        return;
+
+      // Distance width
+      Int mag;
+      bool neg;
+      int dBytes = 1;
+      for(int i = 0; i < nbThread; i++) {
+        for(uint64_t n = 0; n < threads[i].nbKangaroo; n++) {
+          GetWalkDistance(&threads[i].distance[n],&mag,&neg);
+          int l = (mag.GetBitLength() + 7) / 8;
+          if(l > dBytes) dBytes = l;
+        }
+      }
+      uint8_t db = (uint8_t)dBytes;
+      ::fwrite(&db,1,1,f);
+
+      int recSize = 33 + dBytes;
+      uint64_t blockSize = 65536;
+      uint8_t *buff = (uint8_t *)malloc(blockSize * recSize);
+      uint64_t nbRec = 0;
+
+      for(int i = 0; i < nbThread; i++) {
+        for(uint64_t n = 0; n < threads[i].nbKangaroo; n++) {
+          uint8_t *rec = buff + nbRec * recSize;
+          GetWalkDistance(&threads[i].distance[n],&mag,&neg);
+          memcpy(rec,threads[i].px[n].bits64,32);
+          rec[32] = (threads[i].py[n].IsOdd() ? WALK_ODD : 0) | (neg ? WALK_NEG : 0);
+          memcpy(rec + 33,mag.bits64,dBytes);
+          nbRec++;
+          if(nbRec == blockSize) {
+            ::fwrite(buff,recSize,nbRec,f);
+            nbRec = 0;
+          }
+          pointPrint++;
+          if(printPoint && pointPrint>point) {
+            ::printf(".");
+            pointPrint = 0;
+          }
+        }
+      }
+      if(nbRec)
+        ::fwrite(buff,recSize,nbRec,f);
+      free(buff);
+      return;
+
+    }
+
     for(int i = 0; i < nbThread; i++) {
       for(uint64_t n = 0; n < threads[i].nbKangaroo; n++) {
         ::fwrite(&threads[i].px[n].bits64,32,1,f);
         ::fwrite(&threads[i].py[n].bits64,32,1,f);
         ::fwrite(&threads[i].distance[n].bits64,32,1,f);
         pointPrint++;
-        if(pointPrint>point) {
+        if(printPoint && pointPrint>point) {
           ::printf(".");
           pointPrint = 0;
         }
@@ -429,17 +796,252 @@ void Kangaroo::SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,i
 
   }
 
+}
+
+// ----------------------------------------------------------------------------
+// Background save
+// The process is forked while the threads are parked, the child gets a copy-on-write
+// snapshot of the hashtable and of the kangaroos and writes it to fileName.tmp which
+// is renamed on success. The threads are resumed as soon as the fork returns.
+
+bool Kangaroo::ForkSave(string fileName,uint64_t totalCount,double totalTime,TH_PARAM *threads,int nbThread) {
+
+#ifdef WIN64
+
+  return false;
+
+#else
+
+  string tmpName = fileName + ".tmp";
+
+  // Do not duplicate pending output in the child
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    ::printf("\nSaveWork: fork failed, %s\n",::strerror(errno));
+    return false;
+  }
+
+  if(pid == 0) {
+
+    // Child
+    int ret = 1;
+    FILE *f = fopen(tmpName.c_str(),"wb");
+    if(f != NULL) {
+      if(SaveHeader(tmpName,f,clientMode ? HEADK : HEADW,totalCount,totalTime)) {
+        if(!clientMode)
+          hashTable.SaveTable(f,0,HASH_SIZE,false,packTable);
+        SaveWalks(f,threads,nbThread,false);
+        if(fflush(f) == 0 && !ferror(f))
+          ret = 0;
+      }
+      if(fclose(f) != 0)
+        ret = 1;
+      if(ret == 0 && rename(tmpName.c_str(),fileName.c_str()) != 0)
+        ret = 1;
+    }
+    if(ret != 0)
+      remove(tmpName.c_str());
+    fflush(stdout);
+    _exit(ret);
+
+  }
+
+  bgSavePid = (int)pid;
+  bgSaveFile = fileName;
+  bgSaveStart = Timer::get_tick();
+  return true;
+
+#endif
+
+}
+
+bool Kangaroo::WaitBackgroundSave(bool block) {
+
+#ifdef WIN64
+
+  return true;
+
+#else
+
+  if(bgSavePid == 0)
+    return true;
+
+  int status;
+  pid_t r = waitpid((pid_t)bgSavePid,&status,block ? 0 : WNOHANG);
+  if(r == 0)
+    // Still running
+    return false;
+
+  bgSavePid = 0;
+  double t1 = Timer::get_tick();
+
+  if(r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ::printf("\nSaveWork: background save of %s failed\n",bgSaveFile.c_str());
+    return true;
+  }
+
+  // DPs written by the child are no longer needed in the journal
+  if(useJournal)
+    TrimJournal(bgJournalOffset);
+
+  uint64_t size = 0;
+  FILE *f = fopen(bgSaveFile.c_str(),"rb");
+  if(f) {
+    fseek(f,0,SEEK_END);
+    size = FTell(f);
+    fclose(f);
+  }
+
+  char *ctimeBuff;
+  time_t now = time(NULL);
+  ctimeBuff = ctime(&now);
+  ::printf("\nSaveWork: %s done [%.1f MB] [%s] [Pause %.1fms, Total %s] %s",bgSaveFile.c_str(),
+    (double)size / (1024.0*1024.0),GetTimeStr(t1 - bgSaveStart).c_str(),
+    lastSavePause*1000.0,GetTimeStr(totalSavePause).c_str(),ctimeBuff);
+
+  return true;
+
+#endif
+
+}
+
+void Kangaroo::SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,int nbThread) {
+
+  if(useJournal && journalSegment < JOURNAL_SNAPSHOT) {
+    // No need to stop the threads for a journal segment
+    AppendJournal(totalCount,totalTime);
+    return;
+  }
+
+  if(saveBackground && !WaitBackgroundSave(false)) {
+    // Previous snapshot is still being written
+    if(useJournal)
+      AppendJournal(totalCount,totalTime);
+    else
+      ::printf("\nSaveWork: background save of %s still running, skipped\n",bgSaveFile.c_str());
+    return;
+  }
+
+  LOCK(saveMutex);
+
+  double t0 = Timer::get_tick();
+
+  // Wait that all threads blocks before saving works
+  saveRequest = true;
+  int timeout = wtimeout;
+  while(!isWaiting(threads) && timeout>0) {
+    Timer::SleepMillis(50);
+    timeout -= 50;
+  }
+
+  if(timeout<=0) {
+    // Thread blocked or ended !
+    if(!endOfSearch)
+      ::printf("\nSaveWork timeout !\n");
+    UNLOCK(saveMutex);
+    return;
+  }
+
+  string fileName = workFile;
+  if(splitWorkfile)
+    fileName = workFile + "_" + Timer::getTS();
+
+  if(saveBackground) {
+
+    uint64_t jOffset = 0;
+    if(useJournal) {
+      // Journal segments appended from now on are not in the snapshot
+      FILE *fj = fopen((workFile + ".jnl").c_str(),"rb");
+      if(fj) {
+        fseek(fj,0,SEEK_END);
+        jOffset = FTell(fj);
+        fclose(fj);
+      }
+    }
+
+    if(ForkSave(fileName,totalCount,totalTime,threads,nbThread)) {
+
+      if(splitWorkfile)
+        hashTable.Reset();
+
+      if(clientMode)
+        ResetAck(false);
+
+      if(useJournal) {
+        if(jOffset == 0) {
+          // No journal yet
+          ResetJournal();
+        } else {
+          LOCK(ghMutex);
+          journalDP.clear();
+          UNLOCK(ghMutex);
+          journalSegment = 0;
+        }
+        bgJournalOffset = jOffset;
+      }
+
+      // Unblock threads
+      saveRequest = false;
+      UNLOCK(saveMutex);
+
+      lastSavePause = Timer::get_tick() - t0;
+      totalSavePause += lastSavePause;
+      ::printf("\nSaveWork (background): %s [Pause %.1fms]",fileName.c_str(),lastSavePause*1000.0);
+      return;
+
+    }
+
+    // Fork failed, save synchronously
+
+  }
+
+  // Save (split files are renamed when complete, see SaveServerWork)
+  string saveName = splitWorkfile ? fileName + ".tmp" : fileName;
+  FILE *f = fopen(saveName.c_str(),"wb");
+  if(f == NULL) {
+    ::printf("\nSaveWork: Cannot open %s for writing\n",saveName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    UNLOCK(saveMutex);
+    return;
+  }
+
+  if (clientMode) {
+    SaveHeader(fileName,f,HEADK,totalCount,totalTime);
+    ::printf("\nSaveWork (Kangaroo): %s",fileName.c_str());
+    if(ackSuppressed > 0)
+      ::printf(" [%.0f DP already sent]",(double)ackSuppressed);
+  } else {
+    SaveWork(saveName,f,HEADW,totalCount,totalTime);
+  }
+
+  SaveWalks(f,threads,nbThread,true);
+
   uint64_t size = FTell(f);
   fclose(f);
 
-  if(splitWorkfile)
+  if(splitWorkfile) {
+    if(rename(saveName.c_str(),fileName.c_str()) != 0) {
+      ::printf("\nSaveWork: Cannot rename %s to %s\n",saveName.c_str(),fileName.c_str());
+      ::printf("%s\n",::strerror(errno));
+    }
     hashTable.Reset();
+  }
+
+  if(clientMode)
+    ResetAck(false);
+
+  if(useJournal)
+    ResetJournal();
 
   // Unblock threads
   saveRequest = false;
   UNLOCK(saveMutex);
 
   double t1 = Timer::get_tick();
+  lastSavePause = t1 - t0;
+  totalSavePause += lastSavePause;
 
   char *ctimeBuff;
   time_t now = time(NULL);
@@ -448,6 +1050,261 @@ void Kangaroo::SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,i
 
 }
 
+// ----------------------------------------------------------------------------
+// DP journal
+// A journal file starts with HEADJ and a version, then segments are appended:
+// [nbDP][totalCount][totalTime] followed by nbDP DP records
+
+void Kangaroo::ResetJournal(bool lock) {
+
+  string jName = workFile + ".jnl";
+
+  if(lock) LOCK(ghMutex);
+  journalDP.clear();
+  if(lock) UNLOCK(ghMutex);
+
+  FILE *f = fopen(jName.c_str(),"wb");
+  if(f == NULL) {
+    ::printf("\nResetJournal: Cannot open %s for writing\n",jName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    return;
+  }
+
+  uint32_t head = HEADJ;
+  uint32_t version = 0;
+  ::fwrite(&head,sizeof(uint32_t),1,f);
+  ::fwrite(&version,sizeof(uint32_t),1,f);
+  fclose(f);
+
+  journalSegment = 0;
+
+}
+
+// Remove the segments located before offset (already in the work file)
+void Kangaroo::TrimJournal(uint64_t offset) {
+
+  string jName = workFile + ".jnl";
+  string tmpName = jName + ".tmp";
+  uint64_t headSize = 2 * sizeof(uint32_t);
+
+  if(offset <= headSize)
+    return;
+
+  FILE *f = fopen(jName.c_str(),"rb");
+  if(f == NULL)
+    return;
+
+  FILE *fd = fopen(tmpName.c_str(),"wb");
+  if(fd == NULL) {
+    ::printf("\nTrimJournal: Cannot open %s for writing\n",tmpName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    fclose(f);
+    return;
+  }
+
+  uint32_t head = HEADJ;
+  uint32_t version = 0;
+  ::fwrite(&head,sizeof(uint32_t),1,fd);
+  ::fwrite(&version,sizeof(uint32_t),1,fd);
+
+  FSeek(f,offset);
+  char buff[65536];
+  size_t nb;
+  while((nb = ::fread(buff,1,sizeof(buff),f)) > 0)
+    ::fwrite(buff,1,nb,fd);
+
+  fclose(f);
+  fclose(fd);
+
+  remove(jName.c_str());
+  rename(tmpName.c_str(),jName.c_str());
+
+}
+
+bool Kangaroo::AppendJournal(uint64_t totalCount,double totalTime,bool lock) {
+
+  double t0 = Timer::get_tick();
+  string jName = workFile + ".jnl";
+
+  // Get back new DPs
+  vector<DP> dps;
+  if(lock) LOCK(ghMutex);
+  dps.swap(journalDP);
+  if(lock) UNLOCK(ghMutex);
+
+  ::printf("\nSaveWork (journal): %s",jName.c_str());
+
+  FILE *f = fopen(jName.c_str(),"ab");
+  if(f == NULL) {
+    ::printf("\nAppendJournal: Cannot open %s for writing\n",jName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    // Keep DPs for next segment
+    if(lock) LOCK(ghMutex);
+    journalDP.insert(journalDP.end(),dps.begin(),dps.end());
+    if(lock) UNLOCK(ghMutex);
+    return false;
+  }
+
+  uint32_t nbDP = (uint32_t)dps.size();
+  ::fwrite(&nbDP,sizeof(uint32_t),1,f);
+  ::fwrite(&totalCount,sizeof(uint64_t),1,f);
+  ::fwrite(&totalTime,sizeof(double),1,f);
+  if(nbDP)
+    ::fwrite(dps.data(),sizeof(DP),nbDP,f);
+  uint64_t size = FTell(f);
+  fclose(f);
+
+  journalSegment++;
+
+  double t1 = Timer::get_tick();
+
+  char *ctimeBuff;
+  time_t now = time(NULL);
+  ctimeBuff = ctime(&now);
+  ::printf(" [%d DP] done [%.1f MB] [%s] %s",nbDP,(double)size / (1024.0*1024.0),GetTimeStr(t1 - t0).c_str(),ctimeBuff);
+
+  return true;
+
+}
+
+void Kangaroo::ReplayJournal(std::string fileName) {
+
+  string jName = fileName + ".jnl";
+
+  FILE *f = fopen(jName.c_str(),"rb");
+  if(f == NULL)
+    return;
+
+  uint32_t head = 0;
+  uint32_t version;
+  if(::fread(&head,sizeof(uint32_t),1,f) != 1 || head != HEADJ) {
+    ::printf("ReplayJournal: %s is not a journal file\n",jName.c_str());
+    fclose(f);
+    return;
+  }
+  ::fread(&version,sizeof(uint32_t),1,f);
+
+  uint32_t nbSegment = 0;
+  uint64_t nbDP = 0;
+  uint32_t nb;
+  uint64_t count;
+  double time;
+  DP *dp = NULL;
+
+  while(::fread(&nb,sizeof(uint32_t),1,f) == 1) {
+
+    if(::fread(&count,sizeof(uint64_t),1,f) != 1 ||
+       ::fread(&time,sizeof(double),1,f) != 1)
+      break;
+
+    dp = (DP *)realloc(dp,sizeof(DP) * (nb + 1));
+    if(::fread(dp,sizeof(DP),nb,f) != nb) {
+      // Segment not completed (crash during save)
+      ::printf("ReplayJournal: Warning, truncated segment #%d ignored\n",nbSegment);
+      break;
+    }
+
+    for(uint32_t i = 0; i < nb; i++)
+      hashTable.Add(dp[i].h,&dp[i].x,&dp[i].d);
+
+    if(count > 0) {
+      offsetCount = count;
+      offsetTime = time;
+    }
+
+    nbDP += nb;
+    nbSegment++;
+
+  }
+
+  safe_free(dp);
+  fclose(f);
+
+  if(nbDP > 0)
+    ::printf("ReplayJournal: %s [%d segments] [2^%.2f DP]\n",jName.c_str(),nbSegment,log2((double)nbDP));
+  else
+    ::printf("ReplayJournal: %s [%d segments] [0 DP]\n",jName.c_str(),nbSegment);
+
+}
+
+void Kangaroo::CompactWork(std::string &fileName) {
+
+  double t0 = Timer::get_tick();
+
+  ::printf("Loading: %s\n",fileName.c_str());
+
+  uint32_t version;
+  FILE *f1 = ReadHeader(fileName,&version,HEADW);
+  if(f1 == NULL)
+    return;
+
+  uint32_t dp1;
+  Point k1;
+
+  // Read global param
+  ::fread(&dp1,sizeof(uint32_t),1,f1);
+  ::fread(&rangeStart.bits64,32,1,f1); rangeStart.bits64[4] = 0;
+  ::fread(&rangeEnd.bits64,32,1,f1); rangeEnd.bits64[4] = 0;
+  ::fread(&k1.x.bits64,32,1,f1); k1.x.bits64[4] = 0;
+  ::fread(&k1.y.bits64,32,1,f1); k1.y.bits64[4] = 0;
+  ::fread(&offsetCount,sizeof(uint64_t),1,f1);
+  ::fread(&offsetTime,sizeof(double),1,f1);
+
+  k1.z.SetInt32(1);
+  if(!secp->EC(k1)) {
+    ::printf("CompactWork: key1 does not lie on elliptic curve\n");
+    fclose(f1);
+    return;
+  }
+
+  keysToSearch.clear();
+  keysToSearch.push_back(k1);
+  keyIdx = 0;
+  dpSize = dp1;
+
+  if(!hashTable.LoadTable(f1,(version & VERSION_PACKED) != 0)) {
+    ::printf("CompactWork: %s is corrupted\n",fileName.c_str());
+    fclose(f1);
+    return;
+  }
+  ReplayJournal(fileName);
+
+  // Write the new snapshot, kangaroos are copied as is
+  string tmpName = fileName + ".tmp";
+  FILE *f = fopen(tmpName.c_str(),"wb");
+  if(f == NULL) {
+    ::printf("CompactWork: Cannot open %s for writing\n",tmpName.c_str());
+    ::printf("%s\n",::strerror(errno));
+    fclose(f1);
+    return;
+  }
+
+  // The kangaroo section is copied as is, keep its format
+  saveKangaroo = true;
+  compactKangaroo = (version & VERSION_KCOMPACT) != 0;
+  packTable = packTable || (version & VERSION_PACKED);
+  SaveWork(tmpName,f,HEADW,offsetCount,offsetTime);
+
+  char *buff = (char *)malloc(1024 * 1024);
+  size_t nbRead;
+  while((nbRead = ::fread(buff,1,1024 * 1024,f1)) > 0)
+    ::fwrite(buff,1,nbRead,f);
+  free(buff);
+
+  uint64_t size = FTell(f);
+  fclose(f);
+  fclose(f1);
+
+  remove(fileName.c_str());
+  rename(tmpName.c_str(),fileName.c_str());
+  string jName = fileName + ".jnl";
+  remove(jName.c_str());
+
+  double t1 = Timer::get_tick();
+  ::printf("done [%.1f MB] [%s]\n",(double)size / (1024.0*1024.0),GetTimeStr(t1 - t0).c_str());
+
+}
+
 void Kangaroo::WorkInfo(std::string &fName) {
 
   int isDir = IsDir(fName);
@@ -497,11 +1354,11 @@ void Kangaroo::WorkInfo(std::string &fName) {
   if(isDir) {
     for(int i = 0; i < MERGE_PART; i++) {
       FILE* f = OpenPart(fName,"rb",i);
-      hashTable.SeekNbItem(f,i * H_PER_PART,(i + 1) * H_PER_PART);
+      hashTable.SeekNbItem(f,i * H_PER_PART,(i + 1) * H_PER_PART,(version & VERSION_PACKED) != 0);
       fclose(f);
     }
   } else {
-    hashTable.SeekNbItem(f1);
+    hashTable.SeekNbItem(f1,false,(version & VERSION_PACKED) != 0);
   }
 
   ::printf("Version   : %d\n",version);
@@ -582,14 +1439,24 @@ void Kangaroo::WorkExport(std::string &fileName) {
   }
 
   // Read DP
+  bool packed = (version & VERSION_PACKED) != 0;
+  vector<ENTRY> buff;
   for(uint32_t h = 0; h < HASH_SIZE; h++) {
 
     fread(&items,sizeof(uint32_t),1,f1);
     fread(&maxItems,sizeof(uint32_t),1,f1);
+    buff.resize(items + 1);
+    if(!HashTable::ReadItems(f1,packed,items,buff.data())) {
+      ::printf("WorkExport: %s is corrupted (bucket %d)\n",fileName.c_str(),h);
+      fclose(ft);
+      fclose(fw);
+      fclose(f1);
+      return;
+    }
 
     for(uint32_t i = 0; i < items; i++) {
-      fread(&x,16,1,f1);
-      fread(&d,16,1,f1);
+      x = buff[i].x;
+      d = buff[i].d;
       sign = (d.i64[1] & 0x8000000000000000);
       htype = (d.i64[1] & 0x4000000000000000);
 
@@ -30,75 +30,80 @@
 
 using namespace std;
 
-uint32_t Kangaroo::CheckHash(uint32_t h,uint32_t nbItem,HashTable* hT,FILE* f) {
+// Points of kangaroos from their distance and type: d.G (tame) or key + d.G (wild)
+vector<Point> Kangaroo::EntryPoints(vector<int128_t> &d,vector<Point *> &keys) {
 
-  bool ok=true;
   vector<Int> dists;
   vector<uint32_t> types;
   Point Z;
   Z.Clear();
-  uint32_t nbWrong = 0;
-  ENTRY *items = NULL;
-  ENTRY* e;
-
-  if( hT ) {
-
-    for(uint32_t i = 0; i < nbItem; i++) {
-      e = hT->E[h].items[i];
-      Int dist;
-      uint32_t kType;
-      HashTable::CalcCollision(e->d,&dist,&kType);
-      dists.push_back(dist);
-      types.push_back(kType);
-    }
-
-  } else {
-
-    items = (ENTRY*)malloc(nbItem * sizeof(ENTRY));
-
-    for(uint32_t i = 0; i < nbItem; i++) {
-      ::fread(items+i,32,1,f);
-      e = items + i;
-      Int dist;
-      uint32_t kType;
-      HashTable::CalcCollision(e->d,&dist,&kType);
-      dists.push_back(dist);
-      types.push_back(kType);
-    }
 
+  for(size_t i = 0; i < d.size(); i++) {
+    Int dist;
+    uint32_t kType;
+    HashTable::CalcCollision(d[i],&dist,&kType);
+    dists.push_back(dist);
+    types.push_back(kType);
   }
 
   vector<Point> P = secp->ComputePublicKeys(dists);
   vector<Point> Sp;
 
-  for(uint32_t i = 0; i < nbItem; i++) {
+  for(size_t i = 0; i < d.size(); i++) {
 
     if(types[i] == TAME) {
       Sp.push_back(Z);
     } else {
-      Sp.push_back(keyToSearch);
+      Sp.push_back(*keys[i]);
     }
 
   }
 
-  vector<Point> S = secp->AddDirect(Sp,P);
+  return secp->AddDirect(Sp,P);
 
-  for(uint32_t i = 0; i < nbItem; i++) {
+}
+
+// An entry (h,x) matches the point S
+static bool IsEntryPoint(Point &S,uint32_t h,int128_t *x) {
+
+  uint32_t hC = S.x.bits64[2] & HASH_MASK;
+  return (hC == h) && (S.x.bits64[0] == x->i64[0]) && (S.x.bits64[1] == x->i64[1]);
+
+}
+
+// Number of wrong DP of bucket h, read from f when hT is NULL (*readOk is false if the bucket is corrupted)
+uint32_t Kangaroo::CheckHash(uint32_t h,uint32_t nbItem,HashTable* hT,FILE* f,bool packed,bool *readOk) {
+
+  vector<int128_t> d;
+  vector<Point *> keys;
+  uint32_t nbWrong = 0;
+  ENTRY *items = NULL;
+  ENTRY* e;
+
+  if( !hT ) {
+    items = (ENTRY*)malloc(nbItem * sizeof(ENTRY));
+    if(!HashTable::ReadItems(f,packed,nbItem,items)) {
+      free(items);
+      if(readOk) *readOk = false;
+      return 0;
+    }
+  }
 
+  for(uint32_t i = 0; i < nbItem; i++) {
     if(hT)    e = hT->E[h].items[i];
     else      e = items + i;
+    d.push_back(e->d);
+    keys.push_back(&keyToSearch);
+  }
 
-    uint32_t hC = S[i].x.bits64[2] & HASH_MASK;
-    ok = (hC == h) && (S[i].x.bits64[0] == e->x.i64[0]) && (S[i].x.bits64[1] == e->x.i64[1]);
-    if(!ok) nbWrong++;
-    //if(!ok) {
-    //  ::printf("\nCheckWorkFile wrong at: %06X [%d]\n",h,i);
-    //  ::printf("X=%s\n",S[i].x.GetBase16().c_str());
-    //  ::printf("X=%08X%08X%08X%08X\n",e->x.i32[3],e->x.i32[2],e->x.i32[1],e->x.i32[0]);
-    //  ::printf("D=%08X%08X%08X%08X\n",e->d.i32[3],e->d.i32[2],e->d.i32[1],e->d.i32[0]);
-    //  exit(0);
-    //}
+  vector<Point> S = EntryPoints(d,keys);
+
+  for(uint32_t i = 0; i < nbItem; i++) {
+
+    if(hT)    e = hT->E[h].items[i];
+    else      e = items + i;
 
+    if(!IsEntryPoint(S[i],h,&e->x)) nbWrong++;
 
   }
 
@@ -107,6 +112,119 @@ uint32_t Kangaroo::CheckHash(uint32_t h,uint32_t nbItem,HashTable* hT,FILE* f) {
 
 }
 
+// ----------------------------------------------------------------------------
+// Sampled validation of client DPs (server): a fraction of the DPs of each client
+// (all of them for a new client) is queued when received, the validation threads
+// compute the points again and a client over the error rate is quarantined.
+
+// Queue samples of a request, false if the client is quarantined
+bool Kangaroo::SampleDP(const char *info,Kangaroo *job,DP *dp,uint32_t nbDP) {
+
+  if(validRate <= 0.0 || relayMode || job == NULL || nbDP == 0)
+    return true;
+
+  LOCK(validMutex);
+
+  VALID_STAT &s = validStat[info];
+  if(s.quarantined) {
+    UNLOCK(validMutex);
+    return false;
+  }
+
+  uint32_t nbFirst = 0;
+  if(s.nbSampled < VALID_FIRST)
+    nbFirst = (uint32_t)(std::min)((uint64_t)nbDP,VALID_FIRST - s.nbSampled);
+  s.credit += (double)(nbDP - nbFirst) * validRate;
+  uint32_t nbSample = nbFirst + (uint32_t)s.credit;
+  s.credit -= (double)(nbSample - nbFirst);
+  if(nbSample > nbDP) nbSample = nbDP;
+
+  // Samples are dropped when the validation threads are late
+  if(nbSample > 0 && validQueue.size() + nbSample <= VALID_QUEUE_SIZE) {
+    for(uint32_t i = 0; i < nbSample; i++) {
+      VALID_DP v;
+      v.dp = dp[(uint64_t)i * nbDP / nbSample];
+      v.job = job;
+      strncpy(v.info,info,sizeof(v.info) - 1);
+      v.info[sizeof(v.info) - 1] = 0;
+      validQueue.push_back(v);
+    }
+    s.nbSampled += nbSample;
+  }
+
+  UNLOCK(validMutex);
+  return true;
+
+}
+
+// Connection closed, pending samples of this client are ignored
+void Kangaroo::ForgetClient(const char *info) {
+
+  if(validRate <= 0.0)
+    return;
+
+  LOCK(validMutex);
+  validStat.erase(info);
+  UNLOCK(validMutex);
+
+}
+
+// Validation thread
+void Kangaroo::ValidateDP(TH_PARAM* p) {
+
+  vector<VALID_DP> batch;
+  vector<int128_t> d;
+  vector<Point *> keys;
+
+  while(!endOfSearch) {
+
+    LOCK(validMutex);
+    size_t n = (std::min)(validQueue.size(),(size_t)VALID_BATCH);
+    // Oldest first, so that the first DPs of a new client are not starved by later traffic
+    batch.assign(validQueue.begin(),validQueue.begin() + n);
+    validQueue.erase(validQueue.begin(),validQueue.begin() + n);
+    UNLOCK(validMutex);
+
+    if(n == 0) {
+      Timer::SleepMillis(50);
+      continue;
+    }
+
+    d.clear();
+    keys.clear();
+    for(size_t i = 0; i < n; i++) {
+      d.push_back(batch[i].dp.d);
+      keys.push_back(&batch[i].job->keyToSearch);
+    }
+    vector<Point> S = EntryPoints(d,keys);
+
+    LOCK(validMutex);
+    for(size_t i = 0; i < n; i++) {
+
+      bool ok = IsEntryPoint(S[i],batch[i].dp.h,&batch[i].dp.x);
+      validChecked++;
+      if(!ok) validWrong++;
+
+      std::map<std::string,VALID_STAT>::iterator it = validStat.find(batch[i].info);
+      if(it == validStat.end())
+        continue;
+      VALID_STAT &s = it->second;
+      s.nbChecked++;
+      if(!ok) s.nbWrong++;
+      if(!s.quarantined && s.nbChecked >= VALID_MIN_CHECK && (double)s.nbWrong > validMaxError * (double)s.nbChecked) {
+        s.quarantined = true;
+        validQuarantined++;
+        ::printf("\nClient %s quarantined: %.0f/%.0f invalid DP (wrong range or key ?)\n",
+                 batch[i].info,(double)s.nbWrong,(double)s.nbChecked);
+      }
+
+    }
+    UNLOCK(validMutex);
+
+  }
+
+}
+
 bool Kangaroo::CheckPartition(TH_PARAM* p) {
 
   uint32_t part = p->hStart;
@@ -128,7 +246,13 @@ bool Kangaroo::CheckPartition(TH_PARAM* p) {
 
     if(nbItem == 0)
       continue;
-    p->hStop += CheckHash(h,nbItem,NULL,f1);
+    bool readOk = true;
+    p->hStop += CheckHash(h,nbItem,NULL,f1,p->part1Packed,&readOk);
+    if(!readOk) {
+      ::printf("\nCheckPartition: %s is corrupted\n",GetPartName(pName,part,false).c_str());
+      ::fclose(f1);
+      return false;
+    }
     p->hStart += nbItem;
 
   }
@@ -157,17 +281,6 @@ bool Kangaroo::CheckWorkFile(TH_PARAM* p) {
 }
 
 // Threaded proc
-#ifdef WIN64
-DWORD WINAPI _checkPartThread(LPVOID lpParam) {
-#else
-void* _checkPartThread(void* lpParam) {
-#endif
-  TH_PARAM* p = (TH_PARAM*)lpParam;
-  p->obj->CheckPartition(p);
-  p->isRunning = false;
-  return 0;
-}
-
 #ifdef WIN64
 DWORD WINAPI _checkWorkThread(LPVOID lpParam) {
 #else
@@ -227,46 +340,27 @@ void Kangaroo::CheckPartition(int nbCore,std::string& partName) {
   InitRange();
   InitSearchKey();
 
-  int l2 = (int)log2(nbCore);
-  int nbThread = (int)pow(2.0,l2);
+  int nbThread = nbCore;
   if(nbThread > MERGE_PART) nbThread = MERGE_PART;
+  if(nbThread < 1) nbThread = 1;
 
   ::printf("Thread: %d\n",nbThread);
   ::printf("CheckingPart");
 
-  TH_PARAM* params = (TH_PARAM*)malloc(nbThread * sizeof(TH_PARAM));
-  THREAD_HANDLE* thHandles = (THREAD_HANDLE*)malloc(nbThread * sizeof(THREAD_HANDLE));
-  memset(params,0,nbThread * sizeof(TH_PARAM));
-  uint64_t nbDP = 0;
-  uint64_t nbWrong = 0;
-
-  for(int p = 0; p < MERGE_PART; p += nbThread) {
-
-    printf(".");
-
-    for(int i = 0; i < nbThread; i++) {
-      params[i].threadId = i;
-      params[i].isRunning = true;
-      params[i].hStart = p + i;
-      params[i].hStop = 0;
-      params[i].part1Name = _strdup(partName.c_str());
-      thHandles[i] = LaunchThread(_checkPartThread,params + i);
-    }
-
-    JoinThreads(thHandles,nbThread);
-    FreeHandles(thHandles,nbThread);
-
-    for(int i = 0; i < nbThread; i++) {
-      free(params[i].part1Name);
-      nbDP += params[i].hStart;
-      nbWrong += params[i].hStop;
-    }
-
+  TH_PARAM job;
+  memset(&job,0,sizeof(TH_PARAM));
+  job.partJob = PART_CHECK;
+  job.part1Name = _strdup(partName.c_str());
+  job.part1Packed = (v1 & VERSION_PACKED) != 0;
+  RunPartWorkers(nbThread,&job);
+  free(job.part1Name);
+  uint64_t nbDP = job.partDP;
+  uint64_t nbWrong = job.partWrong;
+  if(job.ioFailed) {
+    ::printf("\nCheckPartition: %s cannot be checked\n",partName.c_str());
+    return;
   }
 
-  free(params);
-  free(thHandles);
-
   t1 = Timer::get_tick();
 
   double O = (double)nbWrong / (double)nbDP;
@@ -364,7 +458,15 @@ void Kangaroo::CheckWorkFile(int nbCore,std::string& fileName) {
     uint32_t E = s + block;
 
     // Load hashtables
-    hashTable.LoadTable(f1,S,E);
+    hashTable.Reset();
+    if(!hashTable.LoadTable(f1,S,E,(v1 & VERSION_PACKED) != 0)) {
+      ::printf("\nCheckWorkFile: %s is corrupted\n",fileName.c_str());
+      hashTable.Reset();
+      ::fclose(f1);
+      free(params);
+      free(thHandles);
+      return;
+    }
 
     int stride = block / nbThread;
 
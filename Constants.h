@@ -38,13 +38,91 @@
 #define TAME 0  // Tame kangaroo
 #define WILD 1  // Wild kangaroo
 
-// SendDP Period in sec
+// Maximum time a DP waits on the client before being sent (sec), also the server status period
 #define SEND_PERIOD 2.0
 
+// Period at which solver threads hand their DP to the sender thread (sec)
+#define QUEUE_PERIOD 0.2
+
+// A client sends a batch once it reaches the server target size, at most one batch
+// every BATCH_RTT_FACTOR measured round trips
+#define BATCH_RTT_FACTOR 4.0
+#define BATCH_DEFAULT 4096      // Target when the server does not advertise one (version<6)
+#define BATCH_REFRESH 10.0      // Period at which the client asks for the target (sec)
+
+// The server sizes the target batch so that all clients together make about
+// SERVER_REQUEST_RATE requests per second
+#define SERVER_REQUEST_RATE 200.0
+#define BATCH_TARGET_MIN 256
+#define BATCH_TARGET_MAX (1<<20)
+
+// Server main loop period (sec)
+#define SERVER_TICK 0.1
+
+// A client with a failover list (-c host1:port1,host2:port2) keeps the DP sent to the current
+// server until it reports them streamed to its standbys (asked every FAILOVER_ACK_PERIOD seconds,
+// at most FAILOVER_REPLAY_MAX DP kept), and sends them again to a new server
+#define FAILOVER_ACK_PERIOD 1.0
+#define FAILOVER_REPLAY_MAX (1<<22)
+
+// A primary server keeps at most REPL_BACKLOG DP for an unreachable standby and
+// retries to connect every REPL_RETRY seconds
+#define REPL_BACKLOG (1<<22)
+#define REPL_RETRY 5.0
+
+// A client of a sharded server retries a shard which is down (or in backup) every SHARD_RETRY
+// seconds, the DP of the other shards are still sent
+#define SHARD_RETRY 1.0
+
+// Shared memory ring (-shm), number of DP cells and maximum number of DP read at once
+#define SHM_RING_SIZE (1<<20)
+#define SHM_READ_MAX (1<<16)
+#define SHM_CHECK 1.0
+
+// Maximum number of DP waiting for the client sender thread before spilling to disk
+#define SEND_QUEUE_SIZE (1<<20)
+
+// Number of spilled DP read back per request
+#define SPILL_CHUNK (1<<16)
+
+// Number of server insert threads, each one owns a range of hash buckets
+#define SERVER_INSERT 4
+
+// Sampled validation of client DPs (-vs, -vq): default fraction of DP validated (0: disabled), default maximum
+// error rate, number of DP of a new client always validated, minimum number of validated DP before
+// a client can be quarantined, validation threads, DP per validation batch, maximum DP waiting
+#define VALID_RATE 0.0
+#define VALID_MAX_ERROR 0.05
+#define VALID_FIRST 64
+#define VALID_MIN_CHECK 16
+#define VALID_THREAD 2
+#define VALID_BATCH 256
+#define VALID_QUEUE_SIZE (1<<16)
+
+// Number of DP waiting for insertion above which clients are asked to wait
+#define INSERT_QUEUE_SIZE (1<<24)
+
 // Timeout before closing connection idle client in sec
 #define CLIENT_TIMEOUT 3600.0
 
 // Number of merge partition
 #define MERGE_PART 256
 
+// Maximum number of work files opened at once by a k-way merge (-wmdir)
+#define MERGE_MAX_FILE 128
+
+// Partition worker jobs
+#define PART_MERGE 0
+#define PART_CHECK 1
+#define PART_SAVE  2
+#define PART_DUMP  3
+
+// Merge daemon: polling period (sec), age of a work file before merging it (sec), default I/O limit (MB/s)
+#define MERGE_DAEMON_PERIOD 10.0
+#define MERGE_DAEMON_SETTLE 30.0
+#define MERGE_DAEMON_RATE 64.0
+
+// Number of journal segments between 2 full work file snapshots (-wj)
+#define JOURNAL_SNAPSHOT 16
+
 #endif //CONSTANTSH
@@ -18,8 +18,12 @@
 #include "HashTable.h"
 #include <stdio.h>
 #include <math.h>
+#include <queue>
 #ifndef WIN64
 #include <string.h>
+#include <unistd.h>
+#else
+#include <io.h>
 #endif
 
 #define GET(hash,id) E[hash].items[id]
@@ -44,6 +48,17 @@ void HashTable::Reset() {
 
 }
 
+// Remove all entries, bucket arrays are kept for the next key
+void HashTable::Clear() {
+
+  for(uint32_t h = 0; h < HASH_SIZE; h++) {
+    for(uint32_t i = 0; i<E[h].nbItem; i++)
+      free(E[h].items[i]);
+    E[h].nbItem = 0;
+  }
+
+}
+
 uint64_t HashTable::GetNbItem() {
 
   uint64_t totalItem = 0;
@@ -100,10 +115,11 @@ void HashTable::Convert(Int *x,Int *d,uint32_t type,uint64_t *h,int128_t *X,int1
 }
 
 
-#define AV1() if(pnb1) { ::fread(&e1,32,1,f1); pnb1--; }
-#define AV2() if(pnb2) { ::fread(&e2,32,1,f2); pnb2--; }
+#define AV1() if(pnb1) { e1 = items1[nb1 - pnb1]; pnb1--; }
+#define AV2() if(pnb2) { e2 = items2[nb2 - pnb2]; pnb2--; }
 
-int HashTable::MergeH(uint32_t h,FILE* f1,FILE* f2,FILE* fd,uint32_t* nbDP,uint32_t *duplicate,Int* d1,uint32_t* k1,Int* d2,uint32_t* k2) {
+int HashTable::MergeH(uint32_t h,FILE* f1,bool packed1,FILE* f2,bool packed2,FILE* fd,bool packedd,
+                      uint32_t* nbDP,uint32_t *duplicate,Int* d1,uint32_t* k1,Int* d2,uint32_t* k2) {
 
   // Merge by line
   // N comparison but avoid slow item allocation
@@ -134,6 +150,14 @@ int HashTable::MergeH(uint32_t h,FILE* f1,FILE* f2,FILE* fd,uint32_t* nbDP,uint3
   }
 
   ENTRY *output = (ENTRY *)malloc( md * sizeof(ENTRY) );
+  ENTRY *items1 = (ENTRY *)malloc( (nb1 + 1) * sizeof(ENTRY) );
+  ENTRY *items2 = (ENTRY *)malloc( (nb2 + 1) * sizeof(ENTRY) );
+  if(!ReadItems(f1,packed1,nb1,items1) || !ReadItems(f2,packed2,nb2,items2)) {
+    free(output);
+    free(items1);
+    free(items2);
+    return ADD_ERROR;
+  }
 
   ENTRY e1;
   ENTRY e2;
@@ -210,14 +234,127 @@ int HashTable::MergeH(uint32_t h,FILE* f1,FILE* f2,FILE* fd,uint32_t* nbDP,uint3
 
   ::fwrite(&nbd,sizeof(uint32_t),1,fd);
   ::fwrite(&md,sizeof(uint32_t),1,fd);
-  ::fwrite(output,32,nbd,fd);
+  WriteItems(fd,packedd,nbd,output);
   free(output);
+  free(items1);
+  free(items2);
 
   *nbDP = nbd;
   return (collisionFound?ADD_COLLISION:ADD_OK);
 
 }
 
+// Cursor on a bucket loaded from one of the k merged files
+typedef struct {
+  ENTRY    *items;
+  uint32_t  pos;
+  uint32_t  nbItem;
+} MERGE_CURSOR;
+
+struct MergeCursorGreater {
+  bool operator()(const MERGE_CURSOR *c1,const MERGE_CURSOR *c2) const {
+    return HashTable::compare(&c1->items[c1->pos].x,&c2->items[c2->pos].x) > 0;
+  }
+};
+
+int HashTable::MergeHN(uint32_t h,std::vector<FILE*>& f,std::vector<bool>& packed,FILE* fd,bool packedd,
+                       uint32_t* nbDP,uint32_t* duplicate,Int* d1,uint32_t* k1,Int* d2,uint32_t* k2) {
+
+  // k-way merge of the bucket h of all files through a min heap on x
+  // return ADD_OK or ADD_COLLISION if a COLLISION is detected
+
+  size_t k = f.size();
+  *duplicate = 0;
+  *nbDP = 0;
+
+  std::vector<MERGE_CURSOR> cursors(k);
+  uint32_t md = 0;
+  bool readOk = true;
+
+  for(size_t i = 0; i < k; i++) {
+    uint32_t nb;
+    uint32_t m;
+    ::fread(&nb,sizeof(uint32_t),1,f[i]);
+    ::fread(&m,sizeof(uint32_t),1,f[i]);
+    cursors[i].pos = 0;
+    cursors[i].nbItem = nb;
+    cursors[i].items = NULL;
+    if(nb) {
+      cursors[i].items = (ENTRY *)malloc(nb * sizeof(ENTRY));
+      readOk = ReadItems(f[i],packed[i],nb,cursors[i].items) && readOk;
+    }
+    md += nb;
+  }
+
+  if(!readOk) {
+    for(size_t i = 0; i < k; i++)
+      safe_free(cursors[i].items);
+    return ADD_ERROR;
+  }
+
+  if(md == 0) {
+
+    ::fwrite(&md,sizeof(uint32_t),1,fd);
+    ::fwrite(&md,sizeof(uint32_t),1,fd);
+    return ADD_OK;
+
+  }
+
+  std::priority_queue<MERGE_CURSOR *,std::vector<MERGE_CURSOR *>,MergeCursorGreater> heap;
+  for(size_t i = 0; i < k; i++)
+    if(cursors[i].nbItem) heap.push(&cursors[i]);
+
+  ENTRY *output = (ENTRY *)malloc(md * sizeof(ENTRY));
+  uint32_t nbd = 0;
+  bool collisionFound = false;
+
+  while(!heap.empty()) {
+
+    MERGE_CURSOR *c = heap.top();
+    heap.pop();
+    ENTRY *e = c->items + c->pos;
+
+    if(nbd > 0 && compare(&output[nbd - 1].x,&e->x) == 0) {
+      ENTRY *last = output + (nbd - 1);
+      if((last->d.i64[0] == e->d.i64[0]) && (last->d.i64[1] == e->d.i64[1])) {
+        *duplicate = *duplicate + 1;
+      } else if(!collisionFound) {
+        // Collision
+        CalcCollision(last->d,d1,k1);
+        CalcCollision(e->d,d2,k2);
+        collisionFound = true;
+      }
+    } else {
+      memcpy(output + nbd,e,32);
+      nbd++;
+    }
+
+    c->pos++;
+    if(c->pos < c->nbItem)
+      heap.push(c);
+
+  }
+
+  for(size_t i = 0; i < k; i++)
+    safe_free(cursors[i].items);
+
+  // Round md to next multiple of 4
+  if(nbd % 4 == 0) {
+    md = nbd;
+  } else {
+    md = ((nbd / 4) + 1) * 4;
+  }
+
+  ::fwrite(&nbd,sizeof(uint32_t),1,fd);
+  ::fwrite(&md,sizeof(uint32_t),1,fd);
+  WriteItems(fd,packedd,nbd,output);
+  free(output);
+
+  *nbDP = nbd;
+  return (collisionFound ? ADD_COLLISION : ADD_OK);
+
+}
+
 int HashTable::Add(Int *x,Int *d,uint32_t type) {
 
   int128_t X;
@@ -246,6 +383,16 @@ int HashTable::Add(uint64_t h,int128_t *x,int128_t *d) {
 
 }
 
+int HashTable::Add(uint64_t h,int128_t *x,int128_t *d,Int *cDist,uint32_t *cType) {
+
+  ENTRY *e = CreateEntry(x,d);
+  int addStatus = Add(h,e,cDist,cType);
+  if(addStatus != ADD_OK)
+    free(e);
+  return addStatus;
+
+}
+
 void HashTable::CalcCollision(int128_t d,Int* kDist,uint32_t* kType) {
 
   *kType = (d.i64[1] & 0x4000000000000000ULL) != 0;
@@ -261,6 +408,14 @@ void HashTable::CalcCollision(int128_t d,Int* kDist,uint32_t* kType) {
 
 int HashTable::Add(uint64_t h,ENTRY* e) {
 
+  return Add(h,e,&kDist,&kType);
+
+}
+
+// Collision distance is returned in cDist,cType, threads owning disjoint
+// h ranges can call it concurrently
+int HashTable::Add(uint64_t h,ENTRY* e,Int *cDist,uint32_t *cType) {
+
   if(E[h].maxItem == 0) {
     E[h].maxItem = 16;
     E[h].items = (ENTRY **)malloc(sizeof(ENTRY *) * E[h].maxItem);
@@ -293,7 +448,7 @@ int HashTable::Add(uint64_t h,ENTRY* e) {
       }
 
       // Collision
-      CalcCollision(GET(h,mi)->d , &kDist, &kType);
+      CalcCollision(GET(h,mi)->d , cDist, cType);
       return ADD_COLLISION;
 
     } else {
@@ -344,6 +499,30 @@ std::string HashTable::GetSizeInfo() {
 
 }
 
+// Memory usage and bucket occupancy histogram
+// occupancy[0]: empty buckets, occupancy[i]: buckets with [2^(i-1),2^i-1] items, last bin is open
+void HashTable::GetStats(uint64_t *usedByte,uint64_t *totalByte,uint64_t *occupancy,int nbBin) {
+
+  *totalByte = sizeof(E);
+  *usedByte = HASH_SIZE*2*sizeof(uint32_t);
+  for(int i = 0; i < nbBin; i++)
+    occupancy[i] = 0;
+
+  for(int h = 0; h < HASH_SIZE; h++) {
+    uint32_t nbItem = E[h].nbItem;
+    *totalByte += sizeof(ENTRY *) * E[h].maxItem;
+    *totalByte += sizeof(ENTRY) * nbItem;
+    *usedByte += sizeof(ENTRY) * nbItem;
+    int bin = 0;
+    while(nbItem > 0) {
+      bin++;
+      nbItem >>= 1;
+    }
+    occupancy[(bin < nbBin) ? bin : nbBin - 1]++;
+  }
+
+}
+
 std::string HashTable::GetStr(int128_t *i) {
 
   std::string ret;
@@ -356,18 +535,37 @@ std::string HashTable::GetStr(int128_t *i) {
 
 }
 
-void HashTable::SaveTable(FILE* f) {
-  SaveTable(f,0,HASH_SIZE,true);
+void HashTable::SaveTable(FILE* f,bool packed) {
+  SaveTable(f,0,HASH_SIZE,true,packed);
 }
 
-void HashTable::SaveTable(FILE* f,uint32_t from,uint32_t to,bool printPoint) {
+void HashTable::SaveTable(FILE* f,uint32_t from,uint32_t to,bool printPoint,bool packed) {
 
   uint64_t point = GetNbItem() / 16;
   uint64_t pointPrint = 0;
+  uint32_t buffSize = 0;
+  ENTRY *buff = NULL;
 
   for(uint32_t h = from; h < to; h++) {
     fwrite(&E[h].nbItem,sizeof(uint32_t),1,f);
     fwrite(&E[h].maxItem,sizeof(uint32_t),1,f);
+    if(packed) {
+      if(E[h].nbItem > buffSize) {
+        buffSize = E[h].nbItem;
+        buff = (ENTRY *)realloc(buff,buffSize * sizeof(ENTRY));
+      }
+      for(uint32_t i = 0; i < E[h].nbItem; i++)
+        buff[i] = *E[h].items[i];
+      WriteItems(f,true,E[h].nbItem,buff);
+      if(printPoint) {
+        pointPrint += E[h].nbItem;
+        if(pointPrint > point) {
+          ::printf(".");
+          pointPrint = 0;
+        }
+      }
+      continue;
+    }
     for(uint32_t i = 0; i < E[h].nbItem; i++) {
       fwrite(&(E[h].items[i]->x),16,1,f);
       fwrite(&(E[h].items[i]->d),16,1,f);
@@ -381,9 +579,91 @@ void HashTable::SaveTable(FILE* f,uint32_t from,uint32_t to,bool printPoint) {
     }
   }
 
+  safe_free(buff);
+
+}
+
+// Size of buckets [from,to) in the unpacked work file format
+uint64_t HashTable::GetTableSize(uint32_t from,uint32_t to) {
+
+  uint64_t size = 0;
+  for(uint32_t h = from; h < to; h++)
+    size += 8 + 32 * (uint64_t)E[h].nbItem;
+  return size;
+
+}
+
+// Write at offset, the file position is not used
+static bool PWrite(int fd,uint8_t *buff,size_t size,uint64_t offset) {
+
+  while(size > 0) {
+#ifdef WIN64
+    OVERLAPPED ov;
+    DWORD nb = 0;
+    memset(&ov,0,sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if(!WriteFile((HANDLE)_get_osfhandle(fd),buff,(DWORD)size,&nb,&ov) || nb == 0)
+      return false;
+#else
+    ssize_t nb = ::pwrite(fd,buff,size,(off_t)offset);
+    if(nb <= 0)
+      return false;
+#endif
+    buff += nb;
+    size -= nb;
+    offset += nb;
+  }
+  return true;
+
+}
+
+// Write buckets [from,to) in the unpacked work file format at offset of fd,
+// serialized in a large buffer. Several threads can write disjoint ranges.
+bool HashTable::WriteTable(int fd,uint64_t offset,uint32_t from,uint32_t to) {
+
+  uint64_t total = GetTableSize(from,to);
+  size_t buffSize = (total < DUMP_BUFFER) ? (size_t)total : DUMP_BUFFER;
+  uint8_t *buff = (uint8_t *)malloc(buffSize);
+  if(buff == NULL)
+    return false;
+
+  size_t pos = 0;
+  bool ok = true;
+
+  for(uint32_t h = from; h < to && ok; h++) {
+
+    if(pos + 8 > buffSize) {
+      ok = PWrite(fd,buff,pos,offset);
+      offset += pos;
+      pos = 0;
+    }
+    memcpy(buff + pos,&E[h].nbItem,sizeof(uint32_t));
+    memcpy(buff + pos + 4,&E[h].maxItem,sizeof(uint32_t));
+    pos += 8;
+
+    for(uint32_t i = 0; i < E[h].nbItem && ok; i++) {
+      if(pos + 32 > buffSize) {
+        ok = PWrite(fd,buff,pos,offset);
+        offset += pos;
+        pos = 0;
+      }
+      memcpy(buff + pos,&(E[h].items[i]->x),16);
+      memcpy(buff + pos + 16,&(E[h].items[i]->d),16);
+      pos += 32;
+    }
+
+  }
+
+  if(ok && pos > 0)
+    ok = PWrite(fd,buff,pos,offset);
+
+  free(buff);
+  return ok;
+
 }
 
-void HashTable::SeekNbItem(FILE* f,bool restorePos) {
+void HashTable::SeekNbItem(FILE* f,bool restorePos,bool packed) {
 
   Reset();
 
@@ -393,7 +673,7 @@ void HashTable::SeekNbItem(FILE* f,bool restorePos) {
   uint64_t org = (uint64_t)ftello(f);
 #endif
 
-  SeekNbItem(f,0,HASH_SIZE);
+  SeekNbItem(f,0,HASH_SIZE,packed);
 
   if( restorePos ) {
     // Restore position
@@ -406,27 +686,23 @@ void HashTable::SeekNbItem(FILE* f,bool restorePos) {
 
 }
 
-void HashTable::SeekNbItem(FILE* f,uint32_t from,uint32_t to) {
+void HashTable::SeekNbItem(FILE* f,uint32_t from,uint32_t to,bool packed) {
 
   for(uint32_t h = from; h < to; h++) {
 
     fread(&E[h].nbItem,sizeof(uint32_t),1,f);
     fread(&E[h].maxItem,sizeof(uint32_t),1,f);
-
-    uint64_t hSize = 32ULL * E[h].nbItem;
-#ifdef WIN64
-    _fseeki64(f,hSize,SEEK_CUR);
-#else
-    fseeko(f,hSize,SEEK_CUR);
-#endif
+    SkipItems(f,packed,E[h].nbItem);
 
   }
 
 }
 
-void HashTable::LoadTable(FILE* f,uint32_t from,uint32_t to) {
+// Load buckets [from,to[ (the table is not reset), false if a bucket is corrupted
+bool HashTable::LoadTable(FILE* f,uint32_t from,uint32_t to,bool packed) {
 
-  Reset();
+  uint32_t buffSize = 0;
+  ENTRY *buff = NULL;
 
   for(uint32_t h = from; h < to; h++) {
 
@@ -437,6 +713,24 @@ void HashTable::LoadTable(FILE* f,uint32_t from,uint32_t to) {
       // Allocate indexes
       E[h].items = (ENTRY**)malloc(sizeof(ENTRY*) * E[h].maxItem);
 
+    if(packed) {
+      if(E[h].nbItem > buffSize) {
+        buffSize = E[h].nbItem;
+        buff = (ENTRY *)realloc(buff,buffSize * sizeof(ENTRY));
+      }
+      if(!ReadItems(f,true,E[h].nbItem,buff)) {
+        E[h].nbItem = 0;
+        safe_free(buff);
+        return false;
+      }
+      for(uint32_t i = 0; i < E[h].nbItem; i++) {
+        ENTRY* e = (ENTRY*)malloc(sizeof(ENTRY));
+        *e = buff[i];
+        E[h].items[i] = e;
+      }
+      continue;
+    }
+
     for(uint32_t i = 0; i < E[h].nbItem; i++) {
       ENTRY* e = (ENTRY*)malloc(sizeof(ENTRY));
       fread(&(e->x),16,1,f);
@@ -446,12 +740,177 @@ void HashTable::LoadTable(FILE* f,uint32_t from,uint32_t to) {
 
   }
 
+  safe_free(buff);
+  return true;
+
+}
+
+bool HashTable::LoadTable(FILE *f,bool packed) {
+
+  Reset();
+  return LoadTable(f,0,HASH_SIZE,packed);
+
+}
+
+// ----------------------------------------------------------------------------
+// Packed bucket
+// Items are sorted by x, so x is stored as the difference with the previous item.
+// d is stored as (distance << 2) | (sign << 1) | type. Both use a width in bytes
+// given per bucket:
+// [payloadSize][xBytes][dBytes] followed by nbItem (dx,d) on xBytes+dBytes bytes
+
+static int ByteLength(int128_t *v) {
+
+  for(int i = 15; i > 0; i--)
+    if(v->i8[i]) return i + 1;
+  return 1;
+
+}
+
+static void PackD(int128_t *d,int128_t *p) {
+
+  uint64_t sign = (d->i64[1] >> 63) & 1;
+  uint64_t type = (d->i64[1] >> 62) & 1;
+  uint64_t hi = d->i64[1] & 0x3FFFFFFFFFFFFFFFULL;
+  p->i64[1] = (hi << 2) | (d->i64[0] >> 62);
+  p->i64[0] = (d->i64[0] << 2) | (sign << 1) | type;
+
+}
+
+static void UnpackD(int128_t *p,int128_t *d) {
+
+  uint64_t sign = (p->i64[0] >> 1) & 1;
+  uint64_t type = p->i64[0] & 1;
+  d->i64[0] = (p->i64[0] >> 2) | (p->i64[1] << 62);
+  d->i64[1] = (p->i64[1] >> 2) | (sign << 63) | (type << 62);
+
+}
+
+void HashTable::WriteItems(FILE* f,bool packed,uint32_t nbItem,ENTRY* items) {
+
+  if(!packed) {
+    ::fwrite(items,32,nbItem,f);
+    return;
+  }
+
+  if(nbItem == 0)
+    return;
+
+  int128_t *dx = (int128_t *)malloc(nbItem * sizeof(int128_t));
+  int128_t *pd = (int128_t *)malloc(nbItem * sizeof(int128_t));
+  int xBytes = 1;
+  int dBytes = 1;
+  int128_t prev;
+  prev.i64[0] = 0;
+  prev.i64[1] = 0;
+
+  for(uint32_t i = 0; i < nbItem; i++) {
+    int128_t *x = &items[i].x;
+    dx[i].i64[0] = x->i64[0] - prev.i64[0];
+    dx[i].i64[1] = x->i64[1] - prev.i64[1] - ((x->i64[0] < prev.i64[0]) ? 1 : 0);
+    PackD(&items[i].d,pd + i);
+    int l = ByteLength(dx + i);
+    if(l > xBytes) xBytes = l;
+    l = ByteLength(pd + i);
+    if(l > dBytes) dBytes = l;
+    prev = *x;
+  }
+
+  uint32_t size = 2 + nbItem * (xBytes + dBytes);
+  uint8_t *buff = (uint8_t *)malloc(size);
+  buff[0] = (uint8_t)xBytes;
+  buff[1] = (uint8_t)dBytes;
+  uint8_t *b = buff + 2;
+  for(uint32_t i = 0; i < nbItem; i++) {
+    memcpy(b,dx[i].i8,xBytes);
+    b += xBytes;
+    memcpy(b,pd[i].i8,dBytes);
+    b += dBytes;
+  }
+
+  ::fwrite(&size,sizeof(uint32_t),1,f);
+  ::fwrite(buff,1,size,f);
+
+  free(buff);
+  free(pd);
+  free(dx);
 
 }
 
-void HashTable::LoadTable(FILE *f) {
+// Read nbItem entries of a bucket, false if the bucket is truncated or corrupted
+bool HashTable::ReadItems(FILE* f,bool packed,uint32_t nbItem,ENTRY* items) {
 
-  LoadTable(f,0,HASH_SIZE);
+  if(!packed)
+    return ::fread(items,32,nbItem,f) == nbItem;
+
+  if(nbItem == 0)
+    return true;
+
+  // 1 to 16 bytes for x and for d
+  uint32_t size = 0;
+  if(::fread(&size,sizeof(uint32_t),1,f) != 1 ||
+     (uint64_t)size < 2 + 2ULL * nbItem || (uint64_t)size > 2 + 32ULL * nbItem) {
+    ::printf("ReadItems: corrupted bucket\n");
+    return false;
+  }
+
+  uint8_t *buff = (uint8_t *)malloc(size);
+  if(buff == NULL || ::fread(buff,1,size,f) != size) {
+    ::printf("ReadItems: corrupted bucket\n");
+    free(buff);
+    return false;
+  }
+
+  int xBytes = buff[0];
+  int dBytes = buff[1];
+  if(xBytes < 1 || xBytes > 16 || dBytes < 1 || dBytes > 16 ||
+     (uint64_t)size != 2 + (uint64_t)nbItem * (xBytes + dBytes)) {
+    ::printf("ReadItems: corrupted bucket\n");
+    free(buff);
+    return false;
+  }
+
+  uint8_t *b = buff + 2;
+  int128_t prev;
+  prev.i64[0] = 0;
+  prev.i64[1] = 0;
+  for(uint32_t i = 0; i < nbItem; i++) {
+    int128_t dx;
+    int128_t pd;
+    memset(&dx,0,sizeof(dx));
+    memset(&pd,0,sizeof(pd));
+    memcpy(dx.i8,b,xBytes);
+    b += xBytes;
+    memcpy(pd.i8,b,dBytes);
+    b += dBytes;
+    items[i].x.i64[0] = prev.i64[0] + dx.i64[0];
+    items[i].x.i64[1] = prev.i64[1] + dx.i64[1] + ((items[i].x.i64[0] < prev.i64[0]) ? 1 : 0);
+    UnpackD(&pd,&items[i].d);
+    prev = items[i].x;
+  }
+
+  free(buff);
+  return true;
+
+}
+
+void HashTable::SkipItems(FILE* f,bool packed,uint32_t nbItem) {
+
+  uint64_t hSize = 32ULL * nbItem;
+
+  if(packed) {
+    if(nbItem == 0)
+      return;
+    uint32_t size = 0;
+    ::fread(&size,sizeof(uint32_t),1,f);
+    hSize = size;
+  }
+
+#ifdef WIN64
+  _fseeki64(f,hSize,SEEK_CUR);
+#else
+  fseeko(f,hSize,SEEK_CUR);
+#endif
 
 }
 
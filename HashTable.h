@@ -29,9 +29,13 @@
 #define HASH_SIZE (1<<HASH_SIZE_BIT)
 #define HASH_MASK (HASH_SIZE-1)
 
+// Buffer size of a parallel table dump (per thread)
+#define DUMP_BUFFER (16*1024*1024)
+
 #define ADD_OK        0
 #define ADD_DUPLICATE 1
 #define ADD_COLLISION 2
+#define ADD_ERROR     3  // Merge: corrupted bucket in an input file
 
 union int128_s {
 
@@ -70,18 +74,24 @@ public:
   HashTable();
   int Add(Int *x,Int *d,uint32_t type);
   int Add(uint64_t h,int128_t *x,int128_t *d);
+  int Add(uint64_t h,int128_t *x,int128_t *d,Int *cDist,uint32_t *cType);
   int Add(uint64_t h,ENTRY *e);
+  int Add(uint64_t h,ENTRY *e,Int *cDist,uint32_t *cType);
   uint64_t GetNbItem();
   void Reset();
+  void Clear();
   std::string GetSizeInfo();
+  void GetStats(uint64_t *usedByte,uint64_t *totalByte,uint64_t *occupancy,int nbBin);
   void PrintInfo();
-  void SaveTable(FILE *f);
-  void SaveTable(FILE* f,uint32_t from,uint32_t to,bool printPoint=true);
-  void LoadTable(FILE *f);
-  void LoadTable(FILE* f,uint32_t from,uint32_t to);
+  void SaveTable(FILE *f,bool packed = false);
+  void SaveTable(FILE* f,uint32_t from,uint32_t to,bool printPoint=true,bool packed=false);
+  uint64_t GetTableSize(uint32_t from,uint32_t to);
+  bool WriteTable(int fd,uint64_t offset,uint32_t from,uint32_t to);
+  bool LoadTable(FILE *f,bool packed = false);
+  bool LoadTable(FILE* f,uint32_t from,uint32_t to,bool packed = false);
   void ReAllocate(uint64_t h,uint32_t add);
-  void SeekNbItem(FILE* f,bool restorePos = false);
-  void SeekNbItem(FILE* f,uint32_t from,uint32_t to);
+  void SeekNbItem(FILE* f,bool restorePos = false,bool packed = false);
+  void SeekNbItem(FILE* f,uint32_t from,uint32_t to,bool packed = false);
 
   HASH_ENTRY    E[HASH_SIZE];
   // Collision info
@@ -89,14 +99,22 @@ public:
   uint32_t kType;
 
   static void Convert(Int *x,Int *d,uint32_t type,uint64_t *h,int128_t *X,int128_t *D);
-  static int MergeH(uint32_t h,FILE* f1,FILE* f2,FILE* fd,uint32_t *nbDP,uint32_t* duplicate,
-                    Int* d1,uint32_t* k1,Int* d2,uint32_t* k2);
+  static int MergeH(uint32_t h,FILE* f1,bool packed1,FILE* f2,bool packed2,FILE* fd,bool packedd,
+                    uint32_t *nbDP,uint32_t* duplicate,Int* d1,uint32_t* k1,Int* d2,uint32_t* k2);
+  static int MergeHN(uint32_t h,std::vector<FILE*>& f,std::vector<bool>& packed,FILE* fd,bool packedd,
+                     uint32_t* nbDP,uint32_t* duplicate,Int* d1,uint32_t* k1,Int* d2,uint32_t* k2);
+
+  // Items of a bucket (after nbItem and maxItem), raw or packed
+  static bool ReadItems(FILE* f,bool packed,uint32_t nbItem,ENTRY* items);
+  static void WriteItems(FILE* f,bool packed,uint32_t nbItem,ENTRY* items);
+  static void SkipItems(FILE* f,bool packed,uint32_t nbItem);
   static void CalcCollision(int128_t d,Int* kDist,uint32_t* kType);
 
+  static int compare(int128_t *i1,int128_t *i2);
+
 private:
 
   ENTRY *CreateEntry(int128_t *x,int128_t *d);
-  static int compare(int128_t *i1,int128_t *i2);
   std::string GetStr(int128_t *i);
 
 };
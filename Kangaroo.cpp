@@ -31,10 +31,14 @@ using namespace std;
 
 #define safe_delete_array(x) if(x) {delete[] x;x=NULL;}
 
+// Network threads (epoll workers, sender, replication, shard forwarding) report their own errors
+thread_local std::string Kangaroo::lastError;
+
 // ----------------------------------------------------------------------------
 
 Kangaroo::Kangaroo(Secp256K1 *secp,int32_t initDPSize,bool useGpu,string &workFile,string &iWorkFile,uint32_t savePeriod,bool saveKangaroo,
-                   double maxStep,int wtimeout,int port,int ntimeout,string serverIp,string outputFile,bool splitWorkfile,string prvFile) {
+                   double maxStep,int wtimeout,int port,int ntimeout,string serverIp,string outputFile,bool splitWorkfile,string prvFile,
+                   const KANGAROO_OPT &opt) {
 
   this->secp = secp;
   this->initDPSize = initDPSize;
@@ -46,6 +50,10 @@ Kangaroo::Kangaroo(Secp256K1 *secp,int32_t initDPSize,bool useGpu,string &workFi
   this->inputFile = iWorkFile;
   this->nbLoadedWalk = 0;
   this->saveKangaroo = saveKangaroo;
+  this->compactKangaroo = opt.compactKangaroo;
+  this->packTable = opt.packTable;
+  this->loadWalkDBytes = 0;
+  this->walkBuff = NULL;
   this->fRead = NULL;
   this->maxStep = maxStep;
   this->wtimeout = wtimeout;
@@ -57,12 +65,134 @@ Kangaroo::Kangaroo(Secp256K1 *secp,int32_t initDPSize,bool useGpu,string &workFi
   this->hostInfo = NULL;
   this->clientMode = serverIp.length()>0;
   this->endOfSearch = false;
+  this->walkKey = -1;
+  this->endOfRun = false;
   this->saveRequest = false;
   this->connectedClient = 0;
+  this->epollFd = -1;
+  this->serverVersion = 0;
+  this->relayPort = opt.relayPort;
+  this->relayMode = opt.relayPort > 0;
+  this->upstreamRW = 0;
+  this->relaySent = 0;
+  this->relayDup = 0;
+  this->shardId = opt.shardId;
+  this->shardStart = 0;
+  this->shardEnd = HASH_SIZE;
+  this->foreignDP = 0;
+  this->endFromPeer = false;
+  this->insertRunning = false;
+  this->jobId = -1;
+  this->jobWeight = 1;
+  this->jobPriority = 0;
+  this->spillFile = NULL;
+  this->spillRead = 0;
+  this->spillWrite = 0;
+  this->ackFile = NULL;
+  this->ackSuppressed = 0;
+  this->insertQueued = 0;
+  for(int i = 0; i < SERVER_INSERT; i++)
+    this->insertQueueTime[i] = 0.0;
+  this->insertLag = 0.0;
+  this->insertLagMax = 0.0;
+  this->batchTarget = BATCH_DEFAULT;
+  this->batchAdvertised = BATCH_TARGET_MIN;
+  this->rtt = 0.0;
+  this->sendQueueTime = 0.0;
+  this->dpReceived = 0;
+  this->serverMode = false;
+  this->metricsPort = opt.metricsPort;
+  this->metricsSock = 0;
+  this->opCount = 0;
+  this->avgRate = 0.0;
+  this->avgGpuRate = 0.0;
+  this->insertLockWait = 0.0;
+  this->globalLockWait = 0.0;
+  this->spillFileName = (workFile.length()>0)?workFile + ".spill":"kangaroo.spill";
+  this->listenSock = 0;
   this->totalRW = 0;
   this->collisionInSameHerd = 0;
   this->keyIdx = 0;
   this->splitWorkfile = splitWorkfile;
+  this->useJournal = opt.useJournal;
+  this->journalSegment = JOURNAL_SNAPSHOT;
+  this->saveBackground = opt.saveBackground;
+  this->bgSavePid = 0;
+  this->bgSaveStart = 0.0;
+  this->bgJournalOffset = 0;
+  this->lastSavePause = 0.0;
+  this->totalSavePause = 0.0;
+  this->serverIdx = 0;
+  this->replayBase = 0;
+  this->replayTime = 0.0;
+  this->replayPending = false;
+  this->replOffset = 0;
+  this->replTaken = 0;
+  this->replAcked = 0;
+  this->shmName = opt.shmName;
+  this->shmClient = serverIp.compare(0,4,"shm:") == 0;
+  this->shm = NULL;
+  this->shmMapSize = 0;
+  this->shmSlot = -1;
+  this->shmRW = 0;
+  this->shmIno = 0;
+  this->shmCheckTime = 0.0;
+  this->mergeRate = 0.0;
+  this->savePart = opt.savePart;
+  this->ioLimit = opt.ioLimit;
+  this->validRate = opt.validRate;
+  this->validMaxError = opt.validMaxError;
+  this->validChecked = 0;
+  this->validWrong = 0;
+  this->validQuarantined = 0;
+  this->localDPSize = opt.localDPSize;
+  this->serverMask = 0;
+
+  if(useJournal && splitWorkfile) {
+    ::printf("Warning: -wj cannot be used with -wsplit, ignoring\n");
+    this->useJournal = false;
+  }
+
+#ifdef WIN64
+  if(saveBackground) {
+    ::printf("Warning: -wbg not supported on Windows, using standard backup\n");
+    this->saveBackground = false;
+  }
+#endif
+
+  if(opt.shardMap.length() > 0) {
+    if(!ParseShardMap(opt.shardMap) || shardId < 0 || shardId >= (int)shards.size()) {
+      ::printf("Error: Invalid shard map or shard index\n");
+      ::exit(-1);
+    }
+    // This server listens on its own entry of the map
+    this->port = shards[shardId].port;
+    uint64_t nbShard = shards.size();
+    shardStart = (uint32_t)(((uint64_t)shardId * HASH_SIZE + nbShard - 1) / nbShard);
+    shardEnd = (uint32_t)(((uint64_t)(shardId + 1) * HASH_SIZE + nbShard - 1) / nbShard);
+    // Addresses of the other shards, the only hosts allowed to end the search (SERVER_SETEND)
+    for(int i = 0; i < (int)shards.size(); i++) {
+      if(i != shardId && !ResolveHost(shards[i].host,&shards[i].hostInfo,&shards[i].hostInfoLength,&shards[i].hostAddrType))
+        ::printf("Warning: cannot resolve shard %s, SERVER_SETEND from it will be refused\n",shards[i].host.c_str());
+    }
+  }
+
+  if(opt.standbyList.length() > 0 && !ParseHostList(opt.standbyList,standbys)) {
+    ::printf("Error: Invalid standby list\n");
+    ::exit(-1);
+  }
+
+  if(shmClient) {
+    // DP are written to the shared memory ring of a local aggregator
+    this->shmName = serverIp.substr(4);
+  } else if(serverIp.find_first_of(",:") != string::npos) {
+    // host:port or failover list, the first server is used first
+    if(!ParseHostList(serverIp,servers)) {
+      ::printf("Error: Invalid server list, host:port expected\n");
+      ::exit(-1);
+    }
+    SwapShard(&servers[0]);
+  }
 
   CPU_GRP_SIZE = 1024;
 
@@ -70,9 +200,25 @@ Kangaroo::Kangaroo(Secp256K1 *secp,int32_t initDPSize,bool useGpu,string &workFi
 #ifdef WIN64
   ghMutex = CreateMutex(NULL,FALSE,NULL);
   saveMutex = CreateMutex(NULL,FALSE,NULL);
+  sendMutex = CreateMutex(NULL,FALSE,NULL);
+  queueMutex = CreateMutex(NULL,FALSE,NULL);
+  partMutex = CreateMutex(NULL,FALSE,NULL);
+  validMutex = CreateMutex(NULL,FALSE,NULL);
+  for(int i = 0; i < SERVER_INSERT; i++)
+    insertMutex[i] = CreateMutex(NULL,FALSE,NULL);
+  InitializeCriticalSection(&keyLock);
+  InitializeConditionVariable(&keyCond);
 #else
   pthread_mutex_init(&ghMutex, NULL);
   pthread_mutex_init(&saveMutex, NULL);
+  pthread_mutex_init(&sendMutex, NULL);
+  pthread_mutex_init(&queueMutex, NULL);
+  pthread_mutex_init(&partMutex, NULL);
+  pthread_mutex_init(&validMutex, NULL);
+  for(int i = 0; i < SERVER_INSERT; i++)
+    pthread_mutex_init(&insertMutex[i], NULL);
+  pthread_mutex_init(&keyMutex, NULL);
+  pthread_cond_init(&keyCond, NULL);
   signal(SIGPIPE, SIG_IGN);
 #endif
 
@@ -198,7 +344,8 @@ bool Kangaroo::Output(Int *pk,char sInfo,int sType) {
   if(PR.equals(keysToSearch[keyIdx])) {
     ::fprintf(f,"       Priv: 0x%s \n",pk->GetBase16().c_str());
     savePrivkey(pk);
-    if(workFile.length() > 0)
+    // Insert threads still running, ProcessServer saves once they are joined
+    if(workFile.length() > 0 && !insertRunning)
         SaveServerWork();
   } else {
     ::fprintf(f,"       Failed !\n");
@@ -330,6 +477,15 @@ bool Kangaroo::CollisionCheck(Int* d1,uint32_t type1,Int* d2,uint32_t type2) {
 
 bool Kangaroo::AddToTable(Int *pos,Int *dist,uint32_t kType) {
 
+  if(useJournal) {
+    // Go through the (h,x,d) path to record the DP in the journal
+    int128_t X;
+    int128_t D;
+    uint64_t h;
+    HashTable::Convert(pos,dist,kType,&h,&X,&D);
+    return AddToTable(h,&X,&D);
+  }
+
   int addStatus = hashTable.Add(pos,dist,kType);
   if(addStatus== ADD_COLLISION)
     return CollisionCheck(&hashTable.kDist,hashTable.kType,dist,kType);
@@ -338,6 +494,38 @@ bool Kangaroo::AddToTable(Int *pos,Int *dist,uint32_t kType) {
 
 }
 
+// Client local table (-dl), collisions between kangaroos of this client are solved without the server
+bool Kangaroo::AddToLocalTable(Int *pos,Int *dist,uint32_t kType) {
+
+  int addStatus = hashTable.Add(pos,dist,kType);
+  if(addStatus != ADD_COLLISION)
+    return addStatus == ADD_OK;
+
+  Int kDist(&hashTable.kDist);
+  uint32_t kType2 = hashTable.kType;
+  if(!CollisionCheck(&kDist,kType2,dist,kType))
+    return false;
+
+  // Both points are sent to the server at the end of the search
+  Int *d[2] = { &kDist,dist };
+  uint32_t t[2] = { kType2,kType };
+  for(int i = 0; i < 2; i++) {
+    int128_t X;
+    int128_t D;
+    uint64_t h;
+    HashTable::Convert(pos,d[i],t[i],&h,&X,&D);
+    DP dp;
+    dp.kIdx = t[i];
+    dp.h = (uint32_t)h;
+    dp.x = X;
+    dp.d = D;
+    localCollision.push_back(dp);
+  }
+
+  return true;
+
+}
+
 bool Kangaroo::AddToTable(uint64_t h,int128_t *x,int128_t *d) {
 
   int addStatus = hashTable.Add(h,x,d);
@@ -350,6 +538,15 @@ bool Kangaroo::AddToTable(uint64_t h,int128_t *x,int128_t *d) {
 
   }
 
+  if(useJournal && addStatus == ADD_OK) {
+    DP dp;
+    dp.kIdx = 0;
+    dp.h = (uint32_t)h;
+    dp.x = *x;
+    dp.d = *d;
+    journalDP.push_back(dp);
+  }
+
   return addStatus == ADD_OK;
 
 }
@@ -375,21 +572,6 @@ void Kangaroo::SolveKeyCPU(TH_PARAM *ph) {
   IntGroup *grp = new IntGroup(CPU_GRP_SIZE);
   Int *dx = new Int[CPU_GRP_SIZE];
 
-  if(ph->px==NULL) {
-
-    // Create Kangaroos, if not already loaded
-    ph->px = new Int[CPU_GRP_SIZE];
-    ph->py = new Int[CPU_GRP_SIZE];
-    ph->distance = new Int[CPU_GRP_SIZE];
-    CreateHerd(CPU_GRP_SIZE,ph->px,ph->py,ph->distance,TAME);
-
-  }
-
-  if(keyIdx==0)
-    ::printf("\033[1;31m[SolveKeyCPU Thread %d]\033[0m %d kangaroos\n",ph->threadId,CPU_GRP_SIZE);
-
-  ph->hasStarted = true;
-
   // Using Affine coord
   Int dy;
   Int rx;
@@ -397,122 +579,160 @@ void Kangaroo::SolveKeyCPU(TH_PARAM *ph) {
   Int _s;
   Int _p;
 
-  while(!endOfSearch) {
+  // The thread and its herd are kept across keys (see Run)
+  int lastKey = -1;
+  while(WaitKey(&lastKey)) {
+
+    if(ph->px==NULL) {
+
+      // Create Kangaroos, if not already loaded
+      ph->px = new Int[CPU_GRP_SIZE];
+      ph->py = new Int[CPU_GRP_SIZE];
+      ph->distance = new Int[CPU_GRP_SIZE];
+      CreateHerd(CPU_GRP_SIZE,ph->px,ph->py,ph->distance,TAME);
 
-    // Random walk
+    } else if(keyIdx > 0) {
+
+      // Next key, keep tame kangaroos
+      RetargetHerd(CPU_GRP_SIZE,ph->px,ph->py,ph->distance);
+
+    }
 
-    for(int g = 0; g < CPU_GRP_SIZE; g++) {
+    if(keyIdx==0)
+      ::printf("\033[1;31m[SolveKeyCPU Thread %d]\033[0m %d kangaroos\n",ph->threadId,CPU_GRP_SIZE);
+
+    ph->hasStarted = true;
+
+    while(!endOfSearch) {
+
+      // Random walk
+
+      for(int g = 0; g < CPU_GRP_SIZE; g++) {
 
 #ifdef USE_SYMMETRY
-      uint64_t jmp = ph->px[g].bits64[0] % (NB_JUMP/2) + (NB_JUMP / 2) * ph->symClass[g];
+        uint64_t jmp = ph->px[g].bits64[0] % (NB_JUMP/2) + (NB_JUMP / 2) * ph->symClass[g];
 #else
-      uint64_t jmp = ph->px[g].bits64[0] % NB_JUMP;
+        uint64_t jmp = ph->px[g].bits64[0] % NB_JUMP;
 #endif
 
-      Int *p1x = &jumpPointx[jmp];
-      Int *p2x = &ph->px[g];
-      dx[g].ModSub(p2x,p1x);
+        Int *p1x = &jumpPointx[jmp];
+        Int *p2x = &ph->px[g];
+        dx[g].ModSub(p2x,p1x);
 
-    }
+      }
 
-    grp->Set(dx);
-    grp->ModInv();
+      grp->Set(dx);
+      grp->ModInv();
 
-    for(int g = 0; g < CPU_GRP_SIZE; g++) {
+      for(int g = 0; g < CPU_GRP_SIZE; g++) {
 
 #ifdef USE_SYMMETRY
-      uint64_t jmp = ph->px[g].bits64[0] % (NB_JUMP / 2) + (NB_JUMP / 2) * ph->symClass[g];
+        uint64_t jmp = ph->px[g].bits64[0] % (NB_JUMP / 2) + (NB_JUMP / 2) * ph->symClass[g];
 #else
-      uint64_t jmp = ph->px[g].bits64[0] % NB_JUMP;
+        uint64_t jmp = ph->px[g].bits64[0] % NB_JUMP;
 #endif
 
-      Int *p1x = &jumpPointx[jmp];
-      Int *p1y = &jumpPointy[jmp];
-      Int *p2x = &ph->px[g];
-      Int *p2y = &ph->py[g];
+        Int *p1x = &jumpPointx[jmp];
+        Int *p1y = &jumpPointy[jmp];
+        Int *p2x = &ph->px[g];
+        Int *p2y = &ph->py[g];
 
-      dy.ModSub(p2y,p1y);
-      _s.ModMulK1(&dy,&dx[g]);
-      _p.ModSquareK1(&_s);
+        dy.ModSub(p2y,p1y);
+        _s.ModMulK1(&dy,&dx[g]);
+        _p.ModSquareK1(&_s);
 
-      rx.ModSub(&_p,p1x);
-      rx.ModSub(p2x);
+        rx.ModSub(&_p,p1x);
+        rx.ModSub(p2x);
 
-      ry.ModSub(p2x,&rx);
-      ry.ModMulK1(&_s);
-      ry.ModSub(p2y);
+        ry.ModSub(p2x,&rx);
+        ry.ModMulK1(&_s);
+        ry.ModSub(p2y);
 
-      ph->distance[g].ModAddK1order(&jumpDistance[jmp]);
+        ph->distance[g].ModAddK1order(&jumpDistance[jmp]);
 
 #ifdef USE_SYMMETRY
-      // Equivalence symmetry class switch
-      if( ry.ModPositiveK1() ) {
-        ph->distance[g].ModNegK1order();
-        ph->symClass[g] = !ph->symClass[g];
-      }
+        // Equivalence symmetry class switch
+        if( ry.ModPositiveK1() ) {
+          ph->distance[g].ModNegK1order();
+          ph->symClass[g] = !ph->symClass[g];
+        }
 #endif
 
-      ph->px[g].Set(&rx);
-      ph->py[g].Set(&ry);
+        ph->px[g].Set(&rx);
+        ph->py[g].Set(&ry);
 
-    }
+      }
 
-    if( clientMode ) {
+      if( clientMode ) {
+
+        // Send DP to server (only those reaching the server DP size when the local table is used)
+        for(int g = 0; g < CPU_GRP_SIZE; g++) {
+          if(IsDP(ph->px[g].bits64[3])) {
+            if(localDPSize > 0) {
+              LOCK(ghMutex);
+              bool added = endOfSearch || AddToLocalTable(&ph->px[g],&ph->distance[g],g % 2);
+              if(!added) {
+                // Collision inside the same herd
+                CreateHerd(1,&ph->px[g],&ph->py[g],&ph->distance[g],g % 2,false);
+                collisionInSameHerd++;
+              }
+              UNLOCK(ghMutex);
+              if(!added || (ph->px[g].bits64[3] & serverMask) != 0)
+                continue;
+            }
+            ITEM it;
+            it.x.Set(&ph->px[g]);
+            it.d.Set(&ph->distance[g]);
+            it.kIdx = g;
+            dps.push_back(it);
+          }
+        }
 
-      // Send DP to server
-      for(int g = 0; g < CPU_GRP_SIZE; g++) {
-        if(IsDP(ph->px[g].bits64[3])) {
-          ITEM it;
-          it.x.Set(&ph->px[g]);
-          it.d.Set(&ph->distance[g]);
-          it.kIdx = g;
-          dps.push_back(it);
+        double now = Timer::get_tick();
+        if( now-lastSent > QUEUE_PERIOD ) {
+          QueueDP(dps);
+          lastSent = now;
         }
-      }
 
-      double now = Timer::get_tick();
-      if( now-lastSent > SEND_PERIOD ) {
-        LOCK(ghMutex);
-        SendToServer(dps);
-        UNLOCK(ghMutex);
-        lastSent = now;
-      }
+        if(!endOfSearch) counters[thId] += CPU_GRP_SIZE;
 
-      if(!endOfSearch) counters[thId] += CPU_GRP_SIZE;
+      } else {
 
-    } else {
+        // Add to table and collision check
+        for(int g = 0; g < CPU_GRP_SIZE && !endOfSearch; g++) {
 
-      // Add to table and collision check
-      for(int g = 0; g < CPU_GRP_SIZE && !endOfSearch; g++) {
+          if(IsDP(ph->px[g].bits64[3])) {
+            LOCK(ghMutex);
+            if(!endOfSearch) {
 
-        if(IsDP(ph->px[g].bits64[3])) {
-          LOCK(ghMutex);
-          if(!endOfSearch) {
+              if(!AddToTable(&ph->px[g],&ph->distance[g],g % 2)) {
+                // Collision inside the same herd
+                // We need to reset the kangaroo
+                CreateHerd(1,&ph->px[g],&ph->py[g],&ph->distance[g],g % 2,false);
+                collisionInSameHerd++;
+              }
 
-            if(!AddToTable(&ph->px[g],&ph->distance[g],g % 2)) {
-              // Collision inside the same herd
-              // We need to reset the kangaroo
-              CreateHerd(1,&ph->px[g],&ph->py[g],&ph->distance[g],g % 2,false);
-              collisionInSameHerd++;
             }
-
+            UNLOCK(ghMutex);
           }
-          UNLOCK(ghMutex);
+
+          if(!endOfSearch) counters[thId] ++;
+
         }
 
-        if(!endOfSearch) counters[thId] ++;
+      }
 
+      // Save request
+      if(saveRequest && !endOfSearch) {
+        ph->isWaiting = true;
+        LOCK(saveMutex);
+        ph->isWaiting = false;
+        UNLOCK(saveMutex);
       }
 
     }
 
-    // Save request
-    if(saveRequest && !endOfSearch) {
-      ph->isWaiting = true;
-      LOCK(saveMutex);
-      ph->isWaiting = false;
-      UNLOCK(saveMutex);
-    }
+    ph->isRunning = false;
 
   }
 
@@ -526,8 +746,6 @@ void Kangaroo::SolveKeyCPU(TH_PARAM *ph) {
   safe_delete_array(ph->symClass);
 #endif
 
-  ph->isRunning = false;
-
 }
 
 // ----------------------------------------------------------------------------
@@ -550,103 +768,140 @@ void Kangaroo::SolveKeyGPU(TH_PARAM *ph) {
   if(keyIdx == 0)
     ::printf("\033[1;33m[GPU]\033[0m %s (%.1f MB used)\n",gpu->deviceName.c_str(),gpu->GetMemory() / 1048576.0);
 
-  double t0 = Timer::get_tick();
-
+  // The thread, the GPU engine and the herd are kept across keys (see Run)
+  int lastKey = -1;
+  while(WaitKey(&lastKey)) {
+
+    double t0 = Timer::get_tick();
+
+    if( ph->px==NULL ) {
+      if(keyIdx == 0)
+        ::printf("\033[1;33m[SolveKeyGPU Thread GPU#%d]\033[0m creating kangaroos...\n",ph->gpuId);
+      // Create Kangaroos, if not already loaded
+      uint64_t nbThread = gpu->GetNbThread();
+      ph->px = new Int[ph->nbKangaroo];
+      ph->py = new Int[ph->nbKangaroo];
+      ph->distance = new Int[ph->nbKangaroo];
+
+      for(uint64_t i = 0; i<nbThread; i++) {
+        CreateHerd(GPU_GRP_SIZE,&(ph->px[i*GPU_GRP_SIZE]),
+                                &(ph->py[i*GPU_GRP_SIZE]),
+                                &(ph->distance[i*GPU_GRP_SIZE]),
+                                TAME);
+      }
+    } else if(keyIdx > 0) {
+      // Next key, keep tame kangaroos
+      gpu->GetKangaroos(ph->px,ph->py,ph->distance);
+      RetargetHerd((int)ph->nbKangaroo,ph->px,ph->py,ph->distance);
+    }
 
-  if( ph->px==NULL ) {
     if(keyIdx == 0)
-      ::printf("\033[1;33m[SolveKeyGPU Thread GPU#%d]\033[0m creating kangaroos...\n",ph->gpuId);
-    // Create Kangaroos, if not already loaded
-    uint64_t nbThread = gpu->GetNbThread();
-    ph->px = new Int[ph->nbKangaroo];
-    ph->py = new Int[ph->nbKangaroo];
-    ph->distance = new Int[ph->nbKangaroo];
-
-    for(uint64_t i = 0; i<nbThread; i++) {
-      CreateHerd(GPU_GRP_SIZE,&(ph->px[i*GPU_GRP_SIZE]),
-                              &(ph->py[i*GPU_GRP_SIZE]),
-                              &(ph->distance[i*GPU_GRP_SIZE]),
-                              TAME);
+      gpu->SetParams(dMask,jumpDistance,jumpPointx,jumpPointy);
+    gpu->SetKangaroos(ph->px,ph->py,ph->distance);
+
+    if(keysToSearch.size() == 1 && (workFile.length()==0 || !saveKangaroo)) {
+      // No need to get back kangaroo, free memory
+      safe_delete_array(ph->px);
+      safe_delete_array(ph->py);
+      safe_delete_array(ph->distance);
     }
-  }
 
-  gpu->SetParams(dMask,jumpDistance,jumpPointx,jumpPointy);
-  gpu->SetKangaroos(ph->px,ph->py,ph->distance);
+    gpu->callKernel();
 
-  if(workFile.length()==0 || !saveKangaroo) {
-    // No need to get back kangaroo, free memory
-    safe_delete_array(ph->px);
-    safe_delete_array(ph->py);
-    safe_delete_array(ph->distance);
-  }
+    double t1 = Timer::get_tick();
 
-  gpu->callKernel();
+    if(keyIdx == 0)
+      ::printf("SolveKeyGPU Thread GPU#%d: 2^%.2f kangaroos [%.1fs]\n",ph->gpuId,log2((double)ph->nbKangaroo),(t1-t0));
 
-  double t1 = Timer::get_tick();
+    ph->hasStarted = true;
 
-  if(keyIdx == 0)
-    ::printf("SolveKeyGPU Thread GPU#%d: 2^%.2f kangaroos [%.1fs]\n",ph->gpuId,log2((double)ph->nbKangaroo),(t1-t0));
+    while(!endOfSearch) {
 
-  ph->hasStarted = true;
+      gpu->Launch(gpuFound);
+      counters[thId] += ph->nbKangaroo * NB_RUN;
 
-  while(!endOfSearch) {
+      if( clientMode ) {
 
-    gpu->Launch(gpuFound);
-    counters[thId] += ph->nbKangaroo * NB_RUN;
+        if(localDPSize > 0 && gpuFound.size() > 0) {
 
-    if( clientMode ) {
+          LOCK(ghMutex);
+          for(int g = 0; g < (int)gpuFound.size(); g++) {
 
-      for(int i=0;i<(int)gpuFound.size();i++)
-        dps.push_back(gpuFound[i]);
+            uint32_t kType = (uint32_t)(gpuFound[g].kIdx % 2);
 
-      double now = Timer::get_tick();
-      if(now - lastSent > SEND_PERIOD) {
-        LOCK(ghMutex);
-        SendToServer(dps);
-        UNLOCK(ghMutex);
-        lastSent = now;
-      }
+            if(!endOfSearch && !AddToLocalTable(&gpuFound[g].x,&gpuFound[g].d,kType)) {
+              // Collision inside the same herd
+              Int px;
+              Int py;
+              Int d;
+              CreateHerd(1,&px,&py,&d,kType,false);
+              gpu->SetKangaroo(gpuFound[g].kIdx,&px,&py,&d);
+              collisionInSameHerd++;
+              continue;
+            }
 
-    } else {
+            if((gpuFound[g].x.bits64[3] & serverMask) == 0)
+              dps.push_back(gpuFound[g]);
 
-      if(gpuFound.size() > 0) {
+          }
+          UNLOCK(ghMutex);
 
-        LOCK(ghMutex);
+        } else {
 
-        for(int g = 0; !endOfSearch && g < gpuFound.size(); g++) {
+          for(int i=0;i<(int)gpuFound.size();i++)
+            dps.push_back(gpuFound[i]);
 
-          uint32_t kType = (uint32_t)(gpuFound[g].kIdx % 2);
+        }
 
-          if(!AddToTable(&gpuFound[g].x,&gpuFound[g].d,kType)) {
-            // Collision inside the same herd
-            // We need to reset the kangaroo
-            Int px;
-            Int py;
-            Int d;
-            CreateHerd(1,&px,&py,&d,kType,false);
-            gpu->SetKangaroo(gpuFound[g].kIdx,&px,&py,&d);
-            collisionInSameHerd++;
-          }
+        double now = Timer::get_tick();
+        if(now - lastSent > QUEUE_PERIOD) {
+          QueueDP(dps);
+          lastSent = now;
+        }
+
+      } else {
+
+        if(gpuFound.size() > 0) {
+
+          LOCK(ghMutex);
+
+          for(int g = 0; !endOfSearch && g < gpuFound.size(); g++) {
+
+            uint32_t kType = (uint32_t)(gpuFound[g].kIdx % 2);
 
+            if(!AddToTable(&gpuFound[g].x,&gpuFound[g].d,kType)) {
+              // Collision inside the same herd
+              // We need to reset the kangaroo
+              Int px;
+              Int py;
+              Int d;
+              CreateHerd(1,&px,&py,&d,kType,false);
+              gpu->SetKangaroo(gpuFound[g].kIdx,&px,&py,&d);
+              collisionInSameHerd++;
+            }
+
+          }
+          UNLOCK(ghMutex);
         }
-        UNLOCK(ghMutex);
+
       }
 
-    }
+      // Save request
+      if(saveRequest && !endOfSearch) {
+        // Get kangaroos
+        if(saveKangaroo)
+          gpu->GetKangaroos(ph->px,ph->py,ph->distance);
+        ph->isWaiting = true;
+        LOCK(saveMutex);
+        ph->isWaiting = false;
+        UNLOCK(saveMutex);
+      }
 
-    // Save request
-    if(saveRequest && !endOfSearch) {
-      // Get kangaroos
-      if(saveKangaroo)
-        gpu->GetKangaroos(ph->px,ph->py,ph->distance);
-      ph->isWaiting = true;
-      LOCK(saveMutex);
-      ph->isWaiting = false;
-      UNLOCK(saveMutex);
     }
 
-  }
+    ph->isRunning = false;
 
+  }
 
   safe_delete_array(ph->px);
   safe_delete_array(ph->py);
@@ -656,11 +911,10 @@ void Kangaroo::SolveKeyGPU(TH_PARAM *ph) {
 #else
 
   ph->hasStarted = true;
+  ph->isRunning = false;
 
 #endif
 
-  ph->isRunning = false;
-
 }
 
 // ----------------------------------------------------------------------------
@@ -685,9 +939,58 @@ void *_SolveKeyGPU(void *lpParam) {
   return 0;
 }
 
+#ifdef WIN64
+DWORD WINAPI _sendDP(LPVOID lpParam) {
+#else
+void *_sendDP(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->SendDP(p);
+  p->isRunning = false;
+  return 0;
+}
+
 // ----------------------------------------------------------------------------
 
-void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bool lock) {
+// Park a solver thread until Run releases the next key, false at the end of the run
+bool Kangaroo::WaitKey(int *lastKey) {
+
+#ifdef WIN64
+  EnterCriticalSection(&keyLock);
+  while(walkKey == *lastKey && !endOfRun)
+    SleepConditionVariableCS(&keyCond,&keyLock,INFINITE);
+  LeaveCriticalSection(&keyLock);
+#else
+  pthread_mutex_lock(&keyMutex);
+  while(walkKey == *lastKey && !endOfRun)
+    pthread_cond_wait(&keyCond,&keyMutex);
+  pthread_mutex_unlock(&keyMutex);
+#endif
+  *lastKey = walkKey;
+  return !endOfRun;
+
+}
+
+// Wake up the solver threads parked in WaitKey, on the next key or at the end of the run
+void Kangaroo::ReleaseKey(int key,bool end) {
+
+#ifdef WIN64
+  EnterCriticalSection(&keyLock);
+  walkKey = key;
+  endOfRun = end;
+  WakeAllConditionVariable(&keyCond);
+  LeaveCriticalSection(&keyLock);
+#else
+  pthread_mutex_lock(&keyMutex);
+  walkKey = key;
+  endOfRun = end;
+  pthread_cond_broadcast(&keyCond);
+  pthread_mutex_unlock(&keyMutex);
+#endif
+
+}
+
+void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bool lock,bool alternate) {
 
   vector<Int> pk;
   vector<Point> S;
@@ -707,7 +1010,7 @@ void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bo
 
     // Tame in [0..N/2]
     d[j].Rand(rangePower - 1);
-    if((j+ firstType) % 2 == WILD) {
+    if((alternate ? (j + firstType) % 2 : firstType) == WILD) {
       // Wild in [-N/4..N/4]
       d[j].ModSubK1order(&rangeWidthDiv4);
     }
@@ -716,7 +1019,7 @@ void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bo
 
     // Tame in [0..N]
     d[j].Rand(rangePower);
-    if((j + firstType) % 2 == WILD) {
+    if((alternate ? (j + firstType) % 2 : firstType) == WILD) {
       // Wild in [-N/2..N/2]
       d[j].ModSubK1order(&rangeWidthDiv2);
     }
@@ -733,7 +1036,7 @@ void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bo
   S = secp->ComputePublicKeys(pk);
 
   for(uint64_t j = 0; j<nbKangaroo; j++) {
-    if((j + firstType) % 2 == TAME) {
+    if((alternate ? (j + firstType) % 2 : firstType) == TAME) {
       Sp.push_back(Z);
     } else {
       Sp.push_back(keyToSearch);
@@ -757,6 +1060,44 @@ void Kangaroo::CreateHerd(int nbKangaroo,Int *px,Int *py,Int *d,int firstType,bo
 
 }
 
+// Prepare a herd (tame at even index) for the next key: tame kangaroos do not depend
+// on the key and keep walking, wild kangaroos and tame kangaroos whose distance no
+// longer fits in rangePower bits (|d| >= range width) are created again.
+void Kangaroo::RetargetHerd(int nbKangaroo,Int *px,Int *py,Int *d) {
+
+  vector<int> idx[2];
+  for(int j = 0; j < nbKangaroo; j++) {
+    if(j % 2 == TAME) {
+      Int dist(&d[j]);
+      if(dist.GetBitLength() > 128) dist.ModNegK1order();
+      if(dist.GetBitLength() <= rangePower)
+        continue;
+    }
+    idx[j % 2].push_back(j);
+  }
+
+  for(int type = 0; type < 2; type++) {
+
+    int n = (int)idx[type].size();
+    if(n == 0)
+      continue;
+    Int *hx = new Int[n];
+    Int *hy = new Int[n];
+    Int *hd = new Int[n];
+    CreateHerd(n,hx,hy,hd,type,true,false);
+    for(int i = 0; i < n; i++) {
+      px[idx[type][i]].Set(&hx[i]);
+      py[idx[type][i]].Set(&hy[i]);
+      d[idx[type][i]].Set(&hd[i]);
+    }
+    delete[] hx;
+    delete[] hy;
+    delete[] hd;
+
+  }
+
+}
+
 // ----------------------------------------------------------------------------
 
 void Kangaroo::CreateJumpTable() {
@@ -898,6 +1239,23 @@ void Kangaroo::ComputeExpected(double dp,double *op,double *ram,double *overHead
 
 }
 
+// Two-level DP (client local table at dpLocal, server at dp): a collision between two kangaroos
+// of the client (probability share, its fraction of the kangaroos) is detected after 2^dpLocal
+// steps instead of 2^dp. localRam is the memory of the client local table.
+void Kangaroo::ComputeExpected(double dp,double dpLocal,double share,double *op,double *localRam) {
+
+  double ram;
+  double theta = share * pow(2.0,dpLocal) + (1.0 - share) * pow(2.0,dp);
+  ComputeExpected(log2(theta),op,&ram);
+
+  double entries = share * *op / pow(2.0,dpLocal);
+  *localRam = (double)sizeof(HASH_ENTRY) * (double)HASH_SIZE +
+              (double)sizeof(ENTRY *) * (double)(HASH_SIZE * 4) +
+              (double)(sizeof(ENTRY) + sizeof(ENTRY *)) * entries;
+  *localRam /= (1024.0*1024.0);
+
+}
+
 // ----------------------------------------------------------------------------
 
 void Kangaroo::InitRange() {
@@ -994,6 +1352,8 @@ void Kangaroo::Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize
     // Client save only kangaroos, force -ws
     if(workFile.length()>0)
       saveKangaroo = true;
+    // No hashtable on client side
+    useJournal = false;
   }
 
   InitRange();
@@ -1024,9 +1384,36 @@ void Kangaroo::Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize
 
   SetDP(initDPSize);
 
+  if(clientMode && localDPSize > 0) {
+    if(localDPSize >= initDPSize) {
+      ::printf("Warning: local DP size (%d) must be lower than the server DP size, local table disabled\n",localDPSize);
+      localDPSize = 0;
+    } else {
+      // Kangaroos stop at the local DP size, the server DP size is checked before sending
+      double op1,op2,ram;
+      ComputeExpected((double)initDPSize,&op1,&ram);
+      ComputeExpected((double)initDPSize,(double)localDPSize,1.0,&op2,&ram);
+      ::printf("\033[1;32m[Local DP]\033[0m %d\n",localDPSize);
+      ::printf("\033[1;32m[Expected operations]\033[0m 2^%.2f (this client alone, 2^%.2f without local table)\n",log2(op2),log2(op1));
+      ::printf("\033[1;32m[Local RAM]\033[0m %.1fMB\n",ram);
+      serverMask = dMask;
+      SetDP(localDPSize);
+    }
+  }
+
+  if(metricsPort > 0)
+    StartMetrics();
+
+  if(shmName.length() > 0 && !clientMode)
+    StartShm();
+
   // Fetch kangaroos (if any)
   FectchKangaroos(params);
 
+  // DP acknowledged by the server are recorded until the next kangaroo backup
+  if(clientMode && saveKangaroo && workFile.length() > 0)
+    ResetAck(true);
+
 //#define STATS
 #ifdef STATS
 
@@ -1036,6 +1423,24 @@ void Kangaroo::Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize
       uint64_t totalCount = 0;
       uint64_t totalDead = 0;
 
+#endif
+
+    // Solver threads are launched once and kept across keys, they wait for walkKey
+    ReleaseKey(-1,false);
+    for(int i = 0; i < nbCPUThread; i++) {
+      params[i].threadId = i;
+      thHandles[i] = LaunchThread(_SolveKeyCPU,params + i);
+    }
+
+#ifdef WITHGPU
+
+    for(int i = 0; i < nbGPUThread; i++) {
+      int id = nbCPUThread + i;
+      params[id].threadId = 0x80L + i;
+      params[id].gpuId = gpuId[i];
+      thHandles[id] = LaunchThread(_SolveKeyGPU,params + id);
+    }
+
 #endif
 
     for(keyIdx = 0; keyIdx < keysToSearch.size(); keyIdx++) {
@@ -1048,32 +1453,30 @@ void Kangaroo::Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize
       // Reset conters
       memset(counters,0,sizeof(counters));
 
-      // Lanch CPU threads
-      for(int i = 0; i < nbCPUThread; i++) {
-        params[i].threadId = i;
+      // Release CPU and GPU threads
+      for(int i = 0; i < nbCPUThread + nbGPUThread; i++) {
+        params[i].hasStarted = false;
         params[i].isRunning = true;
-        thHandles[i] = LaunchThread(_SolveKeyCPU,params + i);
       }
-
-#ifdef WITHGPU
-
-      // Launch GPU threads
-      for(int i = 0; i < nbGPUThread; i++) {
-        int id = nbCPUThread + i;
-        params[id].threadId = 0x80L + i;
-        params[id].isRunning = true;
-        params[id].gpuId = gpuId[i];
-        thHandles[id] = LaunchThread(_SolveKeyGPU,params + id);
+      ReleaseKey((int)keyIdx,false);
+
+      // Launch DP sender thread
+      TH_PARAM sendParam;
+      THREAD_HANDLE sendHandle;
+      if( clientMode ) {
+        memset(&sendParam,0,sizeof(TH_PARAM));
+        sendParam.isRunning = true;
+        sendHandle = LaunchThread(_sendDP,&sendParam);
       }
 
-#endif
-
-
       // Wait for end
       Process(params,"MK/s");
-      JoinThreads(thHandles,nbCPUThread + nbGPUThread);
-      FreeHandles(thHandles,nbCPUThread + nbGPUThread);
-      hashTable.Reset();
+      if( clientMode ) {
+        JoinThreads(&sendHandle,1);
+        FreeHandles(&sendHandle,1);
+      }
+      WaitBackgroundSave(true);
+      hashTable.Clear();
 
 #ifdef STATS
 
@@ -1086,16 +1489,27 @@ void Kangaroo::Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize
                               keyIdx, log2((double)count), collisionInSameHerd,
                               log2(avg), (double)totalDead / (double)(keyIdx + 1),
                               avg/SN,expectedNbOp/SN);
+
+#endif
+
     }
+
+    // Stop solver threads
+    ReleaseKey(walkKey,true);
+    JoinThreads(thHandles,nbCPUThread + nbGPUThread);
+    FreeHandles(thHandles,nbCPUThread + nbGPUThread);
+
+#ifdef STATS
+
     string fName = "DP" + ::to_string(dpSize) + ".txt";
     FILE *f = fopen(fName.c_str(),"a");
     fprintf(f,"%d %f\n",CPU_GRP_SIZE*nbCPUThread,(double)totalCount);
     fclose(f);
 
-#endif
-
   }
 
+#endif
+
   double t1 = Timer::get_tick();
 
   ::printf("\nDone: Total time %s \n" , GetTimeStr(t1-t0+offsetTime).c_str());
@@ -38,6 +38,9 @@ typedef int SOCKET;
 
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
+#include <atomic>
 #include "SECPK1/SECP256k1.h"
 #include "HashTable.h"
 #include "SECPK1/IntGroup.h"
@@ -81,11 +84,21 @@ typedef struct {
 
   SOCKET clientSock;
   char  *clientInfo;
+  Kangaroo *job;        // Job served to this client (-jobs)
 
   uint32_t hStart;
   uint32_t hStop;
   char *part1Name;
   char *part2Name;
+  bool part1Packed;
+  bool part2Packed;
+  uint64_t ioSize;      // Partitioned save
+  bool ioFailed;
+  int  partJob;         // Partition worker (PART_MERGE, PART_CHECK, PART_SAVE, PART_DUMP)
+  uint64_t partDP;
+  uint64_t partWrong;
+  uint64_t walkStart;   // Compact kangaroo decoding (-wsc): first kangaroo of the thread
+  uint64_t walkWrong;   // Number of kangaroos which do not decode
 
 } TH_PARAM;
 
@@ -100,69 +113,191 @@ typedef struct {
 
 } DP;
 
-// DP cache
+// Client connection of the event driven server
 typedef struct {
+
+  SOCKET   sock;
+  char     info[64];
+  int      state;       // Field being read
+  char     hdr[8];      // Command or header field
+  uint64_t rPos;        // Bytes of the field received so far
+  uint64_t rSize;       // Size of the field
   uint32_t nbDP;
-  DP *dp;
-} DP_CACHE;
+  DP      *dp;
+  char     out[1024];   // Pending reply
+  uint32_t outPos;
+  uint32_t outSize;
+  uint64_t nbKangaroo;
+  double   lastActivity;
+  Kangaroo *job;        // Job served to this client (-jobs)
+  uint64_t nbDPRecv;
+
+} CONNECTION;
+
+// DP sampled for validation (server)
+typedef struct {
+
+  DP        dp;
+  Kangaroo *job;
+  char      info[64];   // Client
+
+} VALID_DP;
+
+// Validation state of a client connection
+typedef struct {
+
+  uint64_t nbSampled;   // DP queued for validation
+  uint64_t nbChecked;
+  uint64_t nbWrong;
+  double   credit;      // Fraction of DP to sample carried over to the next request
+  bool     quarantined;
+
+} VALID_STAT;
+
+// Connection to another server: shard (-shard), entry of the client failover list (-c)
+// or standby of a primary server (-standby)
+typedef struct {
+
+  std::string host;
+  int      port;
+  char    *hostInfo;
+  int      hostInfoLength;
+  int      hostAddrType;
+  SOCKET   sock;
+  bool     isConnected;
+  std::string status;
+  std::vector<DP> pending;  // DP not yet replicated to this standby
+  uint64_t offset;          // Replication stream offset of the first pending DP
+  double   lastConnect;      // Last connection attempt (or Backup status of a shard)
+
+} SHARD;
+
+// Replication progress of a client connection (primary with -standby): DP received from the
+// connection, DP of the connection streamed to all standbys, and (stream offset, received) at
+// the end of each request not yet streamed
+typedef struct {
+
+  uint64_t received;
+  uint64_t replicated;
+  std::deque< std::pair<uint64_t,uint64_t> > marks;
+
+} REPL_CLIENT;
 
 // Work file type
 #define HEADW 0xFA6A8001  // Full work file
 #define HEADK 0xFA6A8002  // Kangaroo only file
+#define HEADJ 0xFA6A8003  // DP journal file
+#define HEADA 0xFA6A8004  // Acknowledged DP file (client)
+
+// Work file version flags
+#define VERSION_KCOMPACT 0x1  // Compact kangaroos (-wsc)
+#define VERSION_PACKED   0x2  // Packed hashtable (-wpack)
+#define VERSION_FLAGS (VERSION_KCOMPACT|VERSION_PACKED)  // Storage flags, ignored when checking compatibility
 
 // Number of Hash entry per partition
 #define H_PER_PART (HASH_SIZE / MERGE_PART)
 
+// Optional features of a Kangaroo instance (see main.cpp for the matching options),
+// the defaults leave them disabled
+typedef struct {
+
+  bool useJournal = false;          // -wj
+  bool saveBackground = false;      // -wbg
+  bool compactKangaroo = false;     // -wsc
+  bool packTable = false;           // -wpack
+  bool savePart = false;            // -wpart
+  int  ioLimit = 0;                 // -wio
+  int  relayPort = 0;               // -relay
+  int  shardId = -1;                // -shard
+  std::string shardMap;
+  int  metricsPort = 0;             // -metrics
+  std::string standbyList;          // -standby
+  std::string shmName;              // -shm
+  int  localDPSize = 0;             // -dl
+  double validRate = VALID_RATE;    // -vs
+  double validMaxError = VALID_MAX_ERROR;  // -vq
+
+} KANGAROO_OPT;
+
 class Kangaroo {
 
 public:
 
   Kangaroo(Secp256K1 *secp,int32_t initDPSize,bool useGpu,std::string &workFile,std::string &iWorkFile,
            uint32_t savePeriod,bool saveKangaroo,double maxStep,int wtimeout,int sport,int ntimeout,
-           std::string serverIp,std::string outputFile,bool splitWorkfile,std::string prvFile);
+           std::string serverIp,std::string outputFile,bool splitWorkfile,std::string prvFile,
+           const KANGAROO_OPT &opt);
   void Run(int nbThread,std::vector<int> gpuId,std::vector<int> gridSize);
   void RunServer();
   bool ParseConfigFile(std::string &fileName);
   bool LoadWork(std::string &fileName);
+  bool LoadJobs(std::string &fileName);
+  bool LoadTest(std::vector<int> &load,std::string &plantKey);
   void Check(std::vector<int> gpuId,std::vector<int> gridSize);
   void MergeDir2(std::string &dirname,std::string &dest);
   void WorkExport(std::string &fileName);
   void MergeDir(std::string& dirname,std::string& dest);
+  void MergeDaemon(std::string& dirName,std::string& partName,double rate);
   bool MergeWork(std::string &file1,std::string &file2,std::string &dest,bool printStat=true);
+  bool MergeWorkN(std::vector<std::string>& files,std::string& dest,bool printStat=true);
   void WorkInfo(std::string &fileName);
+  void CompactWork(std::string &fileName);
   bool MergeWorkPart(std::string& file1,std::string& file2,bool printStat);
   bool MergeWorkPartPart(std::string& part1Name,std::string& part2Name);
   static void CreateEmptyPartWork(std::string& partName);
   void CheckWorkFile(int nbCore,std::string& fileName);
   void CheckPartition(int nbCore,std::string& partName);
+  bool SampleDP(const char *info,Kangaroo *job,DP *dp,uint32_t nbDP);
+  void ForgetClient(const char *info);
+  void ForgetReplicated(const char *info);
   bool FillEmptyPartFromFile(std::string& partName,std::string& fileName,bool printStat);
+  void ThrottleIO(double t0,uint64_t bytes);
+  void RunPartWorkers(int nbThread,TH_PARAM *job);
 
   // Threaded procedures
   void SolveKeyCPU(TH_PARAM *p);
   void SolveKeyGPU(TH_PARAM *p);
   bool HandleRequest(TH_PARAM *p);
+  void ClientThread(TH_PARAM *p);
   bool MergePartition(TH_PARAM* p);
+  bool SavePartition(TH_PARAM* p);
   bool CheckPartition(TH_PARAM* p);
   bool CheckWorkFile(TH_PARAM* p);
+  void PartWorker(TH_PARAM* p);
+  void ValidateDP(TH_PARAM* p);
+  void DecodeWalks(TH_PARAM *p);
   void ProcessServer();
+  void ServerWorker(TH_PARAM *p);
+  void SendDP(TH_PARAM *p);
+  void InsertDP(TH_PARAM *p);
+  void ReplicateThread(TH_PARAM *p);
+  void MetricsServer();
+  void ShmReader();
+  void LoadClient(TH_PARAM *p);
 
   void AddConnectedClient();
   void RemoveConnectedClient();
   void RemoveConnectedKangaroo(uint64_t nb);
+  void MoveToJob(Kangaroo **job,uint64_t nbKangaroo,Kangaroo *newJob);
 
 private:
 
   bool IsDP(uint64_t x);
   void SetDP(int size);
-  void CreateHerd(int nbKangaroo,Int *px, Int *py, Int *d, int firstType,bool lock=true);
+  void CreateHerd(int nbKangaroo,Int *px, Int *py, Int *d, int firstType,bool lock=true,bool alternate=true);
+  void RetargetHerd(int nbKangaroo,Int *px,Int *py,Int *d);
+  bool WaitKey(int *lastKey);
+  void ReleaseKey(int key,bool end);
   void CreateJumpTable();
   bool AddToTable(uint64_t h,int128_t *x,int128_t *d);
   bool AddToTable(Int *pos,Int *dist,uint32_t kType);
-  bool SendToServer(std::vector<ITEM> &dp);
+  bool AddToLocalTable(Int *pos,Int *dist,uint32_t kType);
+  bool SendToServer(std::vector<DP> &dp,bool final = false);
   bool CheckKey(Int d1,Int d2,uint8_t type);
   bool CollisionCheck(Int* d1,uint32_t type1,Int* d2,uint32_t type2);
   bool savePrivkey(Int *pk);
   void ComputeExpected(double dp,double *op,double *ram,double* overHead = NULL);
+  void ComputeExpected(double dp,double dpLocal,double share,double *op,double *localRam);
   void InitRange();
   void InitSearchKey();
   std::string GetTimeStr(double s);
@@ -172,9 +307,19 @@ private:
   void SaveWork(std::string fileName,FILE *f,int type,uint64_t totalCount,double totalTime);
   void SaveWork(uint64_t totalCount,double totalTime,TH_PARAM *threads,int nbThread);
   void SaveServerWork();
+  bool SavePartWork(std::string partName,uint64_t *size);
+  bool LoadPartWork(std::string partName,bool packed);
+  void SaveWalks(FILE *f,TH_PARAM *threads,int nbThread,bool printPoint);
+  bool ForkSave(std::string fileName,uint64_t totalCount,double totalTime,TH_PARAM *threads,int nbThread);
+  bool WaitBackgroundSave(bool block);
+  void TrimJournal(uint64_t offset);
+  bool AppendJournal(uint64_t totalCount,double totalTime,bool lock=true);
+  void ResetJournal(bool lock=true);
+  void ReplayJournal(std::string fileName);
   void FetchWalks(uint64_t nbWalk,Int *x,Int *y,Int *d);
   void FectchKangaroos(TH_PARAM *threads);
   FILE *ReadHeader(std::string fileName,uint32_t *version,int type);
+  bool  DumpTable(std::string fileName,FILE *f);
   bool  SaveHeader(std::string fileName,FILE* f,int type,uint64_t totalCount,double totalTime);
   int FSeek(FILE *stream,uint64_t pos);
   uint64_t FTell(FILE *stream);
@@ -182,27 +327,101 @@ private:
   bool IsEmpty(std::string fileName);
   static std::string GetPartName(std::string& partName,int i,bool tmpPart);
   static FILE* OpenPart(std::string& partName,char* mode,int i,bool tmpPart=false);
-  uint32_t CheckHash(uint32_t h,uint32_t nbItem,HashTable* hT,FILE* f);
+  uint32_t CheckHash(uint32_t h,uint32_t nbItem,HashTable* hT,FILE* f,bool packed = false,bool *readOk = NULL);
+  std::vector<Point> EntryPoints(std::vector<int128_t> &d,std::vector<Point *> &keys);
 
 
   // Network stuff
   void AcceptConnections(SOCKET server_soc);
+  void RunEventServer(SOCKET server_soc);
+  void AcceptClients();
+  void HandleConnection(CONNECTION *c,uint32_t events);
+  bool ReadConnection(CONNECTION *c);
+  bool FlushConnection(CONNECTION *c);
+  bool ProcessCommand(CONNECTION *c);
+  void QueueReply(CONNECTION *c,void *buf,uint32_t size);
+  void CloseConnection(CONNECTION *c);
+  void CheckIdleConnections();
   int WaitFor(SOCKET sock,int timeout,int mode);
   int Write(SOCKET sock,char *buf,int bufsize,int timeout);
   int Read(SOCKET sock,char *buf,int bufsize,int timeout);
   bool GetConfigFromServer();
   bool ConnectToServer(SOCKET *retSock);
+  bool ResolveHost(std::string &host,char **hInfo,int *hInfoLength,int *hAddrType);
+  bool ConnectToHost(std::string &host,int hPort,char **hInfo,int *hInfoLength,int *hAddrType,SOCKET *retSock);
   void InitSocket();
   void WaitForServer();
+  void QueueDP(std::vector<ITEM> &dps);
+  void DispatchDP(DP *dp,uint32_t nbDP);
+  void EnqueueDP(DP *dp,uint32_t nbDP);
+  void LoadAck(std::string fileName);
+  void ResetAck(bool keepLoaded);
+  void AckDP(DP *dp,size_t nbDP);
+  bool SendKangarooNumber();
+  bool ParseShardMap(std::string shardMap);
+  bool ParseHostList(std::string list,std::vector<SHARD> &hosts);
+  bool GetShardsFromServer();
+  void SwapShard(SHARD *s);
+  uint32_t ShardOf(uint32_t h);
+  void BroadcastEnd();
+  std::string GetShardMap();
+  void SendToShards(std::vector<DP> &dps,bool final = false);
+  bool ConnectShard(SHARD *s);
+  void CloseShard(SHARD *s);
+  bool SendToShard(SHARD *s,std::vector<DP> &dps,bool final);
+  bool SendKangarooNumber(SHARD *s);
+  bool IsShardPeer(const char *info);
+  void ReadSpill(std::vector<DP> &dps);
   int32_t GetServerStatus();
+  double GetInsertLag();
+  bool InitServer();
+  Kangaroo *SelectJob();
+  bool SendJobId();
+  bool GetBatchTarget();
+  void StartMetrics();
+  std::string GetMetrics();
+  void TableMetrics(std::string &out);
+  bool BatchReady(double lastSend);
+  void PlantCollision(Int *privKey);
+  void NextServer();
+  void KeepForReplay(std::vector<DP> &dps);
+  bool GetReplicated();
+  void Replicate();
+  bool ConnectStandby(SHARD *s);
+  bool SendToStandby(SHARD *s,std::vector<DP> &dps);
+  void MarkReplicated(const char *info,uint32_t nbDP);
+  uint64_t ClientReplicated(const char *info);
+  void StartShm();
+  void ShmInsert(std::vector<DP> &dps);
+  void ShmCountKangaroos();
+  bool ShmAttach();
+  void ShmDetach();
+  bool ShmConfig();
+  bool ShmSend(std::vector<DP> &dps,bool final);
+  bool ShmValid();
+  void ShmAck(bool all);
 
 #ifdef WIN64
   HANDLE ghMutex;
   HANDLE saveMutex;
+  HANDLE sendMutex;
+  HANDLE queueMutex;
+  HANDLE partMutex;
+  HANDLE validMutex;
+  HANDLE insertMutex[SERVER_INSERT];
+  CRITICAL_SECTION keyLock;
+  CONDITION_VARIABLE keyCond;
   THREAD_HANDLE LaunchThread(LPTHREAD_START_ROUTINE func,TH_PARAM *p);
 #else
   pthread_mutex_t  ghMutex;
   pthread_mutex_t  saveMutex;
+  pthread_mutex_t  sendMutex;
+  pthread_mutex_t  queueMutex;
+  pthread_mutex_t  partMutex;
+  pthread_mutex_t  validMutex;
+  pthread_mutex_t  insertMutex[SERVER_INSERT];
+  pthread_mutex_t  keyMutex;
+  pthread_cond_t   keyCond;
   THREAD_HANDLE LaunchThread(void *(*func) (void *), TH_PARAM *p);
 #endif
 
@@ -241,11 +460,13 @@ private:
   Point keyToSearchNeg;
   uint32_t keyIdx;
   bool endOfSearch;
+  std::atomic<int> walkKey;    // Key released to the solver threads (see WaitKey)
+  std::atomic<bool> endOfRun;
   bool useGpu;
   double expectedNbOp;
   double expectedMem;
   double maxStep;
-  uint64_t totalRW;
+  std::atomic<uint64_t> totalRW; // Updated by the server workers without lock
 
   Int jumpDistance[NB_JUMP];
   Int jumpPointx[NB_JUMP];
@@ -265,13 +486,27 @@ private:
   int  saveWorkPeriod;
   bool saveRequest;
   bool saveKangaroo;
+  bool compactKangaroo;
+  bool packTable;
+  int  loadWalkDBytes;
+  uint8_t *walkBuff;
   int wtimeout;
   int ntimeout;
   bool splitWorkfile;
+  bool useJournal;
+  int  journalSegment;
+  std::vector<DP> journalDP;
+  bool saveBackground;
+  int  bgSavePid;
+  std::string bgSaveFile;
+  double bgSaveStart;
+  uint64_t bgJournalOffset;
+  double lastSavePause;
+  double totalSavePause;
 
   // Network stuff
   int port;
-  std::string lastError;
+  static thread_local std::string lastError;  // Set by the socket functions, read by the same thread
   std::string serverIp;
   char *hostInfo;
   int   hostInfoLength;
@@ -279,10 +514,97 @@ private:
   bool  clientMode;
   bool  isConnected;
   SOCKET serverConn;
-  std::vector<DP_CACHE> recvDP;
-  std::vector<DP_CACHE> localCache;
+  uint32_t serverVersion;
+  bool  relayMode;
+  int   relayPort;
+  uint64_t upstreamRW;
+  uint64_t relaySent;
+  uint64_t relayDup;
+  std::vector<SHARD> shards;
+  std::vector<SHARD> servers;
+  int serverIdx;
+  std::vector<DP> replayDP;
+  uint64_t replayBase;
+  double replayTime;
+  bool replayPending;
+  std::vector<SHARD> standbys;
+  std::vector<DP> replQueue;
+  uint64_t replOffset;
+  uint64_t replTaken;
+  uint64_t replAcked;
+  std::map<std::string,REPL_CLIENT> replClients;
+  std::string shmName;
+  bool shmClient;
+  void *shm;
+  size_t shmMapSize;
+  int shmSlot;
+  uint64_t shmRW;
+  uint64_t shmIno;                  // Inode of the ring, a restarted aggregator creates a new one
+  double shmCheckTime;
+  std::vector<DP> shmPending;       // Published, not yet read by the aggregator (acknowledged once read)
+  std::vector<uint64_t> shmPendingPos;
+  double mergeRate;
+  bool savePart;
+  int ioLimit;
+  int partNext;
+  int partIO;
+  int partDone;
+  uint64_t partBytes;
+  double partT0;
+  int dumpFd;
+  double validRate;
+  double validMaxError;
+  std::deque<VALID_DP> validQueue;
+  std::map<std::string,VALID_STAT> validStat;
+  uint64_t validChecked;
+  uint64_t validWrong;
+  uint64_t validQuarantined;
+  std::vector<uint64_t> dumpOffset;
+  int localDPSize;
+  uint64_t serverMask;
+  std::vector<DP> localCollision;
+  int shardId;
+  uint32_t shardStart;
+  uint32_t shardEnd;
+  uint64_t foreignDP;
+  bool endFromPeer;
+  std::vector<Kangaroo *> jobs;
+  std::vector<THREAD_HANDLE> jobThreads;  // Main threads of the jobs, joined by the front server
+  int jobId;
+  uint32_t jobWeight;
+  int jobPriority;
+  std::vector<DP> insertQueue[SERVER_INSERT];
+  std::atomic<uint64_t> insertQueued;    // Updated under queueMutex, read without lock (backpressure, metrics)
+  double insertQueueTime[SERVER_INSERT];  // Enqueue time of the oldest waiting DP (0 if none)
+  double insertLag;                       // Enqueue to insertion time of the last DP inserted
+  double insertLagMax;                    // Longest one since the last SERVER_GETLAG
+  bool insertRunning;
   std::string serverStatus;
+  uint32_t batchTarget;
+  uint32_t batchAdvertised;
+  double rtt;
+  double sendQueueTime;
+  uint64_t dpReceived;
+  bool serverMode;
+  int metricsPort;
+  SOCKET metricsSock;
+  uint64_t opCount;
+  double avgRate;
+  double avgGpuRate;
+  double insertLockWait;
+  double globalLockWait;
   int connectedClient;
+  int epollFd;
+  SOCKET listenSock;
+  std::vector<CONNECTION *> connections;
+  std::vector<DP> sendQueue;
+  FILE *spillFile;
+  std::string spillFileName;
+  uint64_t spillRead;
+  uint64_t spillWrite;
+  std::vector<DP> ackDP;
+  FILE *ackFile;
+  uint64_t ackSuppressed;
 
 };
 
@@ -47,141 +47,166 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
     return true;
   }
 
-  double t0;
-  double t1;
-  uint32_t v1;
-  uint32_t v2;
+  vector<string> files;
+  files.push_back(file1);
+  files.push_back(file2);
+  return MergeWorkN(files,dest,printStat);
 
-  t0 = Timer::get_tick();
+}
 
-  // ---------------------------------------------------
-  FILE* f1 = ReadHeader(file1,&v1,HEADW);
-  if(f1 == NULL)
-    return false;
+bool Kangaroo::MergeWorkN(std::vector<std::string>& files,std::string& dest,bool printStat) {
 
-  uint32_t dp1;
-  Point k1;
-  uint64_t count1;
-  double time1;
-  Int RS1;
-  Int RE1;
-
-  // Read global param
-  ::fread(&dp1,sizeof(uint32_t),1,f1);
-  ::fread(&RS1.bits64,32,1,f1); RS1.bits64[4] = 0;
-  ::fread(&RE1.bits64,32,1,f1); RE1.bits64[4] = 0;
-  ::fread(&k1.x.bits64,32,1,f1); k1.x.bits64[4] = 0;
-  ::fread(&k1.y.bits64,32,1,f1); k1.y.bits64[4] = 0;
-  ::fread(&count1,sizeof(uint64_t),1,f1);
-  ::fread(&time1,sizeof(double),1,f1);
-
-  k1.z.SetInt32(1);
-  if(!secp->EC(k1)) {
-    ::printf("MergeWork: key1 does not lie on elliptic curve\n");
-    fclose(f1);
-    return true;
-  }
+  // Single pass k-way merge, the destination is written once
 
+  if(files.size() > MERGE_MAX_FILE) {
 
-  // ---------------------------------------------------
+    // Too many files to keep them all open, merge groups of MERGE_MAX_FILE files
+    // into intermediate work files, then merge those
+    vector<string> groups;
+    vector<string> tmpFiles;
+    bool end = false;
+    for(size_t i = 0; i < files.size() && !end; i += MERGE_MAX_FILE) {
+      size_t last = i + MERGE_MAX_FILE;
+      if(last > files.size()) last = files.size();
+      if(last - i == 1) {
+        groups.push_back(files[i]);
+        continue;
+      }
+      vector<string> group(files.begin() + i,files.begin() + last);
+      // Unique per level: each level has fewer files than the previous one
+      string gName = dest + "_" + ::to_string(files.size()) + "_" + ::to_string(groups.size()) + ".grp";
+      ::printf("## Group #%d: files %d to %d\n",(int)groups.size() + 1,(int)i + 1,(int)last);
+      tmpFiles.push_back(gName);
+      end = MergeWorkN(group,gName,printStat);
+      groups.push_back(gName);
+    }
 
-  FILE* f2 = ReadHeader(file2,&v2,HEADW);
-  if(f2 == NULL) {
-    fclose(f1);
-    return true;
-  }
+    if(!end)
+      end = MergeWorkN(groups,dest,printStat);
 
-  uint32_t dp2;
-  Point k2;
-  uint64_t count2;
-  double time2;
-  Int RS2;
-  Int RE2;
-
-  // Read global param
-  ::fread(&dp2,sizeof(uint32_t),1,f2);
-  ::fread(&RS2.bits64,32,1,f2); RS2.bits64[4] = 0;
-  ::fread(&RE2.bits64,32,1,f2); RE2.bits64[4] = 0;
-  ::fread(&k2.x.bits64,32,1,f2); k2.x.bits64[4] = 0;
-  ::fread(&k2.y.bits64,32,1,f2); k2.y.bits64[4] = 0;
-  ::fread(&count2,sizeof(uint64_t),1,f2);
-  ::fread(&time2,sizeof(double),1,f2);
-
-  if(v1 != v2) {
-    ::printf("MergeWork: cannot merge workfile of different version\n");
-    fclose(f1);
-    fclose(f2);
-    return true;
-  }
+    for(size_t i = 0; i < tmpFiles.size(); i++)
+      remove(tmpFiles[i].c_str());
+    return end;
 
-  k2.z.SetInt32(1);
-  if(!secp->EC(k2)) {
-    ::printf("MergeWork: key2 does not lie on elliptic curve\n");
-    fclose(f1);
-    fclose(f2);
-    return true;
   }
 
-  if(!RS1.IsEqual(&RS2) || !RE1.IsEqual(&RE2)) {
-
-    ::printf("MergeWork: File range differs\n");
-    ::printf("RS1: %s\n",RS1.GetBase16().c_str());
-    ::printf("RE1: %s\n",RE1.GetBase16().c_str());
-    ::printf("RS2: %s\n",RS2.GetBase16().c_str());
-    ::printf("RE2: %s\n",RE2.GetBase16().c_str());
-    fclose(f1);
-    fclose(f2);
-    return true;
+  double t0;
+  double t1;
+  size_t k = files.size();
+
+  vector<FILE*> f(k,(FILE*)NULL);
+  vector<bool> packed(k,false);
+  uint32_t dpMin = 0;
+  uint64_t countT = 0;
+  double timeT = 0;
+  uint32_t v0 = 0;
+  Point k0;
+  Int RS0;
+  Int RE0;
+
+  for(size_t i = 0; i < k; i++) {
+
+    uint32_t v;
+    f[i] = ReadHeader(files[i],&v,HEADW);
+    if(f[i] == NULL) {
+      for(size_t j = 0; j < i; j++) fclose(f[j]);
+      return true;
+    }
+    packed[i] = (v & VERSION_PACKED) != 0;
+
+    uint32_t dp;
+    Point key;
+    uint64_t count;
+    double time;
+    Int RS;
+    Int RE;
+
+    // Read global param
+    ::fread(&dp,sizeof(uint32_t),1,f[i]);
+    ::fread(&RS.bits64,32,1,f[i]); RS.bits64[4] = 0;
+    ::fread(&RE.bits64,32,1,f[i]); RE.bits64[4] = 0;
+    ::fread(&key.x.bits64,32,1,f[i]); key.x.bits64[4] = 0;
+    ::fread(&key.y.bits64,32,1,f[i]); key.y.bits64[4] = 0;
+    ::fread(&count,sizeof(uint64_t),1,f[i]);
+    ::fread(&time,sizeof(double),1,f[i]);
+
+    key.z.SetInt32(1);
+    bool ok = secp->EC(key);
+    if(!ok)
+      ::printf("MergeWork: key of %s does not lie on elliptic curve\n",files[i].c_str());
+
+    if(ok && i == 0) {
+
+      v0 = v;
+      k0 = key;
+      RS0.Set(&RS);
+      RE0.Set(&RE);
+      dpMin = dp;
+
+    } else if(ok) {
+
+      if((v & ~VERSION_FLAGS) != (v0 & ~VERSION_FLAGS)) {
+        ::printf("MergeWork: cannot merge workfile of different version (%s)\n",files[i].c_str());
+        ok = false;
+      } else if(!RS0.IsEqual(&RS) || !RE0.IsEqual(&RE)) {
+        ::printf("MergeWork: File range differs (%s)\n",files[i].c_str());
+        ::printf("RS1: %s\n",RS0.GetBase16().c_str());
+        ::printf("RE1: %s\n",RE0.GetBase16().c_str());
+        ::printf("RS2: %s\n",RS.GetBase16().c_str());
+        ::printf("RE2: %s\n",RE.GetBase16().c_str());
+        ok = false;
+      } else if(!k0.equals(key)) {
+        ::printf("MergeWork: key differs (%s), multiple keys not yet supported\n",files[i].c_str());
+        ok = false;
+      }
 
-  }
+    }
 
-  if(!k1.equals(k2)) {
+    if(!ok) {
+      for(size_t j = 0; j <= i; j++) fclose(f[j]);
+      return true;
+    }
 
-    ::printf("MergeWork: key differs, multiple keys not yet supported\n");
-    fclose(f1);
-    fclose(f2);
-    return true;
+    if(dp < dpMin) dpMin = dp;
+    countT += count;
+    timeT += time;
+    ::printf("File %s: [DP%d]\n",files[i].c_str(),dp);
 
   }
 
-  ::printf("File %s: [DP%d]\n",file1.c_str(),dp1);
-  ::printf("File %s: [DP%d]\n",file2.c_str(),dp2);
-
   endOfSearch = false;
 
   // Set starting parameters
   keysToSearch.clear();
-  keysToSearch.push_back(k1);
+  keysToSearch.push_back(k0);
   keyIdx = 0;
   collisionInSameHerd = 0;
-  rangeStart.Set(&RS1);
-  rangeEnd.Set(&RE1);
+  rangeStart.Set(&RS0);
+  rangeEnd.Set(&RE0);
   InitRange();
   InitSearchKey();
 
   t0 = Timer::get_tick();
 
 #ifndef WIN64
-  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stdout,NULL,_IONBF,0);
 #endif
 
-  ::printf("Merging");
+  ::printf("Merging %d files",(int)k);
 
   // Open output file
   string tmpName = dest + ".tmp";
-  FILE* f = fopen(tmpName.c_str(),"wb");
-  if(f == NULL) {
+  FILE* fd = fopen(tmpName.c_str(),"wb");
+  if(fd == NULL) {
     ::printf("\nMergeWork: Cannot open %s for writing\n",tmpName.c_str());
     ::printf("%s\n",::strerror(errno));
-    fclose(f1);
-    fclose(f2);
+    for(size_t i = 0; i < k; i++) fclose(f[i]);
     return true;
   }
-  dpSize = (dp1 < dp2) ? dp1 : dp2;
-  if( !SaveHeader(tmpName,f,HEADW,count1 + count2,time1 + time2) ) {
-    fclose(f1);
-    fclose(f2);
-    fclose(f);
+  dpSize = dpMin;
+  if(!SaveHeader(tmpName,fd,HEADW,countT,timeT)) {
+    for(size_t i = 0; i < k; i++) fclose(f[i]);
+    fclose(fd);
     return true;
   }
 
@@ -193,17 +218,22 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
   Int d2;
   uint32_t type2;
 
-  for(uint32_t h=0;h<HASH_SIZE && !endOfSearch;h++) {
+  bool corrupted = false;
+
+  for(uint32_t h = 0; h < HASH_SIZE && !endOfSearch && !corrupted; h++) {
 
     if(h % (HASH_SIZE / 64) == 0) ::printf(".");
 
-    int mStatus = HashTable::MergeH(h,f1,f2,f,&hDP,&hDuplicate,&d1,&type1,&d2,&type2);
+    int mStatus = HashTable::MergeHN(h,f,packed,fd,packTable,&hDP,&hDuplicate,&d1,&type1,&d2,&type2);
     switch(mStatus) {
-      case ADD_OK:
+    case ADD_OK:
       break;
-      case ADD_COLLISION:
+    case ADD_COLLISION:
       CollisionCheck(&d1,type1,&d2,type2);
       break;
+    case ADD_ERROR:
+      corrupted = true;
+      continue;
     }
 
     nbDP += hDP;
@@ -211,9 +241,15 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
 
   }
 
-  fclose(f1);
-  fclose(f2);
-  fclose(f);
+  for(size_t i = 0; i < k; i++)
+    fclose(f[i]);
+  fclose(fd);
+
+  if(corrupted) {
+    ::printf("\nMergeWork: corrupted bucket in one of the merged files\n");
+    remove(tmpName.c_str());
+    return true;
+  }
 
   t1 = Timer::get_tick();
 
@@ -221,7 +257,7 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
 
     remove(dest.c_str());
     rename(tmpName.c_str(),dest.c_str());
-    ::printf("Done [%s]\n",GetTimeStr(t1-t0).c_str());
+    ::printf("Done [%s]\n",GetTimeStr(t1 - t0).c_str());
 
   } else {
 
@@ -237,10 +273,10 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
 #else
     ::printf("Dead kangaroo: %" PRId64 "\n",collisionInSameHerd);
 #endif
-    ::printf("Total f1+f2: DP count 2^%.2f\n",log2((double)nbDP));
+    ::printf("Total: DP count 2^%.2f\n",log2((double)nbDP));
   } else {
-    offsetTime = time1 + time2;
-    offsetCount = count1 + count2;
+    offsetTime = timeT;
+    offsetCount = countT;
   }
 
   return false;
@@ -250,9 +286,11 @@ bool Kangaroo::MergeWork(std::string& file1,std::string& file2,std::string& dest
 typedef struct File {
   std::string name;
   uint64_t size;
+  time_t date;
 } File;
 
 bool sortBySize(const File& lhs,const File& rhs) { return lhs.size > rhs.size; }
+bool sortByDate(const File& lhs,const File& rhs) { return lhs.date < rhs.date; }
 
 void Kangaroo::MergeDir(std::string& dirName,std::string& dest) {
 
@@ -334,15 +372,156 @@ void Kangaroo::MergeDir(std::string& dirName,std::string& dest) {
       return;
     }
 
-    int i = 0;
-    ::printf("\n## File #1/%d\n",lgth - 1);
-    bool end = MergeWork(listFiles[0].name,listFiles[1].name,dest,lgth == 2);
-    for(int i = 2; i < lgth && !end; i++) {
-      ::printf("\n## File #%d/%d\n",i,lgth - 1);
-      end = MergeWork(dest,listFiles[i].name,dest,i == lgth - 1);
-    }
+    vector<string> names;
+    for(int i = 0; i < lgth; i++)
+      names.push_back(listFiles[i].name);
+    MergeWorkN(names,dest,true);
 
   }
 
 
 }
+
+// ----------------------------------------------------------------------------
+// Merge daemon: fold the work files written with -wsplit into a partitioned work
+// file as soon as they are complete. Merged files are renamed to <file>.merged,
+// files which cannot be merged to <file>.bad.
+
+static bool endsWith(const string& s,const char *suffix) {
+  size_t l = strlen(suffix);
+  return s.length() >= l && s.compare(s.length() - l,l,suffix) == 0;
+}
+
+// True when both paths designate the same file or directory
+static bool IsSameFile(const string& a,const string& b) {
+#ifdef WIN64
+  return _stricmp(a.c_str(),b.c_str()) == 0;
+#else
+  struct stat sa;
+  struct stat sb;
+  if(stat(a.c_str(),&sa) != 0 || stat(b.c_str(),&sb) != 0)
+    return false;
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+}
+
+void Kangaroo::MergeDaemon(std::string& dirName,std::string& partName,double rate) {
+
+  if(IsDir(partName) != 1) {
+    CreateEmptyPartWork(partName);
+    if(IsDir(partName) != 1)
+      return;
+  }
+
+#ifndef WIN64
+  // Leave the CPU and the disks to the server
+  if(nice(10) == -1)
+    ::printf("MergeDaemon: nice() failed\n");
+#endif
+
+  mergeRate = rate;
+  ::printf("MergeDaemon: watching %s, merging into %s",dirName.c_str(),partName.c_str());
+  if(rate > 0.0)
+    ::printf(" [I/O limit %.0fMB/s]",rate);
+  ::printf("\n");
+
+  int nbMerged = 0;
+
+  while(true) {
+
+    vector<File> listFiles;
+    time_t now = time(NULL);
+
+#ifdef WIN64
+    WIN32_FIND_DATA ffd;
+    HANDLE hFind = FindFirstFile((dirName + string("\\*")).c_str(),&ffd);
+    if(hFind != INVALID_HANDLE_VALUE) {
+      do {
+        if(ffd.cFileName[0] != '.') {
+          File e;
+          e.name = dirName + string("\\") + string(ffd.cFileName);
+          listFiles.push_back(e);
+        }
+      } while(FindNextFile(hFind,&ffd) != 0);
+      FindClose(hFind);
+    }
+#else
+    DIR *dir = opendir(dirName.c_str());
+    if(dir == NULL) {
+      ::printf("opendir(%s) Error:\n",dirName.c_str());
+      perror("");
+      return;
+    }
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+      if(ent->d_type != DT_REG && ent->d_type != DT_DIR) continue;
+      if(ent->d_name[0] == '.') continue;
+      File e;
+      e.name = dirName + "/" + string(ent->d_name);
+      listFiles.push_back(e);
+    }
+    closedir(dir);
+#endif
+
+    // Work files (or partitioned work files written with -wpart) not modified
+    // since MERGE_DAEMON_SETTLE seconds, oldest first
+    vector<File> works;
+    for(int i = 0; i < (int)listFiles.size(); i++) {
+      string& fName = listFiles[i].name;
+      if(endsWith(fName,".merged") || endsWith(fName,".bad") || endsWith(fName,".tmp"))
+        continue;
+      struct stat st;
+      if(stat(fName.c_str(),&st) != 0 || difftime(now,st.st_mtime) < MERGE_DAEMON_SETTLE)
+        continue;
+      bool isPart = (st.st_mode & S_IFDIR) != 0;
+      if(isPart && IsSameFile(fName,partName))
+        continue;
+      FILE *f = fopen(isPart ? (fName + "/header").c_str() : fName.c_str(),"rb");
+      if(f == NULL) continue;
+      uint32_t head = 0;
+      bool isWork = ::fread(&head,sizeof(uint32_t),1,f) == 1 && head == HEADW;
+      fclose(f);
+      if(!isWork) continue;
+      File e;
+      e.name = fName;
+      e.size = (uint64_t)st.st_size;
+      e.date = st.st_mtime;
+      works.push_back(e);
+    }
+    std::sort(works.begin(),works.end(),sortByDate);
+
+    for(int i = 0; i < (int)works.size(); i++) {
+
+      ::printf("\n## MergeDaemon: %s\n",works[i].name.c_str());
+      bool end;
+      if(IsDir(works[i].name) == 1)
+        end = MergeWorkPartPart(partName,works[i].name);
+      else
+        end = MergeWorkPart(partName,works[i].name,false);
+
+      if(endOfSearch) {
+        // Key found (written to the output file by CheckKey)
+        ::printf("MergeDaemon: key solved while merging %s\n",works[i].name.c_str());
+        if(outputFile.length() > 0)
+          ::printf("MergeDaemon: key written to %s\n",outputFile.c_str());
+        return;
+      }
+
+      string newName = works[i].name + (end ? ".bad" : ".merged");
+      if(rename(works[i].name.c_str(),newName.c_str()) != 0)
+        ::printf("MergeDaemon: Cannot rename %s: %s\n",works[i].name.c_str(),::strerror(errno));
+      if(end)
+        ::printf("MergeDaemon: %s cannot be merged, renamed to %s\n",works[i].name.c_str(),newName.c_str());
+      else
+        nbMerged++;
+
+    }
+
+    if(works.size() > 0)
+      ::printf("MergeDaemon: %d file(s) merged\n",nbMerged);
+
+    Timer::SleepMillis((int)(MERGE_DAEMON_PERIOD * 1000.0));
+
+  }
+
+}
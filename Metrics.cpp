@@ -0,0 +1,319 @@
+/*
+ * This file is part of the BSGS distribution (https://github.com/JeanLucPons/Kangaroo).
+ * Copyright (c) 2020 Jean Luc PONS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Kangaroo.h"
+#include "Timer.h"
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#ifndef WIN64
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+extern string GetNetworkError();
+
+#ifdef WIN64
+#define close_socket(s) closesocket(s)
+#else
+#define close_socket(s) close(s)
+#endif
+
+// ------------------------------------------------------------------------------------------------------
+// Metrics (-metrics port)
+// A minimal HTTP listener which answers GET /metrics in Prometheus text format. Requests are served
+// one at a time by a single thread, values are read without locking (scrapes are not exact).
+// ------------------------------------------------------------------------------------------------------
+
+#define NB_OCCUPANCY_BIN 10  // Bucket occupancy histogram: 0,1,3,7,...,255,+Inf entries
+
+// Metric header (once per metric name)
+static void MetricHeader(string &out,const char *name,const char *type,const char *help) {
+  out += "# HELP " + string(name) + " " + string(help) + "\n";
+  out += "# TYPE " + string(name) + " " + string(type) + "\n";
+}
+
+static void MetricValue(string &out,const char *name,string labels,double value) {
+  char tmp[64];
+  ::sprintf(tmp," %.15g\n",value);
+  out += string(name);
+  if(labels.length() > 0)
+    out += "{" + labels + "}";
+  out += string(tmp);
+}
+
+static void Metric(string &out,const char *name,const char *type,const char *help,double value) {
+  MetricHeader(out,name,type,help);
+  MetricValue(out,name,"",value);
+}
+
+#ifdef WIN64
+DWORD WINAPI _metricsServer(LPVOID lpParam) {
+#else
+void *_metricsServer(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->MetricsServer();
+  return 0;
+}
+
+// Hash table metrics of the server, or of each job
+void Kangaroo::TableMetrics(string &out) {
+
+  vector<Kangaroo *> tables;
+  if(jobs.size() > 0)
+    tables = jobs;
+  else
+    tables.push_back(this);
+
+  size_t n = tables.size();
+  vector<string> labels(n);
+  vector<uint64_t> used(n);
+  vector<uint64_t> total(n);
+  vector<uint64_t> hist(n * NB_OCCUPANCY_BIN);
+  for(size_t i = 0; i < n; i++) {
+    if(jobs.size() > 0)
+      labels[i] = "job=\"" + ::to_string(i) + "\"";
+    tables[i]->hashTable.GetStats(&used[i],&total[i],hist.data() + i * NB_OCCUPANCY_BIN,NB_OCCUPANCY_BIN);
+  }
+
+#define TABLE_METRIC(name,type,help,value) \
+  MetricHeader(out,name,type,help); \
+  for(size_t i = 0; i < n; i++) { Kangaroo *k = tables[i]; (void)k; MetricValue(out,name,labels[i],(double)(value)); }
+
+  TABLE_METRIC("kangaroo_hashtable_entries","gauge","Number of DP in the hash table",k->hashTable.GetNbItem());
+  TABLE_METRIC("kangaroo_hashtable_used_bytes","gauge","Memory used by the DP of the hash table",used[i]);
+  TABLE_METRIC("kangaroo_hashtable_allocated_bytes","gauge","Memory allocated by the hash table",total[i]);
+  TABLE_METRIC("kangaroo_expected_operations","gauge","Expected number of group operations",k->expectedNbOp);
+  TABLE_METRIC("kangaroo_estimated_operations","gauge","Group operations estimated from the DP count",
+               (double)k->hashTable.GetNbItem() * pow(2.0,k->dpSize));
+  TABLE_METRIC("kangaroo_dead_kangaroos_total","counter","Dead kangaroos (collisions in the same herd)",k->collisionInSameHerd);
+  TABLE_METRIC("kangaroo_insert_queue_dp","gauge","DP waiting for the insert threads",k->insertQueued);
+  TABLE_METRIC("kangaroo_insert_lag_seconds","gauge","Time from reception to insertion of the last inserted DP",k->insertLag);
+  TABLE_METRIC("kangaroo_dp_received_total","counter","DP received from clients",k->dpReceived);
+  TABLE_METRIC("kangaroo_kangaroos","gauge","Kangaroos of the connected clients",k->totalRW);
+  TABLE_METRIC("kangaroo_save_duration_seconds","gauge","Duration of the last backup pause",k->lastSavePause);
+  TABLE_METRIC("kangaroo_save_pause_seconds_total","counter","Time spent in backup pauses",k->totalSavePause);
+
+  MetricHeader(out,"kangaroo_lock_wait_seconds_total","counter","Time spent by the insert threads waiting for locks");
+  for(size_t i = 0; i < n; i++) {
+    string sep = (labels[i].length() > 0) ? "," : "";
+    MetricValue(out,"kangaroo_lock_wait_seconds_total",labels[i] + sep + "lock=\"insert\"",tables[i]->insertLockWait);
+    MetricValue(out,"kangaroo_lock_wait_seconds_total",labels[i] + sep + "lock=\"global\"",tables[i]->globalLockWait);
+  }
+
+  MetricHeader(out,"kangaroo_bucket_occupancy","histogram","Number of DP per hash bucket");
+  for(size_t i = 0; i < n; i++) {
+    string sep = (labels[i].length() > 0) ? "," : "";
+    uint64_t cumul = 0;
+    for(int b = 0; b < NB_OCCUPANCY_BIN; b++) {
+      cumul += hist[i * NB_OCCUPANCY_BIN + b];
+      string le = (b == NB_OCCUPANCY_BIN - 1) ? "+Inf" : ::to_string((1ULL << b) - 1);
+      MetricValue(out,"kangaroo_bucket_occupancy_bucket",labels[i] + sep + "le=\"" + le + "\"",(double)cumul);
+    }
+    MetricValue(out,"kangaroo_bucket_occupancy_sum",labels[i],(double)tables[i]->hashTable.GetNbItem());
+    MetricValue(out,"kangaroo_bucket_occupancy_count",labels[i],(double)cumul);
+  }
+
+#undef TABLE_METRIC
+
+}
+
+// Metrics page
+string Kangaroo::GetMetrics() {
+
+  string out;
+  bool server = serverMode;
+  const char *mode = relayMode ? "relay" : serverMode ? "server" : clientMode ? "client" : "standalone";
+
+  MetricHeader(out,"kangaroo_info","gauge","Mode of this process");
+  MetricValue(out,"kangaroo_info","mode=\"" + string(mode) + "\"",1.0);
+  Metric(out,"kangaroo_uptime_seconds","gauge","Time since the start of the search",Timer::get_tick() - startTime);
+  Metric(out,"kangaroo_end_of_search","gauge","1 when the key is solved",endOfSearch ? 1.0 : 0.0);
+
+  if(!server) {
+
+    // Solver (standalone or client)
+    Metric(out,"kangaroo_operations_total","counter","Group operations",(double)opCount);
+    Metric(out,"kangaroo_operation_rate","gauge","Group operations per second (all threads)",avgRate);
+    Metric(out,"kangaroo_gpu_operation_rate","gauge","Group operations per second (GPU threads)",avgGpuRate);
+    Metric(out,"kangaroo_kangaroos","gauge","Number of kangaroos",(double)totalRW);
+    if(!clientMode) {
+      Metric(out,"kangaroo_expected_operations","gauge","Expected number of group operations",expectedNbOp);
+      Metric(out,"kangaroo_dead_kangaroos_total","counter","Dead kangaroos (collisions in the same herd)",(double)collisionInSameHerd);
+      Metric(out,"kangaroo_hashtable_entries","gauge","Number of DP in the hash table",(double)hashTable.GetNbItem());
+      Metric(out,"kangaroo_save_duration_seconds","gauge","Duration of the last backup pause",lastSavePause);
+      Metric(out,"kangaroo_save_pause_seconds_total","counter","Time spent in backup pauses",totalSavePause);
+    }
+
+  } else if(!relayMode) {
+
+    TableMetrics(out);
+
+  }
+
+  if(clientMode) {
+
+    // Client or relay towards its server
+    Metric(out,"kangaroo_server_up","gauge","1 when connected to the server",isConnected ? 1.0 : 0.0);
+    Metric(out,"kangaroo_dp_sent_total","counter","DP sent to the server",(double)relaySent);
+    Metric(out,"kangaroo_send_queue_dp","gauge","DP waiting for the sender thread",(double)sendQueue.size());
+    Metric(out,"kangaroo_spill_dp","gauge","DP spilled to disk",(double)(spillWrite - spillRead));
+    Metric(out,"kangaroo_rtt_seconds","gauge","Smoothed duration of a DP request",rtt);
+    Metric(out,"kangaroo_batch_target_dp","gauge","Batch size advertised by the server",(double)batchTarget);
+    if(localDPSize > 0) {
+      Metric(out,"kangaroo_local_table_entries","gauge","Number of DP in the client local table",(double)hashTable.GetNbItem());
+      Metric(out,"kangaroo_dead_kangaroos_total","counter","Dead kangaroos (collisions in the same herd)",(double)collisionInSameHerd);
+    }
+    if(relayMode)
+      Metric(out,"kangaroo_relay_duplicate_dp_total","counter","Duplicate DP removed by the relay",(double)relayDup);
+    else
+      Metric(out,"kangaroo_dp_suppressed_total","counter","DP already acknowledged before the last restart, not sent again",(double)ackSuppressed);
+
+  }
+
+  if(server) {
+
+    Metric(out,"kangaroo_connected_clients","gauge","Number of connected clients",(double)connectedClient);
+    Metric(out,"kangaroo_batch_advertised_dp","gauge","Batch size advertised to clients",(double)batchAdvertised);
+    if(validRate > 0.0 && !relayMode) {
+      Metric(out,"kangaroo_dp_validated_total","counter","Client DP validated again by the server",(double)validChecked);
+      Metric(out,"kangaroo_dp_invalid_total","counter","Validated client DP which are not on a kangaroo walk",(double)validWrong);
+      Metric(out,"kangaroo_clients_quarantined_total","counter","Clients quarantined for invalid DPs",(double)validQuarantined);
+    }
+
+    // Per client DP counter (event driven server only)
+    string clients;
+    string kangaroos;
+    LOCK(ghMutex);
+    for(size_t i = 0; i < connections.size(); i++) {
+      CONNECTION *c = connections[i];
+      string labels = "client=\"" + string(c->info) + "\"";
+      if(c->job && c->job->jobId >= 0)
+        labels += ",job=\"" + ::to_string(c->job->jobId) + "\"";
+      MetricValue(clients,"kangaroo_client_dp_total",labels,(double)c->nbDPRecv);
+      MetricValue(kangaroos,"kangaroo_client_kangaroos",labels,(double)c->nbKangaroo);
+    }
+    UNLOCK(ghMutex);
+    MetricHeader(out,"kangaroo_client_dp_total","counter","DP received from a client on its current connection");
+    out += clients;
+    MetricHeader(out,"kangaroo_client_kangaroos","gauge","Kangaroos of a client");
+    out += kangaroos;
+
+  }
+
+  return out;
+
+}
+
+void Kangaroo::MetricsServer() {
+
+  while(true) {
+
+    struct sockaddr_in client_add;
+    socklen_t len = sizeof(sockaddr_in);
+    SOCKET s = accept(metricsSock,(struct sockaddr*)&client_add,&len);
+    if(s < 0) {
+      Timer::SleepMillis(100);
+      continue;
+    }
+
+    // Blocking socket with timeouts, lastError is not touched from this thread
+#ifdef WIN64
+    DWORD tmo = (DWORD)ntimeout;
+#else
+    struct timeval tmo;
+    tmo.tv_sec = ntimeout / 1000;
+    tmo.tv_usec = (ntimeout % 1000) * 1000;
+#endif
+    setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,(char *)&tmo,sizeof(tmo));
+    setsockopt(s,SOL_SOCKET,SO_SNDTIMEO,(char *)&tmo,sizeof(tmo));
+
+    // Read the request line and headers
+    char req[4096];
+    int size = 0;
+    while(size < (int)sizeof(req) - 1) {
+      int nbRead = (int)recv(s,req + size,(int)sizeof(req) - 1 - size,0);
+      if(nbRead <= 0)
+        break;
+      size += nbRead;
+      req[size] = 0;
+      if(strstr(req,"\r\n\r\n") || strstr(req,"\n\n"))
+        break;
+    }
+    req[size] = 0;
+
+    string body;
+    const char *status;
+    if(strncmp(req,"GET /metrics",12) == 0) {
+      status = "200 OK";
+      body = GetMetrics();
+    } else {
+      status = "404 Not Found";
+      body = "Not found, use /metrics\n";
+    }
+
+    char hdr[256];
+    ::sprintf(hdr,"HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+              status,(int)body.length());
+    string reply = string(hdr) + body;
+    size_t pos = 0;
+    while(pos < reply.length()) {
+      int nbWrite = (int)send(s,reply.data() + pos,(int)(reply.length() - pos),0);
+      if(nbWrite <= 0)
+        break;
+      pos += nbWrite;
+    }
+    close_socket(s);
+
+  }
+
+}
+
+// Start the metrics listener
+void Kangaroo::StartMetrics() {
+
+  InitSocket();
+
+  metricsSock = socket(AF_INET,SOCK_STREAM,0);
+  if(metricsSock < 0) {
+    ::printf("Warning: metrics disabled, invalid socket : %s\n",GetNetworkError().c_str());
+    return;
+  }
+
+  int32_t yes = 1;
+  setsockopt(metricsSock,SOL_SOCKET,SO_REUSEADDR,(char *)&yes,sizeof(yes));
+
+  struct sockaddr_in soc_addr;
+  memset(&soc_addr,0,sizeof(soc_addr));
+  soc_addr.sin_family = AF_INET;
+  soc_addr.sin_port = htons(metricsPort);
+  soc_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(bind(metricsSock,(struct sockaddr*)&soc_addr,sizeof(soc_addr)) || listen(metricsSock,16) < 0) {
+    ::printf("Warning: metrics disabled, can not listen to port %d: %s\n",metricsPort,GetNetworkError().c_str());
+    close_socket(metricsSock);
+    return;
+  }
+
+  ::printf("Metrics available at http://<host>:%d/metrics\n",metricsPort);
+  TH_PARAM *p = (TH_PARAM *)malloc(sizeof(TH_PARAM));
+  memset(p,0,sizeof(TH_PARAM));
+  LaunchThread(_metricsServer,p);
+
+}
@@ -26,9 +26,14 @@
 #include <signal.h>
 #ifndef WIN64
 #include <pthread.h>
+#include <sys/resource.h>
 #else
 #include "WindowsErrors.h"
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <dirent.h>
+#endif
 
 using namespace std;
 
@@ -39,16 +44,27 @@ static SOCKET serverSock = 0;
 // ------------------------------------------------------------------------------------------------------
 
 #define MAX_CLIENT 256
+#define SERVER_WORKER 4          // Threads of the event driven server
+#define MAX_DP_PER_REQUEST (1<<24)
+#define MAX_SHARD 32
 #define WAIT_FOR_READ  1
 #define WAIT_FOR_WRITE 2
 
-#define SERVER_VERSION 2
+#define SERVER_VERSION 7
 
 // Commands
 #define SERVER_GETCONFIG 0
 #define SERVER_STATUS    1
 #define SERVER_SENDDP    2
 #define SERVER_SETKNB    3
+#define SERVER_SENDPDP   4  // Packed DP (version>=3)
+#define SERVER_GETSHARDS 5  // Shard map (version>=4)
+#define SERVER_SETEND    6  // Key solved by another shard (version>=4)
+#define SERVER_GETJOB    7  // Job assigned to this client (version>=5)
+#define SERVER_SETJOB    8  // Resume a job after reconnection (version>=5)
+#define SERVER_GETBATCH  9  // Target batch size (version>=6)
+#define SERVER_GETREPL  10  // DP of this connection streamed to the standbys (version>=7)
+#define SERVER_GETLAG   11  // Longest reception to insertion time since the last request (version>=7)
 
 // Status
 #define SERVER_OK            0
@@ -99,6 +115,130 @@ string GetNetworkError() {
 #define GETFREE(name,s,b,bl,t,x)  if( (nbRead=Read(s,(char *)(b),bl,t))<0 ) { ::printf("\nReadError(" name "): %s\n",lastError.c_str()); isConnected = false; ::free(x); close_socket(s); return false; }
 #define PUTFREE(name,s,b,bl,t,x)  if( (nbWrite=Write(s,(char *)(b),bl,t))<0 ) { ::printf("\nWriteError(" name "): %s\n",lastError.c_str()); isConnected = false; ::free(x); close_socket(s); return false; }
 
+// ------------------------------------------------------------------------------------------------------
+// Packed DP (SERVER_SENDPDP)
+// DP are sorted by h and sent as:
+// [dBytes u8] then for each DP [h delta varint][x 16 bytes][(|d|<<2 | sign<<1 | type) on dBytes bytes]
+// kIdx is not sent (not used by the server). dBytes is sized on the largest distance of the batch.
+// ------------------------------------------------------------------------------------------------------
+
+static bool compareDP(const DP &a,const DP &b) {
+  return a.h < b.h;
+}
+
+static bool compareDPFull(const DP &a,const DP &b) {
+  if(a.h != b.h) return a.h < b.h;
+  if(a.x.i64[1] != b.x.i64[1]) return a.x.i64[1] < b.x.i64[1];
+  if(a.x.i64[0] != b.x.i64[0]) return a.x.i64[0] < b.x.i64[0];
+  if(a.d.i64[1] != b.d.i64[1]) return a.d.i64[1] < b.d.i64[1];
+  return a.d.i64[0] < b.d.i64[0];
+}
+
+static bool equalDP(const DP &a,const DP &b) {
+  return a.h == b.h && a.x.i64[0] == b.x.i64[0] && a.x.i64[1] == b.x.i64[1] &&
+         a.d.i64[0] == b.d.i64[0] && a.d.i64[1] == b.d.i64[1];
+}
+
+// Remove duplicate DP (kIdx ignored), return the number of removed DP
+static uint64_t DedupeDP(std::vector<DP> &dps) {
+  size_t nb = dps.size();
+  std::sort(dps.begin(),dps.end(),compareDPFull);
+  dps.erase(std::unique(dps.begin(),dps.end(),equalDP),dps.end());
+  return nb - dps.size();
+}
+
+// (|d|<<2 | sign<<1 | type) on 128 bits
+static void PackDistance(int128_t *d,uint64_t *v) {
+  v[0] = (d->i64[0] << 2) | ((d->i64[1] >> 63) << 1) | ((d->i64[1] >> 62) & 0x1ULL);
+  v[1] = ((d->i64[1] & 0x3FFFFFFFFFFFFFFFULL) << 2) | (d->i64[0] >> 62);
+}
+
+static void PackDP(std::vector<DP> &dps,std::vector<uint8_t> &out) {
+
+  std::sort(dps.begin(),dps.end(),compareDP);
+
+  // Distance width
+  uint8_t dBytes = 1;
+  for(size_t i = 0; i < dps.size(); i++) {
+    uint64_t v[2];
+    PackDistance(&dps[i].d,v);
+    uint8_t *vb = (uint8_t *)v;
+    uint8_t nb = 16;
+    while(nb > dBytes && vb[nb - 1] == 0) nb--;
+    dBytes = nb;
+  }
+
+  out.clear();
+  out.reserve(1 + dps.size() * (19 + dBytes));
+  out.push_back(dBytes);
+
+  uint32_t prevH = 0;
+  for(size_t i = 0; i < dps.size(); i++) {
+
+    uint32_t delta = dps[i].h - prevH;
+    prevH = dps[i].h;
+    while(delta >= 0x80) {
+      out.push_back((uint8_t)(delta | 0x80));
+      delta >>= 7;
+    }
+    out.push_back((uint8_t)delta);
+
+    uint8_t *x = (uint8_t *)dps[i].x.i64;
+    out.insert(out.end(),x,x + 16);
+
+    uint64_t v[2];
+    PackDistance(&dps[i].d,v);
+    uint8_t *vb = (uint8_t *)v;
+    out.insert(out.end(),vb,vb + dBytes);
+
+  }
+
+}
+
+static bool UnpackDP(uint8_t *buf,uint32_t size,DP *dps,uint32_t nbDP) {
+
+  if(size < 1)
+    return false;
+
+  uint8_t dBytes = buf[0];
+  if(dBytes == 0 || dBytes > 16)
+    return false;
+
+  uint32_t pos = 1;
+  uint32_t h = 0;
+  for(uint32_t i = 0; i < nbDP; i++) {
+
+    // h delta
+    uint32_t delta = 0;
+    int shift = 0;
+    do {
+      if(pos >= size || shift > 21) return false;
+      delta |= (uint32_t)(buf[pos] & 0x7F) << shift;
+      shift += 7;
+    } while(buf[pos++] & 0x80);
+    h += delta;
+    if(h >= HASH_SIZE) return false;
+
+    if(pos + 16 + dBytes > size)
+      return false;
+
+    dps[i].kIdx = 0;
+    dps[i].h = h;
+    memcpy(dps[i].x.i64,buf + pos,16);
+    pos += 16;
+
+    uint64_t v[2] = { 0,0 };
+    memcpy(v,buf + pos,dBytes);
+    pos += dBytes;
+    dps[i].d.i64[0] = (v[0] >> 2) | (v[1] << 62);
+    dps[i].d.i64[1] = (v[1] >> 2) | ((v[0] >> 1 & 0x1ULL) << 63) | ((v[0] & 0x1ULL) << 62);
+
+  }
+
+  return pos == size;
+
+}
+
 void sig_handler(int signo) {
   if(signo == SIGINT) {
     ::printf("\nTerminated\n");
@@ -251,7 +391,7 @@ int32_t Kangaroo::GetServerStatus() {
     return SERVER_END;
   }
 
-  if(saveRequest) {
+  if(saveRequest || insertQueued > INSERT_QUEUE_SIZE) {
     return SERVER_BACKUP;
   }
 
@@ -259,6 +399,67 @@ int32_t Kangaroo::GetServerStatus() {
 
 }
 
+// Longest time from reception to insertion since the last call, DP still waiting included
+double Kangaroo::GetInsertLag() {
+
+  double t = Timer::get_tick();
+  LOCK(queueMutex);
+  double lag = insertLagMax;
+  for(int i = 0; i < SERVER_INSERT; i++)
+    if(insertQueueTime[i] > 0.0 && t - insertQueueTime[i] > lag)
+      lag = t - insertQueueTime[i];
+  insertLagMax = 0.0;
+  UNLOCK(queueMutex);
+  return lag;
+
+}
+
+// Split received DP among the insert threads according to their hash
+void Kangaroo::DispatchDP(DP *dp,uint32_t nbDP) {
+
+  if(relayMode) {
+    // Forwarded upstream by the sender thread
+    LOCK(queueMutex);
+    dpReceived += nbDP;
+    UNLOCK(queueMutex);
+    EnqueueDP(dp,nbDP);
+    free(dp);
+    return;
+  }
+
+  std::vector<DP> part[SERVER_INSERT];
+  uint64_t foreign = 0;
+  uint64_t range = shardEnd - shardStart;
+  for(uint32_t i = 0; i < nbDP; i++) {
+    uint64_t h = (uint64_t)dp[i].h;
+    if(h >= shardStart && h < shardEnd)
+      part[(h - shardStart) * SERVER_INSERT / range].push_back(dp[i]);
+    else
+      foreign++;
+  }
+  free(dp);
+  double t = Timer::get_tick();
+
+  LOCK(queueMutex);
+  dpReceived += nbDP;
+  if(foreign > 0 && foreignDP == 0)
+    ::printf("\nWarning: DP outside of this shard received, client does not support shards (version<4) ?\n");
+  foreignDP += foreign;
+  for(int i = 0; i < SERVER_INSERT; i++) {
+    if(insertQueue[i].size() == 0 && part[i].size() > 0)
+      insertQueueTime[i] = t;
+    insertQueue[i].insert(insertQueue[i].end(),part[i].begin(),part[i].end());
+    insertQueued += part[i].size();
+    // Streamed to the standby servers by the replication thread
+    if(standbys.size() > 0) {
+      replQueue.insert(replQueue.end(),part[i].begin(),part[i].end());
+      replOffset += part[i].size();
+    }
+  }
+  UNLOCK(queueMutex);
+
+}
+
 // Server request handler
 bool Kangaroo::HandleRequest(TH_PARAM *p) {
 
@@ -283,28 +484,80 @@ bool Kangaroo::HandleRequest(TH_PARAM *p) {
     case SERVER_GETCONFIG: {
       ::printf("\nNew connection from %s\n",p->clientInfo);
 
+      if(jobs.size() > 0) {
+        LOCK(ghMutex);
+        MoveToJob(&p->job,p->nbKangaroo,SelectJob());
+        UNLOCK(ghMutex);
+        if(p->job == NULL) {
+          ::printf("\nNo open job for %s, closing connection\n",p->clientInfo);
+          close_socket(p->clientSock);
+          return false;
+        }
+      }
+
       // Send config to the client
+      Kangaroo *job = p->job;
       PUT("Version",p->clientSock,&version,sizeof(uint32_t),ntimeout);
-      PUT("RangeStart",p->clientSock,rangeStart.bits64,32,ntimeout);
-      PUT("RangeEnd",p->clientSock,rangeEnd.bits64,32,ntimeout);
-      PUT("KeyX",p->clientSock,keysToSearch[keyIdx].x.bits64,32,ntimeout);
-      PUT("KeyY",p->clientSock,keysToSearch[keyIdx].y.bits64,32,ntimeout);
-      PUT("DP",p->clientSock,&initDPSize,sizeof(int32_t),ntimeout);
+      PUT("RangeStart",p->clientSock,job->rangeStart.bits64,32,ntimeout);
+      PUT("RangeEnd",p->clientSock,job->rangeEnd.bits64,32,ntimeout);
+      PUT("KeyX",p->clientSock,job->keysToSearch[job->keyIdx].x.bits64,32,ntimeout);
+      PUT("KeyY",p->clientSock,job->keysToSearch[job->keyIdx].y.bits64,32,ntimeout);
+      PUT("DP",p->clientSock,&job->initDPSize,sizeof(int32_t),ntimeout);
 
     } break;
 
     case SERVER_SETKNB: {
-      GET("nbKangaroo",p->clientSock,&p->nbKangaroo,sizeof(uint64_t),ntimeout);
-      totalRW += p->nbKangaroo;
+      // Replace the previous value (a relay updates its number of kangaroos)
+      uint64_t nbKangaroo;
+      GET("nbKangaroo",p->clientSock,&nbKangaroo,sizeof(uint64_t),ntimeout);
+      if(p->job)
+        p->job->totalRW += nbKangaroo - p->nbKangaroo;
+      p->nbKangaroo = nbKangaroo;
     } break;
 
     case SERVER_STATUS: {
 
-      state = GetServerStatus();
+      // A client without job (reconnected version<5 client) is stopped
+      state = p->job ? p->job->GetServerStatus() : SERVER_END;
       PUT("Status",p->clientSock,&state,sizeof(int32_t),ntimeout);
 
     } break;
 
+    case SERVER_GETJOB: {
+      int32_t id = p->job ? p->job->jobId : -1;
+      PUT("JobId",p->clientSock,&id,sizeof(int32_t),ntimeout);
+    } break;
+
+    case SERVER_GETBATCH: {
+      uint32_t target = batchAdvertised;
+      PUT("Batch",p->clientSock,&target,sizeof(uint32_t),ntimeout);
+    } break;
+
+    case SERVER_GETREPL: {
+      uint64_t nb = ClientReplicated(p->clientInfo);
+      PUT("Replicated",p->clientSock,&nb,sizeof(uint64_t),ntimeout);
+    } break;
+
+    case SERVER_GETLAG: {
+      double lag = p->job ? p->job->GetInsertLag() : 0.0;
+      PUT("Lag",p->clientSock,&lag,sizeof(double),ntimeout);
+    } break;
+
+    case SERVER_SETJOB: {
+      int32_t id;
+      GET("JobId",p->clientSock,&id,sizeof(int32_t),ntimeout);
+      if(jobs.size() > 0) {
+        if(id < 0 || id >= (int32_t)jobs.size()) {
+          ::printf("\nUnknown job [%d] from %s, closing connection\n",id,p->clientInfo);
+          close_socket(p->clientSock);
+          return false;
+        }
+        LOCK(ghMutex);
+        MoveToJob(&p->job,p->nbKangaroo,jobs[id]);
+        UNLOCK(ghMutex);
+      }
+    } break;
+
     case SERVER_SENDDP: {
 
       uint32_t nbDP=0;
@@ -324,7 +577,7 @@ bool Kangaroo::HandleRequest(TH_PARAM *p) {
 
         DP *dp = (DP *)malloc(sizeof(DP)*nbDP);
         GETFREE("DP",p->clientSock,dp,sizeof(DP)*nbDP,ntimeout,dp);
-        state = GetServerStatus();
+        state = p->job ? p->job->GetServerStatus() : SERVER_END;
         PUTFREE("Status",p->clientSock,&state,sizeof(int32_t),ntimeout,dp);
 
         if(nbRead != sizeof(DP)*nbDP) {
@@ -351,12 +604,19 @@ bool Kangaroo::HandleRequest(TH_PARAM *p) {
           }
 #endif
 
-          LOCK(ghMutex);
-          DP_CACHE dc;
-          dc.nbDP = nbDP;
-          dc.dp = dp;
-          recvDP.push_back(dc);
-          UNLOCK(ghMutex);
+          if(!SampleDP(p->clientInfo,p->job,dp,nbDP)) {
+            ::printf("\nClosing connection with quarantined client %s\n",p->clientInfo);
+            free(dp);
+            close_socket(p->clientSock);
+            return false;
+          }
+
+          if(p->job) {
+            p->job->DispatchDP(dp,nbDP);
+            p->job->MarkReplicated(p->clientInfo,nbDP);
+          } else {
+            free(dp);
+          }
 
         }
 
@@ -364,6 +624,71 @@ bool Kangaroo::HandleRequest(TH_PARAM *p) {
 
     } break;
 
+    case SERVER_SENDPDP: {
+
+      uint32_t nbDP = 0;
+      uint32_t size = 0;
+
+      GET("nbDP",p->clientSock,&nbDP,sizeof(uint32_t),ntimeout);
+      GET("size",p->clientSock,&size,sizeof(uint32_t),ntimeout);
+
+      if(nbDP == 0 || nbDP > MAX_DP_PER_REQUEST || size > (uint64_t)nbDP * 35 + 1) {
+        ::printf("\nUnexpected number of DP [%d,%d bytes] from %s\n",nbDP,size,p->clientInfo);
+        ::printf("\nClosing connection with %s\n",p->clientInfo);
+        close_socket(p->clientSock);
+        return false;
+      }
+
+      uint8_t *buff = (uint8_t *)malloc(size);
+      GETFREE("DP",p->clientSock,buff,size,ntimeout,buff);
+      state = p->job ? p->job->GetServerStatus() : SERVER_END;
+      PUTFREE("Status",p->clientSock,&state,sizeof(int32_t),ntimeout,buff);
+
+      DP *dp = (DP *)malloc(sizeof(DP)*nbDP);
+      if((uint32_t)nbRead != size || !UnpackDP(buff,size,dp,nbDP)) {
+        ::printf("\nInvalid packed DP from %s\n",p->clientInfo);
+        ::printf("\nClosing connection with %s\n",p->clientInfo);
+        free(buff);
+        free(dp);
+        close_socket(p->clientSock);
+        return false;
+      }
+      free(buff);
+
+      if(!SampleDP(p->clientInfo,p->job,dp,nbDP)) {
+        ::printf("\nClosing connection with quarantined client %s\n",p->clientInfo);
+        free(dp);
+        close_socket(p->clientSock);
+        return false;
+      }
+
+      if(p->job) {
+        p->job->DispatchDP(dp,nbDP);
+        p->job->MarkReplicated(p->clientInfo,nbDP);
+      } else {
+        free(dp);
+      }
+
+    } break;
+
+    case SERVER_GETSHARDS: {
+      std::string map = GetShardMap();
+      PUT("Shards",p->clientSock,map.data(),(int)map.length(),ntimeout);
+    } break;
+
+    case SERVER_SETEND:
+      if(shards.size() > 1 && !relayMode) {
+        if(!IsShardPeer(p->clientInfo)) {
+          ::printf("\nSERVER_SETEND refused from %s (not a shard), closing connection\n",p->clientInfo);
+          close_socket(p->clientSock);
+          return false;
+        }
+        ::printf("\nKey solved by another shard (%s)\n",p->clientInfo);
+        endFromPeer = true;
+        endOfSearch = true;
+      }
+      break;
+
     default:
       ::printf("\nUnexpected command [%d] from %s, closing connection\n",cmdBuff,p->clientInfo);
       close_socket(p->clientSock);
@@ -378,6 +703,24 @@ bool Kangaroo::HandleRequest(TH_PARAM *p) {
 
 }
 
+// Thread per client (AcceptConnections), same bookkeeping as the event server (see CloseConnection)
+void Kangaroo::ClientThread(TH_PARAM *p) {
+
+  LOCK(ghMutex);
+  AddConnectedClient();
+  UNLOCK(ghMutex);
+
+  HandleRequest(p);
+
+  LOCK(ghMutex);
+  RemoveConnectedClient();
+  MoveToJob(&p->job,p->nbKangaroo,NULL);
+  UNLOCK(ghMutex);
+  ForgetClient(p->clientInfo);
+  ForgetReplicated(p->clientInfo);
+
+}
+
 // Threaded proc
 #ifdef WIN64
 DWORD WINAPI _acceptThread(LPVOID lpParam) {
@@ -385,10 +728,7 @@ DWORD WINAPI _acceptThread(LPVOID lpParam) {
 void *_acceptThread(void *lpParam) {
 #endif
   TH_PARAM *p = (TH_PARAM *)lpParam;
-  p->obj->AddConnectedClient();
-  p->obj->HandleRequest(p);
-  p->obj->RemoveConnectedClient();
-  p->obj->RemoveConnectedKangaroo(p->nbKangaroo);
+  p->obj->ClientThread(p);
   p->isRunning = false;
   free(p->clientInfo);
   free(p);
@@ -400,8 +740,9 @@ DWORD WINAPI _processServer(LPVOID lpParam) {
 #else
 void *_processServer(void *lpParam) {
 #endif
-  Kangaroo *obj = (Kangaroo *)lpParam;
-  obj->ProcessServer();
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->ProcessServer();
+  free(p);
   return 0;
 }
 
@@ -410,7 +751,7 @@ void Kangaroo::AcceptConnections(SOCKET server_soc) {
 
   SOCKET clientSock;
 
-  ::printf("Kangaroo server is ready and listening to TCP port %d ...\n",port);
+  ::printf("Kangaroo %s is ready and listening to TCP port %d ...\n",relayMode ? "relay" : "server",relayMode ? relayPort : port);
 
   while(true) {
 
@@ -433,6 +774,7 @@ void Kangaroo::AcceptConnections(SOCKET server_soc) {
       p->clientInfo = ::strdup(info);
 #endif
       p->obj = this;
+      p->job = jobs.empty() ? this : NULL;
       p->isRunning = true;
       p->clientSock = clientSock;
       LaunchThread(_acceptThread,p);
@@ -443,184 +785,1388 @@ void Kangaroo::AcceptConnections(SOCKET server_soc) {
 
 }
 
-// Starts the server
-void Kangaroo::RunServer() {
+#ifdef __linux__
 
-  if(signal(SIGINT,sig_handler) == SIG_ERR)
-    ::printf("\nWarning:can't install singal handler\n");
+// ------------------------------------------------------------------------------------------------------
+// Event driven server (Linux)
+// Non blocking sockets are handled by a small pool of workers sharing one epoll instance.
+// Each socket is armed with EPOLLONESHOT so a connection is processed by one worker at a time.
+// A connection is a state machine which reads the fields of the current request.
+// ------------------------------------------------------------------------------------------------------
 
-  // Set starting parameters
-  InitRange();
-  InitSearchKey();
+#define CONN_CMD   0  // Waiting for a command
+#define CONN_KNB   1  // Waiting for the number of kangaroos
+#define CONN_NBDP  2  // Waiting for the number of DP
+#define CONN_DP    3  // Waiting for the DPs
+#define CONN_PHDR  4  // Waiting for the number of packed DP and their size
+#define CONN_PDP   5  // Waiting for the packed DPs
+#define CONN_JOB   6  // Waiting for the job id
 
-  ComputeExpected((double)initDPSize,&expectedNbOp,&expectedMem);
-  ::printf("Expected operations: 2^%.2f\n",log2(expectedNbOp));
-  ::printf("Expected RAM: %.1fMB\n",expectedMem);
+void *_serverWorker(void *lpParam) {
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->ServerWorker(p);
+  return 0;
+}
 
-  if(initDPSize<0) {
-    ::printf("Error: Server must be launched with a specified number of distinguished bits (-d)\n");
-    exit(-1);
-  }
-  SetDP(initDPSize);
+static void ExpectField(CONNECTION *c,int state,uint64_t size) {
+  c->state = state;
+  c->rPos = 0;
+  c->rSize = size;
+}
 
-  if(sizeof(DP)!=40) {
-    ::printf("Error: Invalid DP size struct\n");
-    exit(-1);
-  }
+void Kangaroo::RunEventServer(SOCKET server_soc) {
 
-  if(saveKangaroo) {
-    ::printf("Waring: Server does not support -ws, ignoring\n");
-    saveKangaroo = false;
+  // Allow as many connections as possible
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&rl);
   }
 
-  // Main thread of server (handle backup and collision check)
-  LaunchThread(_processServer,(TH_PARAM *)this);
-  Timer::SleepMillis(100);
+  listenSock = server_soc;
+  fcntl(listenSock,F_SETFL,fcntl(listenSock,F_GETFL,0) | O_NONBLOCK);
 
-  // Server stuff
+  epollFd = epoll_create1(0);
+  if(epollFd < 0) {
+    ::printf("Warning: epoll_create1 failed (%s), using one thread per client\n",GetNetworkError().c_str());
+    fcntl(listenSock,F_SETFL,fcntl(listenSock,F_GETFL,0) & ~O_NONBLOCK);
+    AcceptConnections(server_soc);
+    return;
+  }
 
-  InitSocket();
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = NULL;
+  epoll_ctl(epollFd,EPOLL_CTL_ADD,listenSock,&ev);
 
-  /* Create socket */
-  serverSock = socket(AF_INET,SOCK_STREAM,0);
+  ::printf("Kangaroo %s is ready and listening to TCP port %d ...\n",relayMode ? "relay" : "server",relayMode ? relayPort : port);
 
-  if(serverSock<0) {
-    ::printf("Error: Invalid socket : %s\n",GetNetworkError().c_str());
-    exit(-1);
+  TH_PARAM *params = (TH_PARAM *)malloc(SERVER_WORKER * sizeof(TH_PARAM));
+  memset(params,0,SERVER_WORKER * sizeof(TH_PARAM));
+  for(int i = 0; i < SERVER_WORKER; i++) {
+    params[i].obj = this;
+    params[i].threadId = i;
+    params[i].isRunning = true;
   }
+  for(int i = 1; i < SERVER_WORKER; i++)
+    LaunchThread(_serverWorker,params + i);
 
-  struct sockaddr_in soc_addr;
-
-  /* Reuse Address */
-  int32_t yes = 1;
-  if(setsockopt(serverSock,SOL_SOCKET,SO_REUSEADDR,(char *)&yes,sizeof(yes)) < 0) {
-    ::printf("Warning: Couldn't Reuse Address: %s\n",GetNetworkError().c_str());
-  }
+  // Worker 0 also checks idle connections
+  ServerWorker(params);
 
-  memset(&soc_addr,0,sizeof(soc_addr));
-  soc_addr.sin_family = AF_INET;
-  soc_addr.sin_port = htons(port);
-  soc_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+}
 
-  if(bind(serverSock,(struct sockaddr*)&soc_addr,sizeof(soc_addr))) {
-    ::printf("Error: Can not bind socket. Another server running?\n%s\n",GetNetworkError().c_str());
-    exit(-1);
-  }
+void Kangaroo::ServerWorker(TH_PARAM *p) {
 
-  if(listen(serverSock,MAX_CLIENT)<0) {
-    ::printf("Error: Can not listen to socket\n%s\n",GetNetworkError().c_str());
-    exit(-1);
-  }
+  struct epoll_event events[16];
+  double lastCheck = Timer::get_tick();
 
-  AcceptConnections(serverSock);
+  while(p->isRunning) {
 
-#ifdef WIN64
-  WSACleanup();
-#endif
+    int n = epoll_wait(epollFd,events,16,1000);
 
-  return;
+    for(int i = 0; i < n; i++) {
+      CONNECTION *c = (CONNECTION *)events[i].data.ptr;
+      if(c == NULL) {
+        AcceptClients();
+      } else {
+        HandleConnection(c,events[i].events);
+      }
+    }
 
-}
+    if(p->threadId == 0) {
+      double t = Timer::get_tick();
+      if(t - lastCheck > 5.0) {
+        CheckIdleConnections();
+        lastCheck = t;
+      }
+    }
 
-// ------------------------------------------------------------------------------------------------------
-// Client part
-// ------------------------------------------------------------------------------------------------------
+  }
 
-// Connection to the server
-bool Kangaroo::ConnectToServer(SOCKET *retSock) {
+}
 
-  lastError = "";
+void Kangaroo::AcceptClients() {
 
-  // Resolve IP
-  if(!hostInfo) {
+  while(true) {
 
-    if(signal(SIGINT,sig_handler) == SIG_ERR)
-      ::printf("\nWarning:can't install singal handler\n");
+    struct sockaddr_in client_add;
+    socklen_t len = sizeof(sockaddr_in);
+    SOCKET clientSock = accept4(listenSock,(struct sockaddr*)&client_add,&len,SOCK_NONBLOCK);
 
-    InitSocket();
+    if(clientSock < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+        ::printf("Error: Invalid Socket returned by accept(): %s\n",GetNetworkError().c_str());
+      break;
+    }
 
-    struct hostent *host_info;
-    host_info = gethostbyname(serverIp.c_str());
-    if(host_info == NULL) {
-      lastError = "Unknown host:" + serverIp;
-      hostInfo = NULL;
-      hostInfoLength = 0;
-      return false;
-    } else {
-      hostInfoLength = host_info->h_length;
-      hostInfo = (char *)malloc(hostInfoLength);
-      ::memcpy(hostInfo,host_info->h_addr,hostInfoLength);
-      hostAddrType = host_info->h_addrtype;
+    CONNECTION *c = (CONNECTION *)malloc(sizeof(CONNECTION));
+    memset(c,0,sizeof(CONNECTION));
+    c->sock = clientSock;
+    ::sprintf(c->info,"%s:%d",inet_ntoa(client_add.sin_addr),ntohs(client_add.sin_port));
+    c->lastActivity = Timer::get_tick();
+    ExpectField(c,CONN_CMD,1);
+    c->job = jobs.empty() ? this : NULL;
+
+    LOCK(ghMutex);
+    connections.push_back(c);
+    AddConnectedClient();
+    UNLOCK(ghMutex);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if(epoll_ctl(epollFd,EPOLL_CTL_ADD,clientSock,&ev) < 0) {
+      ::printf("Error: epoll_ctl(): %s\n",GetNetworkError().c_str());
+      CloseConnection(c);
     }
 
   }
 
-  struct sockaddr_in server;
+  // Rearm listening socket
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = NULL;
+  epoll_ctl(epollFd,EPOLL_CTL_MOD,listenSock,&ev);
 
-  // Build TCP connection
-  SOCKET sock = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-  if(sock < 0) {
-    lastError = "Socket error: " + GetNetworkError();
-    return false;
-  }
+}
 
-  // Use non blocking socket
-#ifdef WIN64
-  unsigned long iMode = 0;
-  if(ioctlsocket(sock,FIONBIO,&iMode) != 0) {
-#else
-  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
-#endif
-    lastError = "Cannot use non blocking socket, " + GetNetworkError();
-    close_socket(sock);
-    return false;
-  }
+void Kangaroo::HandleConnection(CONNECTION *c,uint32_t events) {
 
-  // Connect
-  ::memset(&server,0,sizeof(sockaddr_in));
-  server.sin_family = hostAddrType;
-  ::memcpy((char*)&server.sin_addr,hostInfo,hostInfoLength);
-  server.sin_port = htons(port);
+  bool ok = (events & EPOLLERR) == 0;
 
-  int connectStatus = connect(sock,(struct sockaddr *)&server,sizeof(server));
+  // Pending reply first, no new request is read until it is sent
+  if(ok && c->outSize > 0)
+    ok = FlushConnection(c);
 
-#ifdef WIN64
-  if((connectStatus < 0) && (WSAGetLastError() != WSAEINPROGRESS)) {
-#else
-  if((connectStatus < 0) && (errno != EINPROGRESS)) {
-#endif
-    lastError = "Cannot connect to host: " + GetNetworkError();
-    close_socket(sock);
-    return false;
+  if(ok && c->outSize == 0)
+    ok = ReadConnection(c);
+
+  if(!ok) {
+    CloseConnection(c);
+    return;
   }
 
-  if(connectStatus<0) {
+  struct epoll_event ev;
+  ev.events = ((c->outSize > 0) ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = c;
+  epoll_ctl(epollFd,EPOLL_CTL_MOD,c->sock,&ev);
 
-    // Wait for connection
-    if(!WaitFor(sock,ntimeout,WAIT_FOR_WRITE)) {
-      lastError = "Cannot connect, unreachable host " + serverIp;
-      close_socket(sock);
+}
+
+bool Kangaroo::ReadConnection(CONNECTION *c) {
+
+  while(c->outSize == 0) {
+
+    char *buf = (c->state == CONN_DP || c->state == CONN_PDP) ? (char *)c->dp : c->hdr;
+    ssize_t rd = recv(c->sock,buf + c->rPos,(size_t)(c->rSize - c->rPos),0);
+
+    if(rd == 0) {
+      // Closed by peer
       return false;
     }
 
-    // Check connection completion
-    int socket_err;
-#ifdef WIN64
-    int serrlen = sizeof socket_err;
-    if(getsockopt(sock,SOL_SOCKET,SO_ERROR,(char *)&socket_err,&serrlen) != 0) {
-#else
-    socklen_t serrlen = sizeof(socket_err);
-    if(getsockopt(sock,SOL_SOCKET,SO_ERROR,&socket_err,&serrlen) == -1) {
-#endif
-      lastError = "Cannot connect to host: " + GetNetworkError();
-      close_socket(sock);
+    if(rd < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      ::printf("\nReadError(%s): %s\n",c->info,GetNetworkError().c_str());
       return false;
     }
 
-    if(socket_err != 0) {
-      lastError = "Cannot connect to host: " + string(strerror(socket_err));
-      close_socket(sock);
-      return false;
+    c->rPos += rd;
+    c->lastActivity = Timer::get_tick();
+
+    if(c->rPos == c->rSize) {
+      if(!ProcessCommand(c))
+        return false;
+    }
+
+  }
+
+  return true;
+
+}
+
+bool Kangaroo::FlushConnection(CONNECTION *c) {
+
+  while(c->outPos < c->outSize) {
+
+    ssize_t wr = send(c->sock,c->out + c->outPos,c->outSize - c->outPos,MSG_NOSIGNAL);
+
+    if(wr < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      ::printf("\nWriteError(%s): %s\n",c->info,GetNetworkError().c_str());
+      return false;
+    }
+
+    c->outPos += (uint32_t)wr;
+    c->lastActivity = Timer::get_tick();
+
+  }
+
+  c->outPos = 0;
+  c->outSize = 0;
+  return true;
+
+}
+
+void Kangaroo::QueueReply(CONNECTION *c,void *buf,uint32_t size) {
+
+  memcpy(c->out + c->outSize,buf,size);
+  c->outSize += size;
+
+}
+
+bool Kangaroo::ProcessCommand(CONNECTION *c) {
+
+  int32_t state;
+
+  switch(c->state) {
+
+  case CONN_CMD:
+
+    switch(c->hdr[0]) {
+
+    case SERVER_GETCONFIG: {
+      ::printf("\nNew connection from %s\n",c->info);
+      if(jobs.size() > 0) {
+        LOCK(ghMutex);
+        MoveToJob(&c->job,c->nbKangaroo,SelectJob());
+        UNLOCK(ghMutex);
+        if(c->job == NULL) {
+          ::printf("\nNo open job for %s, closing connection\n",c->info);
+          return false;
+        }
+      }
+      Kangaroo *job = c->job;
+      uint32_t version = SERVER_VERSION;
+      QueueReply(c,&version,sizeof(uint32_t));
+      QueueReply(c,job->rangeStart.bits64,32);
+      QueueReply(c,job->rangeEnd.bits64,32);
+      QueueReply(c,job->keysToSearch[job->keyIdx].x.bits64,32);
+      QueueReply(c,job->keysToSearch[job->keyIdx].y.bits64,32);
+      QueueReply(c,&job->initDPSize,sizeof(int32_t));
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_STATUS:
+      // A client without job (reconnected version<5 client) is stopped
+      state = c->job ? c->job->GetServerStatus() : SERVER_END;
+      QueueReply(c,&state,sizeof(int32_t));
+      ExpectField(c,CONN_CMD,1);
+      break;
+
+    case SERVER_GETJOB: {
+      int32_t id = c->job ? c->job->jobId : -1;
+      QueueReply(c,&id,sizeof(int32_t));
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_GETBATCH: {
+      uint32_t target = batchAdvertised;
+      QueueReply(c,&target,sizeof(uint32_t));
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_GETREPL: {
+      uint64_t nb = ClientReplicated(c->info);
+      QueueReply(c,&nb,sizeof(uint64_t));
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_GETLAG: {
+      double lag = c->job ? c->job->GetInsertLag() : 0.0;
+      QueueReply(c,&lag,sizeof(double));
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_SETJOB:
+      ExpectField(c,CONN_JOB,sizeof(int32_t));
+      break;
+
+    case SERVER_SETKNB:
+      ExpectField(c,CONN_KNB,sizeof(uint64_t));
+      break;
+
+    case SERVER_SENDDP:
+      ExpectField(c,CONN_NBDP,sizeof(uint32_t));
+      break;
+
+    case SERVER_SENDPDP:
+      ExpectField(c,CONN_PHDR,2 * sizeof(uint32_t));
+      break;
+
+    case SERVER_GETSHARDS: {
+      std::string map = GetShardMap();
+      QueueReply(c,(void *)map.data(),(uint32_t)map.length());
+      ExpectField(c,CONN_CMD,1);
+    } break;
+
+    case SERVER_SETEND:
+      if(shards.size() > 1 && !relayMode) {
+        if(!IsShardPeer(c->info)) {
+          ::printf("\nSERVER_SETEND refused from %s (not a shard), closing connection\n",c->info);
+          return false;
+        }
+        ::printf("\nKey solved by another shard (%s)\n",c->info);
+        endFromPeer = true;
+        endOfSearch = true;
+      }
+      ExpectField(c,CONN_CMD,1);
+      break;
+
+    default:
+      ::printf("\nUnexpected command [%d] from %s, closing connection\n",c->hdr[0],c->info);
+      return false;
+
+    }
+    break;
+
+  case CONN_KNB: {
+    uint64_t nbKangaroo;
+    memcpy(&nbKangaroo,c->hdr,sizeof(uint64_t));
+    if(c->job)
+      c->job->totalRW += nbKangaroo - c->nbKangaroo;
+    c->nbKangaroo = nbKangaroo;
+    ExpectField(c,CONN_CMD,1);
+  } break;
+
+  case CONN_JOB: {
+    int32_t id;
+    memcpy(&id,c->hdr,sizeof(int32_t));
+    if(jobs.size() > 0) {
+      if(id < 0 || id >= (int32_t)jobs.size()) {
+        ::printf("\nUnknown job [%d] from %s, closing connection\n",id,c->info);
+        return false;
+      }
+      LOCK(ghMutex);
+      MoveToJob(&c->job,c->nbKangaroo,jobs[id]);
+      UNLOCK(ghMutex);
+    }
+    ExpectField(c,CONN_CMD,1);
+  } break;
+
+  case CONN_NBDP:
+    memcpy(&c->nbDP,c->hdr,sizeof(uint32_t));
+    if(c->nbDP == 0 || c->nbDP > MAX_DP_PER_REQUEST) {
+      ::printf("\nUnexpected number of DP [%d] from %s\n",c->nbDP,c->info);
+      return false;
+    }
+    c->dp = (DP *)malloc(sizeof(DP) * c->nbDP);
+    ExpectField(c,CONN_DP,sizeof(DP) * (uint64_t)c->nbDP);
+    break;
+
+  case CONN_DP: {
+
+#ifdef VALIDITY_POINT_CHECK
+    // Check validity
+    for(uint32_t i = 0; i < c->nbDP; i++) {
+      uint64_t h = (uint64_t)c->dp[i].h;
+      if(h >= HASH_SIZE) {
+        ::printf("\nInvalid data from: %s [at dp=%d]\n",c->info,i);
+        return false;
+      }
+    }
+#endif
+
+    if(!SampleDP(c->info,c->job,c->dp,c->nbDP)) {
+      ::printf("\nDP dropped, client %s is quarantined\n",c->info);
+      return false;
+    }
+
+    state = c->job ? c->job->GetServerStatus() : SERVER_END;
+    QueueReply(c,&state,sizeof(int32_t));
+
+    c->nbDPRecv += c->nbDP;
+    if(c->job) {
+      c->job->DispatchDP(c->dp,c->nbDP);
+      c->job->MarkReplicated(c->info,c->nbDP);
+    } else {
+      free(c->dp);
+    }
+    c->dp = NULL;
+    c->nbDP = 0;
+    ExpectField(c,CONN_CMD,1);
+
+  } break;
+
+  case CONN_PHDR: {
+    uint32_t size;
+    memcpy(&c->nbDP,c->hdr,sizeof(uint32_t));
+    memcpy(&size,c->hdr + 4,sizeof(uint32_t));
+    if(c->nbDP == 0 || c->nbDP > MAX_DP_PER_REQUEST || size > (uint64_t)c->nbDP * 35 + 1) {
+      ::printf("\nUnexpected number of DP [%d,%d bytes] from %s\n",c->nbDP,size,c->info);
+      return false;
+    }
+    c->dp = (DP *)malloc(size);
+    ExpectField(c,CONN_PDP,size);
+  } break;
+
+  case CONN_PDP: {
+
+    DP *dp = (DP *)malloc(sizeof(DP) * c->nbDP);
+    if(!UnpackDP((uint8_t *)c->dp,(uint32_t)c->rSize,dp,c->nbDP)) {
+      ::printf("\nInvalid packed DP from %s\n",c->info);
+      free(dp);
+      return false;
+    }
+    safe_free(c->dp);
+
+    if(!SampleDP(c->info,c->job,dp,c->nbDP)) {
+      ::printf("\nDP dropped, client %s is quarantined\n",c->info);
+      free(dp);
+      return false;
+    }
+
+    state = c->job ? c->job->GetServerStatus() : SERVER_END;
+    QueueReply(c,&state,sizeof(int32_t));
+
+    c->nbDPRecv += c->nbDP;
+    if(c->job) {
+      c->job->DispatchDP(dp,c->nbDP);
+      c->job->MarkReplicated(c->info,c->nbDP);
+    } else {
+      free(dp);
+    }
+    c->dp = NULL;
+    c->nbDP = 0;
+    ExpectField(c,CONN_CMD,1);
+
+  } break;
+
+  }
+
+  return FlushConnection(c);
+
+}
+
+void Kangaroo::CloseConnection(CONNECTION *c) {
+
+  ::printf("\nClosing connection with %s\n",c->info);
+
+  LOCK(ghMutex);
+  for(size_t i = 0; i < connections.size(); i++) {
+    if(connections[i] == c) {
+      connections[i] = connections.back();
+      connections.pop_back();
+      break;
+    }
+  }
+  RemoveConnectedClient();
+  MoveToJob(&c->job,c->nbKangaroo,NULL);
+  UNLOCK(ghMutex);
+  ForgetClient(c->info);
+  ForgetReplicated(c->info);
+
+  epoll_ctl(epollFd,EPOLL_CTL_DEL,c->sock,NULL);
+  close_socket(c->sock);
+  safe_free(c->dp);
+  free(c);
+
+}
+
+void Kangaroo::CheckIdleConnections() {
+
+  // Idle connections are shut down, the owning worker then closes them
+  double t = Timer::get_tick();
+  double ioTimeout = (double)ntimeout / 1000.0;
+
+  LOCK(ghMutex);
+  for(size_t i = 0; i < connections.size(); i++) {
+    CONNECTION *c = connections[i];
+    bool inRequest = (c->state != CONN_CMD) || (c->rPos > 0) || (c->outSize > 0);
+    double timeout = inRequest ? ioTimeout : CLIENT_TIMEOUT;
+    if(t - c->lastActivity > timeout)
+      shutdown(c->sock,SHUT_RDWR);
+  }
+  UNLOCK(ghMutex);
+
+}
+
+#endif
+
+// Set starting parameters of the server (or of a job)
+bool Kangaroo::InitServer() {
+
+  InitRange();
+  InitSearchKey();
+
+  ComputeExpected((double)initDPSize,&expectedNbOp,&expectedMem);
+  ::printf("Expected operations: 2^%.2f\n",log2(expectedNbOp));
+  ::printf("Expected RAM: %.1fMB\n",expectedMem);
+
+  if(initDPSize<0) {
+    ::printf("Error: Server must be launched with a specified number of distinguished bits (-d)\n");
+    return false;
+  }
+  SetDP(initDPSize);
+
+  if(saveKangaroo) {
+    ::printf("Waring: Server does not support -ws, ignoring\n");
+    saveKangaroo = false;
+  }
+
+  return true;
+
+}
+
+// Starts the server
+void Kangaroo::RunServer() {
+
+  if(signal(SIGINT,sig_handler) == SIG_ERR)
+    ::printf("\nWarning:can't install singal handler\n");
+
+  serverMode = true;
+
+  if(relayMode) {
+    // Configuration comes from upstream
+    if(!GetConfigFromServer())
+      exit(-1);
+    if(workFile.length() > 0) {
+      ::printf("Warning: Relay does not keep DP, ignoring -w\n");
+      workFile = "";
+    }
+  }
+
+  if(sizeof(DP)!=40) {
+    ::printf("Error: Invalid DP size struct\n");
+    exit(-1);
+  }
+
+  if(jobs.size() > 0) {
+
+    if(workFile.length() > 0) {
+      ::printf("Warning: Work files are given by the job file, ignoring -w\n");
+      workFile = "";
+    }
+
+    // Each job has its own main thread, hash table and insert threads
+    for(size_t i = 0; i < jobs.size(); i++) {
+      ::printf("\033[1;36m[Job %d]\033[0m Weight %d Priority %d %s\n",(int)i,jobs[i]->jobWeight,jobs[i]->jobPriority,
+        jobs[i]->workFile.c_str());
+      if(!jobs[i]->InitServer())
+        exit(-1);
+      // Not through LaunchThread, which sets obj to the front server
+      TH_PARAM *jp = (TH_PARAM *)malloc(sizeof(TH_PARAM));
+      memset(jp,0,sizeof(TH_PARAM));
+      jp->obj = jobs[i];
+      THREAD_HANDLE jh;
+#ifdef WIN64
+      jh = CreateThread(NULL,0,_processServer,(void*)jp,0,NULL);
+#else
+      pthread_create(&jh,NULL,_processServer,(void*)jp);
+#endif
+      jobThreads.push_back(jh);
+    }
+
+  } else {
+
+    if(!InitServer())
+      exit(-1);
+
+  }
+
+  // Main thread of server (handle backup and collision check)
+  TH_PARAM *sp = (TH_PARAM *)malloc(sizeof(TH_PARAM));
+  memset(sp,0,sizeof(TH_PARAM));
+  LaunchThread(_processServer,sp);
+  Timer::SleepMillis(100);
+
+  // Server stuff
+
+  InitSocket();
+
+  /* Create socket */
+  serverSock = socket(AF_INET,SOCK_STREAM,0);
+
+  if(serverSock<0) {
+    ::printf("Error: Invalid socket : %s\n",GetNetworkError().c_str());
+    exit(-1);
+  }
+
+  struct sockaddr_in soc_addr;
+
+  /* Reuse Address */
+  int32_t yes = 1;
+  if(setsockopt(serverSock,SOL_SOCKET,SO_REUSEADDR,(char *)&yes,sizeof(yes)) < 0) {
+    ::printf("Warning: Couldn't Reuse Address: %s\n",GetNetworkError().c_str());
+  }
+
+  memset(&soc_addr,0,sizeof(soc_addr));
+  soc_addr.sin_family = AF_INET;
+  soc_addr.sin_port = htons(relayMode ? relayPort : port);
+  soc_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(bind(serverSock,(struct sockaddr*)&soc_addr,sizeof(soc_addr))) {
+    ::printf("Error: Can not bind socket. Another server running?\n%s\n",GetNetworkError().c_str());
+    exit(-1);
+  }
+
+#ifdef __linux__
+  int backlog = SOMAXCONN;
+#else
+  int backlog = MAX_CLIENT;
+#endif
+
+  if(listen(serverSock,backlog)<0) {
+    ::printf("Error: Can not listen to socket\n%s\n",GetNetworkError().c_str());
+    exit(-1);
+  }
+
+  if(metricsPort > 0)
+    StartMetrics();
+
+  if(shmName.length() > 0)
+    StartShm();
+
+#ifdef __linux__
+  RunEventServer(serverSock);
+#else
+  AcceptConnections(serverSock);
+#endif
+
+#ifdef WIN64
+  WSACleanup();
+#endif
+
+  return;
+
+}
+
+// ------------------------------------------------------------------------------------------------------
+// Shards
+// Shard i of n owns the hash buckets [ceil(i*HASH_SIZE/n),ceil((i+1)*HASH_SIZE/n)[. Clients get the
+// shard map with SERVER_GETSHARDS and send each DP to the shard owning its bucket.
+// ------------------------------------------------------------------------------------------------------
+
+static bool ParseHost(std::string entry,std::string &host,int &port) {
+
+  size_t pos = entry.rfind(':');
+  if(pos == std::string::npos || pos == 0 || entry.length() > 255)
+    return false;
+  host = entry.substr(0,pos);
+  port = atoi(entry.substr(pos + 1).c_str());
+  return port > 0 && port < 65536;
+
+}
+
+static SHARD NewShard() {
+
+  SHARD s;
+  s.port = 0;
+  s.hostInfo = NULL;
+  s.hostInfoLength = 0;
+  s.hostAddrType = 0;
+  s.sock = 0;
+  s.isConnected = false;
+  s.status = "OK";
+  s.offset = 0;
+  s.lastConnect = 0.0;
+  return s;
+
+}
+
+// Comma separated list of host:port
+bool Kangaroo::ParseHostList(std::string list,std::vector<SHARD> &hosts) {
+
+  hosts.clear();
+  size_t start = 0;
+  while(start <= list.length()) {
+    size_t end = list.find(',',start);
+    if(end == std::string::npos) end = list.length();
+    SHARD s = NewShard();
+    if(!ParseHost(list.substr(start,end - start),s.host,s.port))
+      return false;
+    hosts.push_back(s);
+    start = end + 1;
+  }
+  return true;
+
+}
+
+bool Kangaroo::ParseShardMap(std::string shardMap) {
+
+  if(!ParseHostList(shardMap,shards))
+    return false;
+
+  // The map must fit in a connection reply buffer
+  return shards.size() <= MAX_SHARD && GetShardMap().length() <= 1000;
+
+}
+
+// [nbShard u32] then [len u8][host:port] for each shard
+std::string Kangaroo::GetShardMap() {
+
+  // Clients of a relay send their DP to the relay
+  uint32_t nbShard = relayMode ? 0 : (uint32_t)shards.size();
+  std::string map((char *)&nbShard,sizeof(uint32_t));
+  for(size_t i = 0; i < nbShard; i++) {
+    std::string entry = shards[i].host + ":" + ::to_string(shards[i].port);
+    map.push_back((char)entry.length());
+    map += entry;
+  }
+  return map;
+
+}
+
+uint32_t Kangaroo::ShardOf(uint32_t h) {
+  return (uint32_t)(((uint64_t)h * shards.size()) / HASH_SIZE);
+}
+
+// Exchange the current server connection with the one of a shard
+void Kangaroo::SwapShard(SHARD *s) {
+
+  std::swap(serverIp,s->host);
+  std::swap(port,s->port);
+  std::swap(hostInfo,s->hostInfo);
+  std::swap(hostInfoLength,s->hostInfoLength);
+  std::swap(hostAddrType,s->hostAddrType);
+  std::swap(serverConn,s->sock);
+  std::swap(isConnected,s->isConnected);
+  std::swap(serverStatus,s->status);
+
+}
+
+// Send DP to their shard, DP of shards which are down or busy are left in dps
+void Kangaroo::SendToShards(std::vector<DP> &dps,bool final) {
+
+  std::vector< std::vector<DP> > parts(shards.size());
+  for(size_t i = 0; i < dps.size(); i++)
+    parts[ShardOf(dps[i].h)].push_back(dps[i]);
+  dps.clear();
+
+  std::string status = "OK";
+  for(size_t i = 0; i < shards.size(); i++) {
+    if(parts[i].size() > 0 && (!endOfSearch || final))
+      SendToShard(&shards[i],parts[i],final);
+    dps.insert(dps.end(),parts[i].begin(),parts[i].end());
+    if(status == "OK" && shards[i].status != "OK")
+      status = shards[i].status;
+  }
+  if(!endOfSearch)
+    serverStatus = status;
+
+}
+
+// Connection to a shard, on its own connection state
+bool Kangaroo::ConnectShard(SHARD *s) {
+
+  s->lastConnect = Timer::get_tick();
+  s->isConnected = ConnectToHost(s->host,s->port,&s->hostInfo,&s->hostInfoLength,&s->hostAddrType,&s->sock);
+  if(!s->isConnected) {
+    if(s->status != "Fault")
+      ::printf("\nCannot connect to shard %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+    s->status = "Fault";
+    return false;
+  }
+  s->status = "OK";
+  return true;
+
+}
+
+void Kangaroo::CloseShard(SHARD *s) {
+
+  if(s->isConnected)
+    close_socket(s->sock);
+  s->isConnected = false;
+  s->status = "Fault";
+
+}
+
+// Send DP to one shard, returns false and keeps dps if the shard is down or busy. A shard which
+// is down is retried every SHARD_RETRY seconds, a shard in backup receives nothing during SHARD_RETRY.
+bool Kangaroo::SendToShard(SHARD *s,std::vector<DP> &dps,bool final) {
+
+  double t = Timer::get_tick();
+
+  if(!s->isConnected) {
+    if(!final && t - s->lastConnect < SHARD_RETRY)
+      return false;
+    if(!ConnectShard(s))
+      return false;
+    if(serverVersion >= 2 && !SendKangarooNumber(s))
+      return false;
+  } else if(!final && s->status == "Backup" && t - s->lastConnect < SHARD_RETRY) {
+    return false;
+  }
+
+  uint32_t nbDP = (uint32_t)dps.size();
+  int32_t status;
+  std::vector<uint8_t> buff;
+  PackDP(dps,buff);
+  uint32_t size = (uint32_t)buff.size();
+  char cmd = SERVER_SENDPDP;
+
+  bool ok = Write(s->sock,&cmd,1,ntimeout) > 0 &&
+            Write(s->sock,(char *)&nbDP,sizeof(uint32_t),ntimeout) > 0 &&
+            Write(s->sock,(char *)&size,sizeof(uint32_t),ntimeout) > 0 &&
+            Write(s->sock,(char *)buff.data(),size,ntimeout) > 0 &&
+            Read(s->sock,(char *)&status,sizeof(int32_t),ntimeout) > 0;
+  if(!ok) {
+    ::printf("\nSendToShard(%s:%d): %s\n",s->host.c_str(),s->port,lastError.c_str());
+    CloseShard(s);
+    return false;
+  }
+
+  AckDP(dps.data(),dps.size());
+  dps.clear();
+
+  switch(status) {
+  case SERVER_OK:
+    s->status = "OK";
+    break;
+  case SERVER_END:
+    s->status = "END";
+    endOfSearch = true;
+    break;
+  case SERVER_BACKUP:
+    s->status = "Backup";
+    s->lastConnect = t;
+    break;
+  }
+  return true;
+
+}
+
+bool Kangaroo::SendKangarooNumber(SHARD *s) {
+
+  uint64_t nbKangaroo = totalRW;
+  char cmd = SERVER_SETKNB;
+
+  if(Write(s->sock,&cmd,1,ntimeout) <= 0 || Write(s->sock,(char *)&nbKangaroo,sizeof(uint64_t),ntimeout) <= 0) {
+    ::printf("\nWriteError(nbKangaroo) %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+    CloseShard(s);
+    return false;
+  }
+  upstreamRW = nbKangaroo;
+  return true;
+
+}
+
+// SERVER_SETEND is only accepted from the hosts of the shard map
+bool Kangaroo::IsShardPeer(const char *info) {
+
+  std::string ip(info);
+  ip = ip.substr(0,ip.find(':'));
+  for(int i = 0; i < (int)shards.size(); i++) {
+    if(i == shardId || shards[i].hostInfo == NULL)
+      continue;
+    struct in_addr addr;
+    ::memcpy(&addr,shards[i].hostInfo,(std::min)(shards[i].hostInfoLength,(int)sizeof(addr)));
+    if(ip == std::string(inet_ntoa(addr)))
+      return true;
+  }
+  return false;
+
+}
+
+// Tell the other shards that the key is solved
+void Kangaroo::BroadcastEnd() {
+
+  for(int i = 0; i < (int)shards.size(); i++) {
+
+    if(i == shardId)
+      continue;
+
+    SHARD *s = &shards[i];
+    SOCKET sock;
+    if(ConnectToHost(s->host,s->port,&s->hostInfo,&s->hostInfoLength,&s->hostAddrType,&sock)) {
+      char cmd = SERVER_SETEND;
+      if(Write(sock,&cmd,1,ntimeout) <= 0)
+        ::printf("\nCannot notify shard %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+      close_socket(sock);
+    } else {
+      ::printf("\nCannot notify shard %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+    }
+
+  }
+
+}
+
+// Get the shard map from the server (version>=4)
+bool Kangaroo::GetShardsFromServer() {
+
+  int nbRead;
+  int nbWrite;
+  uint32_t nbShard;
+
+  char cmd = SERVER_GETSHARDS;
+  PUT("CMD",serverConn,&cmd,1,ntimeout);
+  GET("nbShard",serverConn,&nbShard,sizeof(uint32_t),ntimeout);
+
+  if(nbShard > MAX_SHARD) {
+    ::printf("Invalid shard map from %s\n",serverIp.c_str());
+    return false;
+  }
+
+  shards.clear();
+  for(uint32_t i = 0; i < nbShard; i++) {
+    uint8_t len;
+    char entry[256];
+    GET("ShardLength",serverConn,&len,1,ntimeout);
+    GET("Shard",serverConn,entry,len,ntimeout);
+    entry[len] = 0;
+    SHARD s = NewShard();
+    if(!ParseHost(string(entry),s.host,s.port)) {
+      ::printf("Invalid shard map from %s\n",serverIp.c_str());
+      return false;
+    }
+    shards.push_back(s);
+  }
+
+  if(shards.size() < 2) {
+    // Single server
+    shards.clear();
+    return true;
+  }
+
+  // DP are now sent to the shards on their own connections
+  ::printf("Shard map: %d servers\n",(int)shards.size());
+  close_socket(serverConn);
+  isConnected = false;
+  for(size_t i = 0; i < shards.size(); i++) {
+    // Unreachable shards are retried by SendToShard
+    if(ConnectShard(&shards[i]) && serverVersion >= 2)
+      SendKangarooNumber(&shards[i]);
+  }
+  return true;
+
+}
+
+// ------------------------------------------------------------------------------------------------------
+// Standby replication (-standby)
+// The primary streams the DP it accepts to its standby servers, which build their own hash table and
+// can take over the clients (-c primary:port,standby:port). A standby is a plain server started
+// with the same input file.
+// ------------------------------------------------------------------------------------------------------
+
+// Replication thread: streams the accepted DP to the standby servers every SERVER_TICK, on the
+// connections of the standbys, so that a slow or unreachable standby does not block the server
+void Kangaroo::ReplicateThread(TH_PARAM *p) {
+
+  while(!endOfSearch) {
+    Timer::SleepMillis((uint32_t)(SERVER_TICK*1000.0));
+    Replicate();
+  }
+
+  // Last DP, the standbys find the same collision and stop
+  Replicate();
+
+}
+
+// Stream the DP accepted since the last call to the standby servers
+void Kangaroo::Replicate() {
+
+  std::vector<DP> dps;
+  LOCK(queueMutex);
+  dps.swap(replQueue);
+  replTaken += dps.size();
+  UNLOCK(queueMutex);
+
+  double t = Timer::get_tick();
+  uint64_t acked = replTaken;
+
+  for(size_t i = 0; i < standbys.size(); i++) {
+
+    SHARD *s = &standbys[i];
+    if(s->status == "Invalid")
+      continue;
+    s->pending.insert(s->pending.end(),dps.begin(),dps.end());
+    if(s->pending.size() > REPL_BACKLOG) {
+      ::printf("\nWarning: standby %s:%d lost %d DP, restart it from a work file of this server\n",
+               s->host.c_str(),s->port,(int)s->pending.size());
+      s->offset += s->pending.size();
+      s->pending.clear();
+    }
+
+    if(!s->isConnected && (s->lastConnect == 0.0 || t - s->lastConnect > REPL_RETRY)) {
+      s->lastConnect = t;
+      ConnectStandby(s);
+    }
+    if(s->isConnected && s->pending.size() > 0)
+      SendToStandby(s,s->pending);
+
+    if(s->status != "Invalid" && s->offset < acked)
+      acked = s->offset;
+
+  }
+
+  LOCK(queueMutex);
+  replAcked = acked;
+  UNLOCK(queueMutex);
+
+}
+
+// Connect to a standby and check that it searches the same key
+bool Kangaroo::ConnectStandby(SHARD *s) {
+
+  if(!ConnectToHost(s->host,s->port,&s->hostInfo,&s->hostInfoLength,&s->hostAddrType,&s->sock)) {
+    if(s->status == "OK")
+      ::printf("\nCannot connect to standby %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+    s->status = "Fault";
+    return false;
+  }
+
+  uint32_t version;
+  Int sStart;
+  Int sEnd;
+  Point key;
+  int32_t dp;
+  sStart.SetInt32(0);
+  sEnd.SetInt32(0);
+  key.Clear();
+  key.z.SetInt32(1);
+
+  char cmd = SERVER_GETCONFIG;
+  bool ok = Write(s->sock,&cmd,1,ntimeout) > 0 &&
+            Read(s->sock,(char *)&version,sizeof(uint32_t),ntimeout) > 0 &&
+            Read(s->sock,(char *)sStart.bits64,32,ntimeout) > 0 &&
+            Read(s->sock,(char *)sEnd.bits64,32,ntimeout) > 0 &&
+            Read(s->sock,(char *)key.x.bits64,32,ntimeout) > 0 &&
+            Read(s->sock,(char *)key.y.bits64,32,ntimeout) > 0 &&
+            Read(s->sock,(char *)&dp,sizeof(int32_t),ntimeout) > 0;
+  if(!ok) {
+    ::printf("\nCannot get configuration of standby %s:%d: %s\n",s->host.c_str(),s->port,lastError.c_str());
+    close_socket(s->sock);
+    s->status = "Fault";
+    return false;
+  }
+
+  if(version < 3 || !sStart.IsEqual(&rangeStart) || !sEnd.IsEqual(&rangeEnd) || !key.equals(keysToSearch[keyIdx])) {
+    ::printf("\nStandby %s:%d does not search the same key (or version<3), ignoring it\n",s->host.c_str(),s->port);
+    close_socket(s->sock);
+    s->status = "Invalid";
+    return false;
+  }
+
+  ::printf("\nReplicating to standby %s:%d\n",s->host.c_str(),s->port);
+  s->isConnected = true;
+  s->status = "OK";
+  return true;
+
+}
+
+bool Kangaroo::SendToStandby(SHARD *s,std::vector<DP> &dps) {
+
+  int32_t status;
+  std::vector<uint8_t> buff;
+
+  uint32_t nbDP = (uint32_t)dps.size();
+  PackDP(dps,buff);
+  uint32_t size = (uint32_t)buff.size();
+  char cmd = SERVER_SENDPDP;
+
+  bool ok = Write(s->sock,&cmd,1,ntimeout) > 0 &&
+            Write(s->sock,(char *)&nbDP,sizeof(uint32_t),ntimeout) > 0 &&
+            Write(s->sock,(char *)&size,sizeof(uint32_t),ntimeout) > 0 &&
+            Write(s->sock,(char *)buff.data(),size,ntimeout) > 0 &&
+            Read(s->sock,(char *)&status,sizeof(int32_t),ntimeout) > 0;
+  if(!ok) {
+    // Sent again after reconnection
+    ::printf("\nSendToStandby(%s:%d): %s\n",s->host.c_str(),s->port,lastError.c_str());
+    close_socket(s->sock);
+    s->isConnected = false;
+    s->status = "Fault";
+    return false;
+  }
+  s->offset += dps.size();
+  dps.clear();
+
+  if(status == SERVER_END && !endOfSearch) {
+    // The standby also receives DP from clients which failed over
+    ::printf("\nKey solved by standby %s:%d\n",s->host.c_str(),s->port);
+    endOfSearch = true;
+  }
+  return true;
+
+}
+
+// End of a request of a client, its DP are at the end of replQueue
+void Kangaroo::MarkReplicated(const char *info,uint32_t nbDP) {
+
+  if(standbys.size() == 0)
+    return;
+
+  LOCK(queueMutex);
+  REPL_CLIENT &c = replClients[info];
+  c.received += nbDP;
+  c.marks.push_back(std::make_pair(replOffset,c.received));
+  UNLOCK(queueMutex);
+
+}
+
+// Number of DP of a client streamed to all standbys (SERVER_GETREPL)
+uint64_t Kangaroo::ClientReplicated(const char *info) {
+
+  if(standbys.size() == 0)
+    return UINT64_MAX;
+
+  LOCK(queueMutex);
+  REPL_CLIENT &c = replClients[info];
+  while(c.marks.size() > 0 && c.marks.front().first <= replAcked) {
+    c.replicated = c.marks.front().second;
+    c.marks.pop_front();
+  }
+  uint64_t nb = c.replicated;
+  UNLOCK(queueMutex);
+  return nb;
+
+}
+
+void Kangaroo::ForgetReplicated(const char *info) {
+
+  if(standbys.size() == 0)
+    return;
+
+  LOCK(queueMutex);
+  replClients.erase(info);
+  UNLOCK(queueMutex);
+
+}
+
+// ------------------------------------------------------------------------------------------------------
+// Jobs
+// A server started with -jobs hosts several searches, each job has its own range, key, DP size,
+// hash table and work file. A new client is given the open job with the highest priority and
+// the lowest number of clients per weight, it resumes this job with SERVER_SETJOB after a reconnection.
+// ------------------------------------------------------------------------------------------------------
+
+// One job per line: inputFile dpBits [workFile|-] [weight] [priority]
+// The job restarts from its work file when it exists
+bool Kangaroo::LoadJobs(std::string &fileName) {
+
+  FILE *fp = fopen(fileName.c_str(),"r");
+  if(fp == NULL) {
+    ::printf("Error: Cannot open %s %s\n",fileName.c_str(),strerror(errno));
+    return false;
+  }
+
+  char line[1024];
+  int lineNb = 0;
+  while(fgets(line,sizeof(line),fp)) {
+
+    lineNb++;
+    char input[512];
+    char work[512];
+    int dp;
+    int weight = 1;
+    int priority = 0;
+    strcpy(work,"-");
+
+    char *l = line;
+    while(isspace(*l)) l++;
+    if(*l == 0 || *l == '#')
+      continue;
+
+    if(sscanf(l,"%511s %d %511s %d %d",input,&dp,work,&weight,&priority) < 2 || dp < 0 || weight <= 0) {
+      ::printf("%s, error line %d: %s\n",fileName.c_str(),lineNb,l);
+      fclose(fp);
+      return false;
+    }
+
+    string iFile = string(input);
+    string wFile = (strcmp(work,"-") == 0) ? "" : string(work);
+    string noFile = "";
+    // Jobs share the storage options of the front server, network features stay on the front server
+    KANGAROO_OPT opt;
+    opt.useJournal = useJournal;
+    opt.saveBackground = saveBackground;
+    opt.compactKangaroo = compactKangaroo;
+    opt.packTable = packTable;
+    opt.savePart = savePart;
+    opt.ioLimit = ioLimit;
+    opt.validRate = 0.0;
+    Kangaroo *job = new Kangaroo(secp,dp,false,wFile,noFile,saveWorkPeriod,false,maxStep,wtimeout,port,ntimeout,"",
+                                 outputFile,splitWorkfile,prvFile,opt);
+    job->jobId = (int)jobs.size();
+    job->jobWeight = (uint32_t)weight;
+    job->jobPriority = priority;
+
+    ::printf("\033[1;36m[Job %d]\033[0m %s\n",job->jobId,iFile.c_str());
+    bool ok;
+    FILE *fw = (wFile.length() > 0) ? fopen(wFile.c_str(),"rb") : NULL;
+    if(fw) {
+      fclose(fw);
+      ok = job->LoadWork(wFile);
+    } else {
+      ok = job->ParseConfigFile(iFile);
+    }
+    if(!ok) {
+      fclose(fp);
+      return false;
+    }
+
+    jobs.push_back(job);
+
+  }
+
+  fclose(fp);
+
+  if(jobs.size() == 0) {
+    ::printf("Error: %s, no job found\n",fileName.c_str());
+    return false;
+  }
+
+  return true;
+
+}
+
+// Job given to a new client (ghMutex locked)
+Kangaroo *Kangaroo::SelectJob() {
+
+  Kangaroo *best = NULL;
+  for(size_t i = 0; i < jobs.size(); i++) {
+    Kangaroo *j = jobs[i];
+    if(j->endOfSearch)
+      continue;
+    if(best == NULL || j->jobPriority > best->jobPriority) {
+      best = j;
+    } else if(j->jobPriority == best->jobPriority) {
+      // Fewer clients per weight (round robin for equal weights)
+      if((uint64_t)j->connectedClient * best->jobWeight < (uint64_t)best->connectedClient * j->jobWeight)
+        best = j;
+    }
+  }
+  return best;
+
+}
+
+// Move a client and its kangaroos to another job (ghMutex locked)
+void Kangaroo::MoveToJob(Kangaroo **job,uint64_t nbKangaroo,Kangaroo *newJob) {
+
+  if(*job == newJob)
+    return;
+
+  // Without -jobs, clients are counted at connection time
+  if(*job) {
+    (*job)->RemoveConnectedKangaroo(nbKangaroo);
+    if(*job != this) (*job)->RemoveConnectedClient();
+  }
+  if(newJob) {
+    newJob->totalRW += nbKangaroo;
+    if(newJob != this) newJob->AddConnectedClient();
+  }
+  *job = newJob;
+
+}
+
+// ------------------------------------------------------------------------------------------------------
+// Client part
+// ------------------------------------------------------------------------------------------------------
+
+// Connection to the server
+bool Kangaroo::ConnectToServer(SOCKET *retSock) {
+  return ConnectToHost(serverIp,port,&hostInfo,&hostInfoLength,&hostAddrType,retSock);
+}
+
+// Resolve IP (once)
+bool Kangaroo::ResolveHost(std::string &host,char **hInfo,int *hInfoLength,int *hAddrType) {
+
+  if(*hInfo)
+    return true;
+
+  if(signal(SIGINT,sig_handler) == SIG_ERR)
+    ::printf("\nWarning:can't install singal handler\n");
+
+  InitSocket();
+
+  struct hostent *host_info;
+  host_info = gethostbyname(host.c_str());
+  if(host_info == NULL) {
+    lastError = "Unknown host:" + host;
+    *hInfoLength = 0;
+    return false;
+  }
+
+  *hInfoLength = host_info->h_length;
+  *hInfo = (char *)malloc(*hInfoLength);
+  ::memcpy(*hInfo,host_info->h_addr,*hInfoLength);
+  *hAddrType = host_info->h_addrtype;
+  return true;
+
+}
+
+// Connection to a server given by its host and port
+bool Kangaroo::ConnectToHost(std::string &host,int hPort,char **hInfo,int *hInfoLength,int *hAddrType,SOCKET *retSock) {
+
+  lastError = "";
+
+  if(!ResolveHost(host,hInfo,hInfoLength,hAddrType))
+    return false;
+
+  struct sockaddr_in server;
+
+  // Build TCP connection
+  SOCKET sock = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+  if(sock < 0) {
+    lastError = "Socket error: " + GetNetworkError();
+    return false;
+  }
+
+  // Use non blocking socket
+#ifdef WIN64
+  unsigned long iMode = 0;
+  if(ioctlsocket(sock,FIONBIO,&iMode) != 0) {
+#else
+  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
+#endif
+    lastError = "Cannot use non blocking socket, " + GetNetworkError();
+    close_socket(sock);
+    return false;
+  }
+
+  // Connect
+  ::memset(&server,0,sizeof(sockaddr_in));
+  server.sin_family = *hAddrType;
+  ::memcpy((char*)&server.sin_addr,*hInfo,*hInfoLength);
+  server.sin_port = htons(hPort);
+
+  int connectStatus = connect(sock,(struct sockaddr *)&server,sizeof(server));
+
+#ifdef WIN64
+  if((connectStatus < 0) && (WSAGetLastError() != WSAEINPROGRESS)) {
+#else
+  if((connectStatus < 0) && (errno != EINPROGRESS)) {
+#endif
+    lastError = "Cannot connect to host: " + GetNetworkError();
+    close_socket(sock);
+    return false;
+  }
+
+  if(connectStatus<0) {
+
+    // Wait for connection
+    if(!WaitFor(sock,ntimeout,WAIT_FOR_WRITE)) {
+      lastError = "Cannot connect, unreachable host " + host;
+      close_socket(sock);
+      return false;
+    }
+
+    // Check connection completion
+    int socket_err;
+#ifdef WIN64
+    int serrlen = sizeof socket_err;
+    if(getsockopt(sock,SOL_SOCKET,SO_ERROR,(char *)&socket_err,&serrlen) != 0) {
+#else
+    socklen_t serrlen = sizeof(socket_err);
+    if(getsockopt(sock,SOL_SOCKET,SO_ERROR,&socket_err,&serrlen) == -1) {
+#endif
+      lastError = "Cannot connect to host: " + GetNetworkError();
+      close_socket(sock);
+      return false;
+    }
+
+    if(socket_err != 0) {
+      lastError = "Cannot connect to host: " + string(strerror(socket_err));
+      close_socket(sock);
+      return false;
     }
 
   }
@@ -661,107 +2207,494 @@ void Kangaroo::WaitForServer() {
     while(!isConnected) {
       serverStatus = "Fault";
       Timer::SleepMillis(1000);
-      // Try to reconnect
+      // Try to reconnect, or the next server of the failover list
       isConnected = ConnectToServer(&serverConn);
+      if(!isConnected)
+        NextServer();
+      else
+        replayPending = servers.size() > 1;
+      // The server forgets our job and our kangaroos with the connection
+      if(isConnected && jobId >= 0)
+        SendJobId();
+      if(isConnected && serverVersion >= 2)
+        SendKangarooNumber();
+    }
+
+    // Wait for ready
+    while(isConnected && !ok) {
+
+      char cmd = SERVER_STATUS;
+      nbWrite = Write(serverConn,&cmd,1,ntimeout);
+      if( nbWrite<=0 ) {
+
+        if(nbWrite<0)
+          ::printf("\nSendToServer(Status): %s\n",lastError.c_str()); 
+        serverStatus = "Not OK";
+        close_socket(serverConn);
+        isConnected = false;
+
+      } else {
+
+        nbRead = Read(serverConn,(char *)(&status),sizeof(int32_t),ntimeout);
+        if( nbRead<=0 ) {
+          if(nbRead<0)
+            ::printf("\nRecvFromServer(Status): %s\n",lastError.c_str()); 
+          serverStatus = "Fault";
+          close_socket(serverConn);
+          isConnected = false;
+        } else {
+
+          switch(status) {
+          case SERVER_OK:
+            serverStatus = "OK";
+            ok = true;
+            break;
+
+          case SERVER_END:
+            serverStatus = "END";
+            endOfSearch = true;
+            ok = true;
+            break;
+
+          case SERVER_BACKUP:
+            serverStatus = "Backup";
+            Timer::SleepMillis(1000);
+            break;
+          }
+
+        }
+
+      }
+
+    }
+
+  }
+
+}
+
+// Queue DP for the sender thread (called by solver threads)
+void Kangaroo::QueueDP(std::vector<ITEM> &dps) {
+
+  uint32_t nbDP = (uint32_t)dps.size();
+  if(nbDP==0)
+    return;
+
+  DP *dp = (DP *)malloc(sizeof(DP)*nbDP);
+  uint32_t nb = 0;
+  for(uint32_t i = 0; i<nbDP; i++) {
+
+    int128_t X;
+    int128_t D;
+    uint64_t h;
+    HashTable::Convert(&dps[i].x,&dps[i].d,dps[i].kIdx % 2,&h,&X,&D);
+
+    dp[nb].kIdx = (uint32_t)dps[i].kIdx;
+    dp[nb].h = (uint32_t)h;
+    dp[nb].x.i64[0] = X.i64[0];
+    dp[nb].x.i64[1] = X.i64[1];
+    dp[nb].d.i64[0] = D.i64[0];
+    dp[nb].d.i64[1] = D.i64[1];
+
+    // Kangaroo restored from backup walking again a path already sent
+    if(ackDP.size() > 0 && std::binary_search(ackDP.begin(),ackDP.end(),dp[nb],compareDPFull))
+      continue;
+    nb++;
+
+  }
+  dps.clear();
+
+  if(nb < nbDP) {
+    LOCK(sendMutex);
+    ackSuppressed += nbDP - nb;
+    UNLOCK(sendMutex);
+  }
+
+  if(nb > 0)
+    EnqueueDP(dp,nb);
+  free(dp);
+
+}
+
+// Append DP to the sender queue, spill to disk when full
+void Kangaroo::EnqueueDP(DP *dp,uint32_t nbDP) {
+
+  LOCK(sendMutex);
+
+  if(sendQueue.size() + nbDP <= SEND_QUEUE_SIZE) {
+
+    if(sendQueue.size() == 0)
+      sendQueueTime = Timer::get_tick();
+    sendQueue.insert(sendQueue.end(),dp,dp + nbDP);
+
+  } else {
+
+    // Queue full (server unreachable or too slow), spill to local file
+    if(spillFile == NULL) {
+      spillFile = fopen(spillFileName.c_str(),"wb+");
+      if(spillFile == NULL)
+        ::printf("\nQueueDP: Cannot open %s %s\n",spillFileName.c_str(),strerror(errno));
+      spillRead = 0;
+      spillWrite = 0;
+    }
+    if(spillFile) {
+      FSeek(spillFile,spillWrite * sizeof(DP));
+      if(fwrite(dp,sizeof(DP),nbDP,spillFile) != nbDP)
+        ::printf("\nQueueDP: Cannot write to %s %s\n",spillFileName.c_str(),strerror(errno));
+      else
+        spillWrite += nbDP;
+    }
+
+  }
+
+  UNLOCK(sendMutex);
+
+}
+
+// Read back a chunk of spilled DP (oldest first)
+void Kangaroo::ReadSpill(std::vector<DP> &dps) {
+
+  LOCK(sendMutex);
+
+  if(spillFile && spillRead < spillWrite) {
+
+    uint64_t nbDP = spillWrite - spillRead;
+    if(nbDP > SPILL_CHUNK) nbDP = SPILL_CHUNK;
+    dps.resize(nbDP);
+    fflush(spillFile);
+    FSeek(spillFile,spillRead * sizeof(DP));
+    if(fread(dps.data(),sizeof(DP),nbDP,spillFile) != nbDP) {
+      ::printf("\nReadSpill: Cannot read %s %s\n",spillFileName.c_str(),strerror(errno));
+      dps.clear();
+      nbDP = spillWrite - spillRead;
+    }
+    spillRead += nbDP;
+
+    if(spillRead == spillWrite) {
+      // Everything read back, restart from the beginning of the file
+      spillRead = 0;
+      spillWrite = 0;
     }
 
-    // Wait for ready
-    while(isConnected && !ok) {
+  }
+
+  UNLOCK(sendMutex);
+
+}
+
+// ----------------------------------------------------------------------------
+// Acknowledged DP (client)
+// DP acknowledged by the server since the last kangaroo backup are appended to
+// <workFile>.ack: [HEADA][version] followed by DP records. When the client restarts
+// from this backup, the kangaroos walk again the same paths and the DP found in this
+// file are not sent again.
+
+void Kangaroo::LoadAck(std::string fileName) {
+
+  string aName = fileName + ".ack";
+
+  FILE *f = fopen(aName.c_str(),"rb");
+  if(f == NULL)
+    return;
+
+  uint32_t head = 0;
+  uint32_t version;
+  if(::fread(&head,sizeof(uint32_t),1,f) != 1 || head != HEADA) {
+    ::printf("LoadAck: %s is not an acknowledged DP file\n",aName.c_str());
+    fclose(f);
+    return;
+  }
+  ::fread(&version,sizeof(uint32_t),1,f);
+
+  // A truncated record (crash while writing) is ignored
+  DP buff[4096];
+  size_t nb;
+  while((nb = ::fread(buff,sizeof(DP),4096,f)) > 0)
+    ackDP.insert(ackDP.end(),buff,buff + nb);
+  fclose(f);
+
+  std::sort(ackDP.begin(),ackDP.end(),compareDPFull);
+  ackDP.erase(std::unique(ackDP.begin(),ackDP.end(),equalDP),ackDP.end());
+
+  ::printf("LoadAck: %s [%d DP]\n",aName.c_str(),(int)ackDP.size());
+
+}
+
+// Start a new acknowledged DP file (a kangaroo backup has been written)
+void Kangaroo::ResetAck(bool keepLoaded) {
+
+  string aName = workFile + ".ack";
+
+  LOCK(sendMutex);
+
+  if(ackFile)
+    fclose(ackFile);
+
+  ackFile = fopen(aName.c_str(),"wb");
+  if(ackFile == NULL) {
+    ::printf("\nResetAck: Cannot open %s for writing\n",aName.c_str());
+    ::printf("%s\n",::strerror(errno));
+  } else {
+    uint32_t head = HEADA;
+    uint32_t version = 0;
+    ::fwrite(&head,sizeof(uint32_t),1,ackFile);
+    ::fwrite(&version,sizeof(uint32_t),1,ackFile);
+    // Until the first backup, the loaded DP are still ahead of the restored kangaroos
+    if(keepLoaded && ackDP.size() > 0)
+      ::fwrite(ackDP.data(),sizeof(DP),ackDP.size(),ackFile);
+    fflush(ackFile);
+  }
+
+  UNLOCK(sendMutex);
+
+}
+
+void Kangaroo::AckDP(DP *dp,size_t nbDP) {
 
-      char cmd = SERVER_STATUS;
-      nbWrite = Write(serverConn,&cmd,1,ntimeout);
-      if( nbWrite<=0 ) {
+  if(ackFile == NULL || nbDP == 0)
+    return;
 
-        if(nbWrite<0)
-          ::printf("\nSendToServer(Status): %s\n",lastError.c_str()); 
-        serverStatus = "Not OK";
-        close_socket(serverConn);
-        isConnected = false;
+  LOCK(sendMutex);
+  if(ackFile) {
+    ::fwrite(dp,sizeof(DP),nbDP,ackFile);
+    fflush(ackFile);
+  }
+  UNLOCK(sendMutex);
 
-      } else {
+}
 
-        nbRead = Read(serverConn,(char *)(&status),sizeof(int32_t),ntimeout);
-        if( nbRead<=0 ) {
-          if(nbRead<0)
-            ::printf("\nRecvFromServer(Status): %s\n",lastError.c_str()); 
-          serverStatus = "Fault";
-          close_socket(serverConn);
-          isConnected = false;
-        } else {
+// DP sender thread, owns serverConn once the configuration is retrieved
+void Kangaroo::SendDP(TH_PARAM *p) {
 
-          switch(status) {
-          case SERVER_OK:
-            serverStatus = "OK";
-            ok = true;
-            break;
+  std::vector<DP> dps;
+  double lastSend = 0.0;
+  double lastRefresh = Timer::get_tick();
 
-          case SERVER_END:
-            serverStatus = "END";
-            endOfSearch = true;
-            ok = true;
-            break;
+  while(!endOfSearch) {
 
-          case SERVER_BACKUP:
-            serverStatus = "Backup";
-            Timer::SleepMillis(1000);
-            break;
-          }
+    if(dps.size() == 0) {
+      ReadSpill(dps);
+      if(dps.size() == 0) {
+        LOCK(sendMutex);
+        if(BatchReady(lastSend))
+          dps.swap(sendQueue);
+        UNLOCK(sendMutex);
+      }
+    } else if(shards.size() > 0 && dps.size() < SEND_QUEUE_SIZE) {
+      // DP of shards which are down are kept, the other shards still get the new DP
+      LOCK(sendMutex);
+      if(BatchReady(lastSend)) {
+        dps.insert(dps.end(),sendQueue.begin(),sendQueue.end());
+        sendQueue.clear();
+      }
+      UNLOCK(sendMutex);
+    }
 
+    if(relayMode) {
+      // Forward our clients' kangaroo number
+      if(totalRW != upstreamRW) {
+        if(shards.size() > 0) {
+          for(size_t i = 0; i < shards.size(); i++)
+            if(shards[i].isConnected) SendKangarooNumber(&shards[i]);
+        } else if(isConnected) {
+          SendKangarooNumber();
         }
-
       }
+      relayDup += DedupeDP(dps);
+    }
+
+    if(dps.size() == 0) {
+      Timer::SleepMillis(20);
+      continue;
+    }
+
+    // On failure, dps is kept and sent again after reconnection
+    size_t nbDP = dps.size();
+    if(shards.size() > 0)
+      SendToShards(dps);
+    else
+      SendToServer(dps);
+    relaySent += nbDP - dps.size();
+    lastSend = Timer::get_tick();
+    if(dps.size() == nbDP && shards.size() > 0)
+      Timer::SleepMillis(20);
+
+    if(serverVersion >= 7 && servers.size() > 1 && isConnected && lastSend - replayTime > FAILOVER_ACK_PERIOD) {
+      GetReplicated();
+      replayTime = lastSend;
+    }
 
+    if(serverVersion >= 6 && shards.size() == 0 && isConnected && lastSend - lastRefresh > BATCH_REFRESH) {
+      GetBatchTarget();
+      lastRefresh = lastSend;
     }
 
   }
 
+  if(localCollision.size() > 0) {
+    // Key solved by the local table: the server checks the collision and stops the other clients
+    if(shards.size() > 0)
+      SendToShards(localCollision,true);
+    else
+      SendToServer(localCollision,true);
+  }
+
+  LOCK(sendMutex);
+  if(spillFile) {
+    fclose(spillFile);
+    spillFile = NULL;
+    remove(spillFileName.c_str());
+  }
+  if(ackFile) {
+    fclose(ackFile);
+    ackFile = NULL;
+  }
+  UNLOCK(sendMutex);
+
+  if(shmClient)
+    ShmDetach();
+
+}
+
+// Adaptive batching (sendMutex locked): send when the server target size is reached, at most
+// one batch every BATCH_RTT_FACTOR round trips, or when the oldest DP has waited SEND_PERIOD
+bool Kangaroo::BatchReady(double lastSend) {
+
+  if(sendQueue.size() == 0)
+    return false;
+
+  double t = Timer::get_tick();
+  if(t - sendQueueTime >= SEND_PERIOD)
+    return true;
+
+  return sendQueue.size() >= batchTarget && (t - lastSend) >= BATCH_RTT_FACTOR * rtt;
+
 }
 
 // Send DP to Server
-bool Kangaroo::SendToServer(std::vector<ITEM> &dps) {
+// final: last batch sent after the end of search (collision found by the local table)
+bool Kangaroo::SendToServer(std::vector<DP> &dps,bool final) {
 
   int nbRead;
   int nbWrite;
-  uint32_t nbDP = (uint32_t)dps.size();
   if(dps.size()==0)
     return false;
 
-  WaitForServer();
+  if(shmClient)
+    return ShmSend(dps,final);
+
+  // The reply to the previous batch carries the server status
+  if(final) {
+    if(!isConnected)
+      return false;
+  } else if(!isConnected || serverStatus != "OK") {
+    WaitForServer();
+  }
+
+  if(replayPending && !final) {
+    // New connection after a failover, DP which were not reported on the standbys are sent again
+    replayPending = false;
+    dps.insert(dps.end(),replayDP.begin(),replayDP.end());
+    replayDP.clear();
+    replayBase = 0;
+  }
 
-  if(!endOfSearch) {
+  if(!endOfSearch || final) {
 
+    uint32_t nbDP = (uint32_t)dps.size();
     int32_t status;
+    double t0 = Timer::get_tick();
 
-    // Send DP
-    DP *dp = (DP *)malloc(sizeof(DP)*nbDP);
-    for(uint32_t i = 0; i<nbDP; i++) {
+    if(serverVersion >= 3) {
 
-      int128_t X;
-      int128_t D;
-      uint64_t h;
-      HashTable::Convert(&dps[i].x,&dps[i].d,dps[i].kIdx % 2,&h,&X,&D);
+      std::vector<uint8_t> buff;
+      PackDP(dps,buff);
+      uint32_t size = (uint32_t)buff.size();
+      char cmd = SERVER_SENDPDP;
 
-      dp[i].kIdx = (uint32_t)dps[i].kIdx;
-      dp[i].h = (uint32_t)h;
-      dp[i].x.i64[0] = X.i64[0];
-      dp[i].x.i64[1] = X.i64[1];
-      dp[i].d.i64[0] = D.i64[0];
-      dp[i].d.i64[1] = D.i64[1];
+      PUT("CMD",serverConn,&cmd,1,ntimeout);
+      PUT("nbDP",serverConn,&nbDP,sizeof(uint32_t),ntimeout);
+      PUT("size",serverConn,&size,sizeof(uint32_t),ntimeout);
+      PUT("DP",serverConn,buff.data(),size,ntimeout);
+
+    } else {
+
+      char cmd = SERVER_SENDDP;
+
+      PUT("CMD",serverConn,&cmd,1,ntimeout);
+      PUT("nbDP",serverConn,&nbDP,sizeof(uint32_t),ntimeout);
+      PUT("DP",serverConn,dps.data(),sizeof(DP)*nbDP,ntimeout);
 
     }
 
-    char cmd = SERVER_SENDDP;
+    GET("Status",serverConn,&status,sizeof(uint32_t),ntimeout);
 
-    PUTFREE("CMD",serverConn,&cmd,1,ntimeout,dp);
-    PUTFREE("nbDP",serverConn,&nbDP,sizeof(uint32_t),ntimeout,dp);
-    PUTFREE("DP",serverConn,dp,sizeof(DP)*nbDP,ntimeout,dp);
-    GETFREE("Status",serverConn,&status,sizeof(uint32_t),ntimeout,dp)
+    double t1 = Timer::get_tick();
+    rtt = (rtt == 0.0) ? (t1 - t0) : 0.8 * rtt + 0.2 * (t1 - t0);
 
+    AckDP(dps.data(),dps.size());
+    if(servers.size() > 1)
+      KeepForReplay(dps);
     dps.clear();
-    free(dp);
 
+    switch(status) {
+    case SERVER_OK:
+      serverStatus = "OK";
+      break;
+    case SERVER_END:
+      serverStatus = "END";
+      endOfSearch = true;
+      break;
+    case SERVER_BACKUP:
+      serverStatus = "Backup";
+      break;
+    }
+
+  }
+
+  return true;
+
+}
+
+// Switch to the next server of the failover list
+void Kangaroo::NextServer() {
+
+  if(servers.size() < 2 || shards.size() > 0)
+    return;
+
+  SwapShard(&servers[serverIdx]);
+  serverIdx = (serverIdx + 1) % (int)servers.size();
+  SwapShard(&servers[serverIdx]);
+  ::printf("\nTrying server %s:%d\n",serverIp.c_str(),port);
+
+}
+
+// Keep the DP sent on this connection until the server reports them on its standbys
+void Kangaroo::KeepForReplay(std::vector<DP> &dps) {
+
+  replayDP.insert(replayDP.end(),dps.begin(),dps.end());
+  if(replayDP.size() > FAILOVER_REPLAY_MAX) {
+    size_t n = replayDP.size() - FAILOVER_REPLAY_MAX;
+    replayDP.erase(replayDP.begin(),replayDP.begin() + n);
+    replayBase += n;
   }
 
+}
+
+// Number of DP sent on this connection which reached the standbys of the server (version>=7)
+bool Kangaroo::GetReplicated() {
+
+  int nbRead;
+  int nbWrite;
+  uint64_t nb;
+  char cmd = SERVER_GETREPL;
+
+  PUT("CMD",serverConn,&cmd,1,ntimeout);
+  GET("Replicated",serverConn,&nb,sizeof(uint64_t),ntimeout);
+  if(nb > replayBase) {
+    size_t n = (size_t)(std::min)(nb - replayBase,(uint64_t)replayDP.size());
+    replayDP.erase(replayDP.begin(),replayDP.begin() + n);
+    replayBase += n;
+  }
   return true;
 
 }
@@ -778,12 +2711,57 @@ void Kangaroo::RemoveConnectedKangaroo(uint64_t nb) {
   totalRW -= nb;
 }
 
+// Send our number of kangaroos (version>=2), a relay sends the total of its clients
+bool Kangaroo::SendKangarooNumber() {
+
+  int nbWrite;
+  uint64_t nbKangaroo = totalRW;
+  char cmd = SERVER_SETKNB;
+
+  PUT("CMD",serverConn,&cmd,1,ntimeout);
+  PUT("nbKangaroo",serverConn,&nbKangaroo,sizeof(uint64_t),ntimeout);
+  upstreamRW = nbKangaroo;
+  return true;
+
+}
+
+// Target batch size advertised by the server (version>=6)
+bool Kangaroo::GetBatchTarget() {
+
+  int nbRead;
+  int nbWrite;
+  uint32_t target;
+  char cmd = SERVER_GETBATCH;
+
+  PUT("CMD",serverConn,&cmd,1,ntimeout);
+  GET("Batch",serverConn,&target,sizeof(uint32_t),ntimeout);
+  if(target > 0)
+    batchTarget = target;
+  return true;
+
+}
+
+// Resume our job on a new connection (version>=5)
+bool Kangaroo::SendJobId() {
+
+  int nbWrite;
+  char cmd = SERVER_SETJOB;
+
+  PUT("CMD",serverConn,&cmd,1,ntimeout);
+  PUT("JobId",serverConn,&jobId,sizeof(int32_t),ntimeout);
+  return true;
+
+}
+
 // Get configuration from server
 bool Kangaroo::GetConfigFromServer() {
 
   int nbRead;
   int nbWrite;
 
+  if(shmClient)
+    return ShmConfig();
+
   if(!ConnectToServer(&serverConn)) {
     ::printf("Cannot connect to server: %s\n%s\n",serverIp.c_str(),lastError.c_str());
     return false;
@@ -804,6 +2782,7 @@ bool Kangaroo::GetConfigFromServer() {
   uint32_t version;
 
   GET("Version",serverConn,&version,sizeof(uint32_t),ntimeout);
+  serverVersion = version;
   GET("RangeStart",serverConn,rangeStart.bits64,32,ntimeout);
   GET("RangeEnd",serverConn,rangeEnd.bits64,32,ntimeout);
   GET("KeyX",serverConn,key.x.bits64,32,ntimeout);
@@ -812,9 +2791,27 @@ bool Kangaroo::GetConfigFromServer() {
 
   if(version>=2) {
     // Set kangaroo number
-    char cmd = SERVER_SETKNB;
+    if(!SendKangarooNumber())
+      return false;
+  }
+
+  if(version>=5) {
+    // Job assigned by the server, resumed after a reconnection
+    char cmd = SERVER_GETJOB;
     PUT("CMD",serverConn,&cmd,1,ntimeout);
-    PUT("nbKangaroo",serverConn,&totalRW,sizeof(uint64_t),ntimeout);
+    GET("JobId",serverConn,&jobId,sizeof(int32_t),ntimeout);
+    if(jobId >= 0)
+      ::printf("Job: %d\n",jobId);
+  }
+
+  if(version>=6) {
+    if(!GetBatchTarget())
+      return false;
+  }
+
+  if(version>=4) {
+    if(!GetShardsFromServer())
+      return false;
   }
 
   ::printf("Succesfully connected to server: %s (Version %d)\n",serverIp.c_str(),version);
@@ -825,3 +2822,497 @@ bool Kangaroo::GetConfigFromServer() {
 
 }
 
+
+// ------------------------------------------------------------------------------------------------------
+// Load generator
+// Simulated clients streaming random DP to a server, a real collision can be planted to measure the
+// detection time. Threads use raw blocking sockets, lastError is not touched outside the main thread.
+// ------------------------------------------------------------------------------------------------------
+
+#define LOAD_KANGAROO (1ULL<<20)  // Kangaroo number announced by each simulated client
+
+typedef struct {
+
+  uint64_t nbDP;        // DP acknowledged by the server
+  uint64_t nbRequest;
+  uint64_t nbBackup;    // Requests answered while the server was saving
+  double   rttSum;      // Request round trip (sec)
+  double   rttMax;
+  bool     ended;
+  bool     failed;
+
+} LOAD_STAT;
+
+static LOAD_STAT *loadStat = NULL;
+static int loadClient = 0;
+static int loadRate = 0;
+static int loadBatch = 0;
+static DP loadPlant[2];
+static bool loadPlantPending[2] = { false,false };
+static int loadPlantAck = 0;     // Planted DP acknowledged by the server
+static double loadPlantTime = 0.0;
+
+static bool SendAll(SOCKET s,void *buf,int size) {
+  char *b = (char *)buf;
+  while(size > 0) {
+    int nb = (int)send(s,b,size,0);
+    if(nb <= 0) return false;
+    b += nb;
+    size -= nb;
+  }
+  return true;
+}
+
+static bool RecvAll(SOCKET s,void *buf,int size) {
+  char *b = (char *)buf;
+  while(size > 0) {
+    int nb = (int)recv(s,b,size,0);
+    if(nb <= 0) return false;
+    b += nb;
+    size -= nb;
+  }
+  return true;
+}
+
+static inline uint64_t LoadRand(uint64_t *s) {
+  // xorshift64*
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545F4914F6CDD1DULL;
+}
+
+#ifdef __linux__
+
+// Pid of the local process listening on port, 0 if not found
+static int GetListenerPid(int port) {
+
+  uint64_t inode = 0;
+  const char *tables[2] = { "/proc/net/tcp","/proc/net/tcp6" };
+  for(int t = 0; t < 2 && inode == 0; t++) {
+    FILE *f = fopen(tables[t],"r");
+    if(f == NULL) continue;
+    char line[512];
+    while(inode == 0 && fgets(line,sizeof(line),f)) {
+      unsigned int lPort,state;
+      unsigned long ino;
+      if(sscanf(line,"%*d: %*[0-9A-Fa-f]:%X %*[0-9A-Fa-f]:%*X %X %*X:%*X %*X:%*X %*X %*d %*d %lu",
+                &lPort,&state,&ino) == 3 && lPort == (unsigned int)port && state == 0x0A)
+        inode = ino;
+    }
+    fclose(f);
+  }
+  if(inode == 0)
+    return 0;
+
+  char target[64];
+  sprintf(target,"socket:[%lu]",(unsigned long)inode);
+
+  int pid = 0;
+  DIR *proc = opendir("/proc");
+  if(proc == NULL)
+    return 0;
+  struct dirent *pe;
+  while(pid == 0 && (pe = readdir(proc)) != NULL) {
+    if(pe->d_name[0] < '0' || pe->d_name[0] > '9') continue;
+    string fdDir = string("/proc/") + pe->d_name + "/fd";
+    DIR *fds = opendir(fdDir.c_str());
+    if(fds == NULL) continue;
+    struct dirent *fe;
+    while(pid == 0 && (fe = readdir(fds)) != NULL) {
+      char link[64];
+      string fdName = fdDir + "/" + fe->d_name;
+      ssize_t l = readlink(fdName.c_str(),link,sizeof(link) - 1);
+      if(l <= 0) continue;
+      link[l] = 0;
+      if(strcmp(link,target) == 0)
+        pid = atoi(pe->d_name);
+    }
+    closedir(fds);
+  }
+  closedir(proc);
+  return pid;
+
+}
+
+// Resident size of a process in MB, -1 if unknown
+static double GetRSS(int pid) {
+
+  char name[64];
+  sprintf(name,"/proc/%d/status",pid);
+  FILE *f = fopen(name,"r");
+  if(f == NULL)
+    return -1.0;
+  char line[256];
+  double rss = -1.0;
+  while(fgets(line,sizeof(line),f)) {
+    unsigned long kb;
+    if(sscanf(line,"VmRSS: %lu kB",&kb) == 1) {
+      rss = (double)kb / 1024.0;
+      break;
+    }
+  }
+  fclose(f);
+  return rss;
+
+}
+
+#else
+
+static int GetListenerPid(int port) {
+  return 0;
+}
+
+static double GetRSS(int pid) {
+  return -1.0;
+}
+
+#endif
+
+#ifdef WIN64
+DWORD WINAPI _loadClient(LPVOID lpParam) {
+#else
+void *_loadClient(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->LoadClient(p);
+  return 0;
+}
+
+void Kangaroo::LoadClient(TH_PARAM *p) {
+
+  LOAD_STAT *st = loadStat + p->threadId;
+  SOCKET s = p->clientSock;
+
+  // Blocking socket with timeouts
+#ifdef WIN64
+  DWORD tmo = (DWORD)ntimeout;
+#else
+  fcntl(s,F_SETFL,fcntl(s,F_GETFL,0) & ~O_NONBLOCK);
+  struct timeval tmo;
+  tmo.tv_sec = ntimeout / 1000;
+  tmo.tv_usec = (ntimeout % 1000) * 1000;
+#endif
+  setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,(char *)&tmo,sizeof(tmo));
+  setsockopt(s,SOL_SOCKET,SO_SNDTIMEO,(char *)&tmo,sizeof(tmo));
+
+  // Same handshake as a client
+  char cmd = SERVER_GETCONFIG;
+  uint8_t config[4 + 4 * 32 + 4];
+  bool ok = SendAll(s,&cmd,1) && RecvAll(s,config,sizeof(config));
+  if(ok && serverVersion >= 5 && jobId >= 0) {
+    int32_t id = jobId;
+    cmd = SERVER_SETJOB;
+    ok = SendAll(s,&cmd,1) && SendAll(s,&id,sizeof(int32_t));
+  }
+  if(ok && serverVersion >= 2) {
+    uint64_t nbKangaroo = LOAD_KANGAROO;
+    cmd = SERVER_SETKNB;
+    ok = SendAll(s,&cmd,1) && SendAll(s,&nbKangaroo,sizeof(uint64_t));
+  }
+
+  uint64_t seed = (uint64_t)(p->threadId + 1) * 0x9E3779B97F4A7C15ULL ^ (uint64_t)(Timer::get_tick() * 1e6);
+  double period = (double)loadBatch * (double)loadClient / (double)loadRate;
+  double next = Timer::get_tick() + period * (double)p->threadId / (double)loadClient;
+  std::vector<DP> dps;
+  std::vector<uint8_t> buff;
+
+  while(ok && p->isRunning && !endOfSearch) {
+
+    // Pace requests to reach the requested rate
+    double t = Timer::get_tick();
+    if(t < next) {
+      Timer::SleepMillis((uint32_t)((next - t) * 1000.0) + 1);
+      continue;
+    }
+    next = (t - next > period) ? t + period : next + period;
+
+    // Random DP, distances of ~100 bits
+    dps.resize(loadBatch);
+    for(int i = 0; i < loadBatch; i++) {
+      dps[i].kIdx = 0;
+      dps[i].x.i64[0] = LoadRand(&seed);
+      dps[i].x.i64[1] = LoadRand(&seed);
+      dps[i].h = (uint32_t)(LoadRand(&seed) & HASH_MASK);
+      dps[i].d.i64[0] = LoadRand(&seed);
+      dps[i].d.i64[1] = LoadRand(&seed) & 0xC000000FFFFFFFFFULL;
+    }
+
+    // Planted collision, tame DP on the first client and wild DP on the second
+    int planted = 0;
+    if(p->threadId < 2) {
+      LOCK(ghMutex);
+      for(int i = 0; i < 2; i++) {
+        if(loadPlantPending[i] && (i == p->threadId || loadClient == 1)) {
+          dps.push_back(loadPlant[i]);
+          loadPlantPending[i] = false;
+          planted++;
+        }
+      }
+      UNLOCK(ghMutex);
+    }
+
+    uint32_t nbDP = (uint32_t)dps.size();
+    double t0 = Timer::get_tick();
+    if(serverVersion >= 3) {
+      PackDP(dps,buff);
+      uint32_t size = (uint32_t)buff.size();
+      cmd = SERVER_SENDPDP;
+      ok = SendAll(s,&cmd,1) && SendAll(s,&nbDP,sizeof(uint32_t)) &&
+           SendAll(s,&size,sizeof(uint32_t)) && SendAll(s,buff.data(),size);
+    } else {
+      cmd = SERVER_SENDDP;
+      ok = SendAll(s,&cmd,1) && SendAll(s,&nbDP,sizeof(uint32_t)) &&
+           SendAll(s,dps.data(),(int)(sizeof(DP) * nbDP));
+    }
+    int32_t status = SERVER_OK;
+    ok = ok && RecvAll(s,&status,sizeof(int32_t));
+    double rtt = Timer::get_tick() - t0;
+    if(!ok)
+      break;
+
+    LOCK(ghMutex);
+    loadPlantAck += planted;
+    if(planted && loadPlantAck == 2)
+      loadPlantTime = t0 + rtt;
+    st->nbDP += nbDP;
+    st->nbRequest++;
+    st->rttSum += rtt;
+    if(rtt > st->rttMax) st->rttMax = rtt;
+    if(status == SERVER_BACKUP) st->nbBackup++;
+    if(status == SERVER_END) st->ended = true;
+    UNLOCK(ghMutex);
+
+    if(status == SERVER_END)
+      break;
+
+  }
+
+  if(!ok) {
+    LOCK(ghMutex);
+    st->failed = true;
+    UNLOCK(ghMutex);
+  }
+
+  close_socket(s);
+  p->isRunning = false;
+
+}
+
+// Build a tame/wild DP pair with the same x whose distances sum to the private key
+void Kangaroo::PlantCollision(Int *privKey) {
+
+  Int kp(privKey);
+  Int SP(&rangeStart);
+#ifdef USE_SYMMETRY
+  SP.ModAddK1order(&rangeWidthDiv2);
+#endif
+  kp.ModSubK1order(&SP);
+
+  Int Wd;
+  Wd.SetInt32(0);
+  Wd.bits64[0] = rndl();
+  Int Td(&kp);
+  Td.ModSubK1order(&Wd);
+
+  Int x;
+  x.Rand(256);
+
+  uint64_t h;
+  loadPlant[TAME].kIdx = 0;
+  HashTable::Convert(&x,&Td,TAME,&h,&loadPlant[TAME].x,&loadPlant[TAME].d);
+  loadPlant[TAME].h = (uint32_t)h;
+  loadPlant[WILD].kIdx = 0;
+  HashTable::Convert(&x,&Wd,WILD,&h,&loadPlant[WILD].x,&loadPlant[WILD].d);
+  loadPlant[WILD].h = (uint32_t)h;
+
+  LOCK(ghMutex);
+  loadPlantPending[TAME] = true;
+  loadPlantPending[WILD] = true;
+  UNLOCK(ghMutex);
+
+}
+
+bool Kangaroo::LoadTest(std::vector<int> &load,std::string &plantKey) {
+
+  if(load.size() < 3 || load[0] <= 0 || load[1] <= 0 || load[2] <= 0) {
+    ::printf("LoadTest: -load nbClient,dpPerSec,batchSize[,plantSec] expected\n");
+    return false;
+  }
+
+  loadClient = load[0];
+  loadRate = load[1];
+  loadBatch = load[2];
+  double plantSec = (load.size() > 3) ? (double)load[3] : -1.0;
+  if(plantSec >= 0.0 && plantKey.length() == 0) {
+    ::printf("LoadTest: planting a collision requires the private key (-lkey)\n");
+    return false;
+  }
+
+  if(!GetConfigFromServer())
+    return false;
+  if(shards.size() > 0) {
+    ::printf("LoadTest: sharded cluster, run one load test per shard\n");
+    return false;
+  }
+  InitRange();
+  InitSearchKey();
+
+  Int privKey;
+  if(plantKey.length() > 0) {
+    privKey.SetBase16((char *)plantKey.c_str());
+    Point P = secp->ComputePublicKey(&privKey);
+    if(!P.equals(keysToSearch[0])) {
+      ::printf("LoadTest: -lkey does not match the key of the server\n");
+      return false;
+    }
+  }
+
+  int serverPid = (serverIp == "localhost" || serverIp == "127.0.0.1") ? GetListenerPid(port) : 0;
+
+  ::printf("Load: %d clients, %d DP/s, %d DP per request\n",loadClient,loadRate,loadBatch);
+  if(plantSec >= 0.0)
+    ::printf("Collision planted after %.0fs\n",plantSec);
+
+  loadStat = (LOAD_STAT *)calloc(loadClient,sizeof(LOAD_STAT));
+  TH_PARAM *params = (TH_PARAM *)calloc(loadClient,sizeof(TH_PARAM));
+  THREAD_HANDLE *thHandles = (THREAD_HANDLE *)calloc(loadClient,sizeof(THREAD_HANDLE));
+
+  int nbConnected = 0;
+  for(int i = 0; i < loadClient; i++) {
+    params[i].threadId = i;
+    params[i].isRunning = true;
+    if(!ConnectToServer(&params[i].clientSock)) {
+      ::printf("LoadTest: cannot connect client %d: %s\n",i,lastError.c_str());
+      params[i].isRunning = false;
+      loadStat[i].failed = true;
+      continue;
+    }
+    thHandles[nbConnected++] = LaunchThread(_loadClient,params + i);
+  }
+
+  double t0 = Timer::get_tick();
+  double lastPrint = t0;
+  double plantSent = 0.0;
+  double detection = -1.0;
+  uint64_t lastDP = 0;
+  uint64_t lastRequest = 0;
+  double lastRtt = 0.0;
+  double rssMax = 0.0;
+  double ingestMax = -1.0;
+  bool planted = false;
+  bool lost = false;
+  bool running = nbConnected > 0;
+
+  while(running) {
+
+    Timer::SleepMillis(10);
+    double t = Timer::get_tick();
+
+    if(plantSec >= 0.0 && !planted && t - t0 >= plantSec) {
+      PlantCollision(&privKey);
+      planted = true;
+    }
+
+    uint64_t nbDP = 0;
+    uint64_t nbRequest = 0;
+    uint64_t nbBackup = 0;
+    double rttSum = 0.0;
+    double rttMax = 0.0;
+    int nbAlive = 0;
+    bool ended = false;
+    LOCK(ghMutex);
+    for(int i = 0; i < loadClient; i++) {
+      nbDP += loadStat[i].nbDP;
+      nbRequest += loadStat[i].nbRequest;
+      nbBackup += loadStat[i].nbBackup;
+      rttSum += loadStat[i].rttSum;
+      if(loadStat[i].rttMax > rttMax) rttMax = loadStat[i].rttMax;
+      if(params[i].isRunning) nbAlive++;
+      ended |= loadStat[i].ended;
+    }
+    if(plantSent == 0.0) plantSent = loadPlantTime;
+    UNLOCK(ghMutex);
+
+    // Wait for the server to report the planted key
+    if(plantSent > 0.0 && detection < 0.0) {
+      char cmd = SERVER_STATUS;
+      int32_t status;
+      lost = Write(serverConn,&cmd,1,ntimeout) <= 0 || Read(serverConn,(char *)&status,sizeof(int32_t),ntimeout) <= 0;
+      if(!lost && status == SERVER_END) {
+        detection = Timer::get_tick() - plantSent;
+        ended = true;
+      }
+    }
+
+    running = (nbAlive > 0) && !ended && !endOfSearch && !lost;
+
+    if(t - lastPrint >= SEND_PERIOD || !running) {
+
+      // Longest reception to insertion time on the server since the last print (version>=7)
+      double ingest = -1.0;
+      if(!lost && serverVersion >= 7) {
+        char cmd = SERVER_GETLAG;
+        lost = Write(serverConn,&cmd,1,ntimeout) <= 0 || Read(serverConn,(char *)&ingest,sizeof(double),ntimeout) <= 0;
+        if(lost) {
+          ingest = -1.0;
+          running = false;
+        }
+        if(ingest > ingestMax) ingestMax = ingest;
+      }
+
+      double rss = (serverPid > 0) ? GetRSS(serverPid) : -1.0;
+      if(rss > rssMax) rssMax = rss;
+      double dt = t - lastPrint;
+      double avgRtt = (nbRequest > lastRequest) ? (rttSum - lastRtt) / (double)(nbRequest - lastRequest) : 0.0;
+      ::printf("\r[Clients %d][Accepted %.0f DP/s]",nbAlive,(double)(nbDP - lastDP) / dt);
+      if(ingest >= 0.0)
+        ::printf("[Ingest lag %.1f ms]",ingest * 1000.0);
+      ::printf("[RTT %.1f/%.1f ms][Backup %d]",avgRtt * 1000.0,rttMax * 1000.0,(int)nbBackup);
+      if(rss >= 0.0)
+        ::printf("[Server RSS %.1f MB]",rss);
+      ::printf("  ");
+      lastPrint = t;
+      lastDP = nbDP;
+      lastRequest = nbRequest;
+      lastRtt = rttSum;
+
+    }
+
+    if(!running) {
+      double total = t - t0;
+      int nbFailed = 0;
+      for(int i = 0; i < loadClient; i++)
+        if(loadStat[i].failed) nbFailed++;
+      if(lost)
+        ::printf("\nLoadTest: connection to the server lost: %s",lastError.length() ? lastError.c_str() : "closed");
+      ::printf("\nDuration: %.1fs\n",total);
+      ::printf("DP accepted: %.0f (%.0f DP/s average)\n",(double)nbDP,(double)nbDP / total);
+      if(ingestMax >= 0.0)
+        ::printf("Ingest lag max: %.1f ms\n",ingestMax * 1000.0);
+      ::printf("Requests: %.0f, round trip avg %.1f ms, max %.1f ms\n",(double)nbRequest,
+        (nbRequest > 0) ? rttSum * 1000.0 / (double)nbRequest : 0.0,rttMax * 1000.0);
+      if(nbFailed > 0)
+        ::printf("Failed clients: %d\n",nbFailed);
+      if(rssMax > 0.0)
+        ::printf("Server RSS max: %.1f MB\n",rssMax);
+      if(detection >= 0.0)
+        ::printf("Time to detection: %.3fs\n",detection);
+      else if(planted)
+        ::printf("Planted collision not detected\n");
+    }
+
+  }
+
+  // Stop clients
+  endOfSearch = true;
+  for(int i = 0; i < loadClient; i++)
+    params[i].isRunning = false;
+  JoinThreads(thHandles,nbConnected);
+  free(thHandles);
+  free(params);
+  free(loadStat);
+  loadStat = NULL;
+  return !lost && (detection >= 0.0 || !planted);
+
+}
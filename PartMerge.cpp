@@ -58,6 +58,19 @@ FILE * Kangaroo::OpenPart(std::string& partName,char *mode,int i,bool tmpPart) {
 
 }
 
+// Keep the average I/O rate of a merge under mergeRate MB/s (merge daemon)
+void Kangaroo::ThrottleIO(double t0,uint64_t bytes) {
+
+  if(mergeRate <= 0.0)
+    return;
+
+  double minTime = (double)bytes / (mergeRate * 1024.0 * 1024.0);
+  double elapsed = Timer::get_tick() - t0;
+  if(elapsed < minTime)
+    Timer::SleepMillis((int)((minTime - elapsed) * 1000.0));
+
+}
+
 void Kangaroo::CreateEmptyPartWork(std::string& partName) {
 
 #ifdef WIN64
@@ -148,15 +161,21 @@ bool Kangaroo::MergePartition(TH_PARAM* p) {
   Int d2;
   uint32_t type2;
 
-  for(uint32_t h = hStart; h < hStop && !endOfSearch; h++) {
+  bool corrupted = false;
+
+  for(uint32_t h = hStart; h < hStop && !endOfSearch && !corrupted; h++) {
 
-    int mStatus = HashTable::MergeH(h,f1,f2,f,&hDP,&hDuplicate,&d1,&type1,&d2,&type2);
+    int mStatus = HashTable::MergeH(h,f1,p->part1Packed,f2,p->part2Packed,f,p->part1Packed,
+                                    &hDP,&hDuplicate,&d1,&type1,&d2,&type2);
     switch(mStatus) {
     case ADD_OK:
       break;
     case ADD_COLLISION:
       CollisionCheck(&d1,type1,&d2,type2);
       break;
+    case ADD_ERROR:
+      corrupted = true;
+      continue;
     }
 
     // Counting overflow after (2^32)*MARGE_PART DP
@@ -165,10 +184,18 @@ bool Kangaroo::MergePartition(TH_PARAM* p) {
 
   }
 
+  p->ioSize = FTell(f1) + FTell(f2) + FTell(f);
   ::fclose(f1);
   ::fclose(f2);
   ::fclose(f);
 
+  if(corrupted) {
+    // The partition is left unchanged
+    ::printf("\nMergePartition: partition %d is corrupted\n",part);
+    remove(GetPartName(p1Name,part,true).c_str());
+    return false;
+  }
+
   // Rename
   string oldName = GetPartName(p1Name,part,true);
   string newName = GetPartName(p1Name,part,false);
@@ -185,18 +212,125 @@ extern DWORD WINAPI _mergeThread(LPVOID lpParam);
 extern void* _mergeThread(void* lpParam);
 #endif
 
+// ----------------------------------------------------------------------------
+// Partition work queue: workers pull the next partition index until MERGE_PART
+// partitions are processed, so a slow partition does not stall the other threads.
+// At most ioLimit partitions (-wio) are processed at the same time.
+
 // Threaded proc
 #ifdef WIN64
-DWORD WINAPI _mergePartThread(LPVOID lpParam) {
+DWORD WINAPI _partWorkerThread(LPVOID lpParam) {
 #else
-void* _mergePartThread(void* lpParam) {
+void* _partWorkerThread(void* lpParam) {
 #endif
   TH_PARAM* p = (TH_PARAM*)lpParam;
-  p->obj->MergePartition(p);
+  p->obj->PartWorker(p);
   p->isRunning = false;
   return 0;
 }
 
+void Kangaroo::PartWorker(TH_PARAM* p) {
+
+  while(true) {
+
+    // Next partition and I/O slot
+    int part = -1;
+    while(part < 0) {
+      LOCK(partMutex);
+      if(partNext >= MERGE_PART || (p->partJob == PART_MERGE && endOfSearch)) {
+        UNLOCK(partMutex);
+        return;
+      }
+      if(ioLimit <= 0 || partIO < ioLimit) {
+        part = partNext++;
+        partIO++;
+      }
+      UNLOCK(partMutex);
+      if(part < 0) Timer::SleepMillis(1);
+    }
+
+    TH_PARAM q = *p;
+    q.hStart = part;
+    q.hStop = (p->partJob == PART_SAVE) ? part + 1 : 0;
+    q.ioSize = 0;
+    q.ioFailed = false;
+
+    bool ok = false;
+    switch(p->partJob) {
+    case PART_MERGE:
+      ok = MergePartition(&q);
+      p->partDP += q.hStop;
+      break;
+    case PART_CHECK:
+      ok = CheckPartition(&q);
+      p->partDP += q.hStart;
+      p->partWrong += q.hStop;
+      break;
+    case PART_SAVE:
+      ok = SavePartition(&q);
+      break;
+    case PART_DUMP:
+      ok = hashTable.WriteTable(dumpFd,dumpOffset[part],part * H_PER_PART,(part + 1) * H_PER_PART);
+      q.ioSize = dumpOffset[part + 1] - dumpOffset[part];
+      break;
+    }
+    p->ioSize += q.ioSize;
+    if(!ok) p->ioFailed = true;
+
+    LOCK(partMutex);
+    partIO--;
+    partDone++;
+    partBytes += q.ioSize;
+    uint64_t bytes = partBytes;
+    if(p->partJob != PART_SAVE && partDone % 8 == 0)
+      ::printf(".");
+    UNLOCK(partMutex);
+
+    ThrottleIO(partT0,bytes);
+
+  }
+
+}
+
+// Run job on all partitions with nbThread workers, results are summed in job
+void Kangaroo::RunPartWorkers(int nbThread,TH_PARAM *job) {
+
+  partNext = 0;
+  partIO = 0;
+  partDone = 0;
+  partBytes = 0;
+  partT0 = Timer::get_tick();
+
+  TH_PARAM* params = (TH_PARAM*)malloc(nbThread * sizeof(TH_PARAM));
+  THREAD_HANDLE* thHandles = (THREAD_HANDLE*)malloc(nbThread * sizeof(THREAD_HANDLE));
+
+  for(int i = 0; i < nbThread; i++) {
+    params[i] = *job;
+    params[i].obj = this;
+    params[i].threadId = i;
+    params[i].isRunning = true;
+    params[i].partDP = 0;
+    params[i].partWrong = 0;
+    params[i].ioSize = 0;
+    params[i].ioFailed = false;
+    thHandles[i] = LaunchThread(_partWorkerThread,params + i);
+  }
+
+  JoinThreads(thHandles,nbThread);
+  FreeHandles(thHandles,nbThread);
+
+  for(int i = 0; i < nbThread; i++) {
+    job->partDP += params[i].partDP;
+    job->partWrong += params[i].partWrong;
+    job->ioSize += params[i].ioSize;
+    job->ioFailed = job->ioFailed || params[i].ioFailed;
+  }
+
+  free(params);
+  free(thHandles);
+
+}
+
 bool Kangaroo::MergeWorkPartPart(std::string& part1Name,std::string& part2Name) {
 
   double t0;
@@ -279,7 +413,7 @@ bool Kangaroo::MergeWorkPartPart(std::string& part1Name,std::string& part2Name)
 
   if(!partIsEmpty) {
 
-    if(v1 != v2) {
+    if((v1 & ~VERSION_FLAGS) != (v2 & ~VERSION_FLAGS)) {
       ::printf("MergeWorkPartPart: cannot merge workfile of different version\n");
       ::fclose(f2);
       return true;
@@ -331,6 +465,11 @@ bool Kangaroo::MergeWorkPartPart(std::string& part1Name,std::string& part2Name)
   InitRange();
   InitSearchKey();
 
+  // Format of partition #1 is kept, it is chosen when it is empty
+  bool packed1 = partIsEmpty ? (packTable || (v2 & VERSION_PACKED)) : ((v1 & VERSION_PACKED) != 0);
+  bool packed2 = (v2 & VERSION_PACKED) != 0;
+  packTable = packed1;
+
   // Write new header
   FILE* f = fopen(file1.c_str(),"wb");
   if(f == NULL) {
@@ -347,10 +486,9 @@ bool Kangaroo::MergeWorkPartPart(std::string& part1Name,std::string& part2Name)
   fclose(f);
 
 
-  int nbCore = Timer::getCoreNumber();
-  int l2 = (int)log2(nbCore);
-  int nbThread = (int)pow(2.0,l2);
-  if(nbThread > 16) nbThread = 16;
+  int nbThread = Timer::getCoreNumber();
+  if(nbThread > MERGE_PART) nbThread = MERGE_PART;
+  if(nbThread < 1) nbThread = 1;
 
 #ifndef WIN64
   setvbuf(stdout,NULL,_IONBF,0);
@@ -359,39 +497,23 @@ bool Kangaroo::MergeWorkPartPart(std::string& part1Name,std::string& part2Name)
   ::printf("Thread: %d\n",nbThread);
   ::printf("Merging");
 
-  TH_PARAM* params = (TH_PARAM*)malloc(nbThread * sizeof(TH_PARAM));
-  THREAD_HANDLE* thHandles = (THREAD_HANDLE*)malloc(nbThread * sizeof(THREAD_HANDLE));
-  memset(params,0,nbThread * sizeof(TH_PARAM));
-  uint64_t nbDP = 0;
-
-  for(int p = 0; p < MERGE_PART && !endOfSearch; p+=nbThread) {
-
-    printf(".");
-
-    for(int i = 0; i < nbThread; i++) {
-      params[i].threadId = i;
-      params[i].isRunning = true;
-      params[i].hStart = p+i;
-      params[i].hStop = 0;
-      params[i].part1Name = _strdup(part1Name.c_str());
-      params[i].part2Name = _strdup(part2Name.c_str());
-      thHandles[i] = LaunchThread(_mergePartThread,params + i);
-    }
-
-    JoinThreads(thHandles,nbThread);
-    FreeHandles(thHandles,nbThread);
-
-    for(int i = 0; i < nbThread; i++) {
-      free(params[i].part1Name);
-      free(params[i].part2Name);
-      nbDP += params[i].hStop;
-    }
-
+  TH_PARAM job;
+  memset(&job,0,sizeof(TH_PARAM));
+  job.partJob = PART_MERGE;
+  job.part1Name = _strdup(part1Name.c_str());
+  job.part2Name = _strdup(part2Name.c_str());
+  job.part1Packed = packed1;
+  job.part2Packed = packed2;
+  RunPartWorkers(nbThread,&job);
+  free(job.part1Name);
+  free(job.part2Name);
+  uint64_t nbDP = job.partDP;
+
+  if(job.ioFailed) {
+    ::printf("\nMergeWork: %s and %s cannot be merged\n",part1Name.c_str(),part2Name.c_str());
+    return true;
   }
 
-  free(params);
-  free(thHandles);
-
   t1 = Timer::get_tick();
 
   if(!endOfSearch) {
@@ -467,6 +589,10 @@ bool Kangaroo::FillEmptyPartFromFile(std::string& partName,std::string& fileName
   InitRange();
   InitSearchKey();
 
+  // Partition format
+  bool packed1 = (v1 & VERSION_PACKED) != 0;
+  packTable = packTable || packed1;
+
   string file1 = partName + "/header";
   FILE* f = fopen(file1.c_str(),"wb");
   if(f == NULL) {
@@ -483,6 +609,7 @@ bool Kangaroo::FillEmptyPartFromFile(std::string& partName,std::string& fileName
   ::printf("File %s: [DP%d]\n",fileName.c_str(),dp1);
 
   uint64_t nbDP = 0;
+  uint64_t ioBytes = 0;
   ::printf("Filling");
 
   // Save parts
@@ -490,27 +617,39 @@ bool Kangaroo::FillEmptyPartFromFile(std::string& partName,std::string& fileName
 
     if(p % (MERGE_PART / 64) == 0) ::printf(".");
 
-    FILE *f = OpenPart(partName,"wb",p,false);
+    FILE *f = OpenPart(partName,"wb",p,true);
     uint32_t hStart = p * (HASH_SIZE / MERGE_PART);
     uint32_t hStop = (p + 1) * (HASH_SIZE / MERGE_PART);
 
     uint32_t nbItem;
     uint32_t maxItem;
-    unsigned char buff[32];
+    vector<ENTRY> buff;
 
     for(uint32_t h= hStart;h<hStop;h++) {
       ::fread(&nbItem,sizeof(uint32_t),1,f1);
       ::fread(&maxItem,sizeof(uint32_t),1,f1);
       ::fwrite(&nbItem,sizeof(uint32_t),1,f);
       ::fwrite(&maxItem,sizeof(uint32_t),1,f);
-      for(uint32_t i=0;i<nbItem;i++) {
-        ::fread(&buff,32,1,f1);
-        ::fwrite(&buff,32,1,f);
+      buff.resize(nbItem + 1);
+      if(!HashTable::ReadItems(f1,packed1,nbItem,buff.data())) {
+        // Partitions already filled are kept, this one is left empty
+        ::printf("\nFillEmptyPart: %s is corrupted\n",fileName.c_str());
+        ::fclose(f);
+        remove(GetPartName(partName,p,true).c_str());
+        ::fclose(f1);
+        return true;
       }
+      HashTable::WriteItems(f,packTable,nbItem,buff.data());
       nbDP += nbItem;
     }
 
+    ioBytes += FTell(f);
     ::fclose(f);
+    string oldName = GetPartName(partName,p,true);
+    string newName = GetPartName(partName,p,false);
+    remove(newName.c_str());
+    rename(oldName.c_str(),newName.c_str());
+    ThrottleIO(t0,ioBytes + FTell(f1));
 
   }
 
@@ -599,7 +738,7 @@ bool Kangaroo::MergeWorkPart(std::string& partName,std::string& file2,bool print
     return true;
   }
 
-  if(v1 != v2) {
+  if((v1 & ~VERSION_FLAGS) != (v2 & ~VERSION_FLAGS)) {
     ::printf("MergeWorkPart: cannot merge workfile of different version\n");
     ::fclose(f2);
     return true;
@@ -644,6 +783,11 @@ bool Kangaroo::MergeWorkPart(std::string& partName,std::string& file2,bool print
 
   ::printf("Merging");
 
+  // Format of the partition is kept
+  bool packed1 = (v1 & VERSION_PACKED) != 0;
+  bool packed2 = (v2 & VERSION_PACKED) != 0;
+  packTable = packed1;
+
   // Save header
   FILE* f = fopen(file1.c_str(),"wb");
   if(f == NULL) {
@@ -660,6 +804,7 @@ bool Kangaroo::MergeWorkPart(std::string& partName,std::string& file2,bool print
   fclose(f);
 
   uint64_t nbDP = 0;
+  uint64_t ioBytes = 0;
   uint32_t hDP;
   uint32_t hDuplicate;
   Int d1;
@@ -678,15 +823,21 @@ bool Kangaroo::MergeWorkPart(std::string& partName,std::string& file2,bool print
     FILE *f1 = OpenPart(partName,"rb",part);
     FILE *f = OpenPart(partName,"wb",part,true);
 
-    for(uint32_t h = hStart; h < hStop && !endOfSearch; h++) {
+    bool corrupted = false;
 
-      int mStatus = HashTable::MergeH(h,f1,f2,f,&hDP,&hDuplicate,&d1,&type1,&d2,&type2);
+    for(uint32_t h = hStart; h < hStop && !endOfSearch && !corrupted; h++) {
+
+      int mStatus = HashTable::MergeH(h,f1,packed1,f2,packed2,f,packed1,
+                                      &hDP,&hDuplicate,&d1,&type1,&d2,&type2);
       switch(mStatus) {
       case ADD_OK:
         break;
       case ADD_COLLISION:
         CollisionCheck(&d1,type1,&d2,type2);
         break;
+      case ADD_ERROR:
+        corrupted = true;
+        continue;
       }
 
       nbDP += hDP;
@@ -694,9 +845,19 @@ bool Kangaroo::MergeWorkPart(std::string& partName,std::string& file2,bool print
 
     }
 
+    ioBytes += FTell(f1) + FTell(f);
     fclose(f1);
     fclose(f);
 
+    if(corrupted) {
+      // Partitions already merged are kept, this one is left unchanged
+      ::printf("\nMergeWork: corrupted bucket in partition %d of %s or in %s\n",part,partName.c_str(),file2.c_str());
+      remove(GetPartName(partName,part,true).c_str());
+      fclose(f2);
+      return true;
+    }
+    ThrottleIO(t0,ioBytes + FTell(f2));
+
     // Rename
     string oldName = GetPartName(partName,part,true);
     string newName = GetPartName(partName,part,false);
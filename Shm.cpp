@@ -0,0 +1,560 @@
+/*
+ * This file is part of the BSGS distribution (https://github.com/JeanLucPons/Kangaroo).
+ * Copyright (c) 2020 Jean Luc PONS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Kangaroo.h"
+#include "Timer.h"
+#include <string.h>
+#ifndef WIN64
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------------------------------------------------
+// Shared memory transport (-shm name, -c shm:name)
+// Processes of the same host publish their DP into a POSIX shared memory ring owned by an aggregator
+// (server, relay or standalone run). The ring is a bounded multi producer / single consumer queue:
+// each cell has a sequence number, a producer reserves a range of free cells by moving head, writes
+// them and publishes each cell by setting its sequence to pos+1. The consumer frees a cell by
+// setting its sequence to pos+size. The header carries the configuration, the status and the number
+// of kangaroos of each attached process. Each process also records the range it is reserving, so
+// that the consumer can skip the unpublished cells of a process which died while writing them.
+// ------------------------------------------------------------------------------------------------------
+
+#define SHM_MAGIC 0x4B414E47524F4F02ULL
+#define SHM_MAX_CLIENT 64
+#define SHM_STALL 1.0       // A cell reserved but not published after this time is checked for a dead writer (sec)
+
+// Same values as the server status
+#define SHM_OK      0
+#define SHM_END     1
+#define SHM_BACKUP  2
+
+typedef struct {
+
+  uint64_t magic;
+  uint64_t size;                 // Number of cells (power of 2)
+  int32_t  ownerPid;
+  int32_t  dpSize;
+  volatile int32_t  status;
+  volatile uint32_t ready;
+  uint64_t rangeStart[4];
+  uint64_t rangeEnd[4];
+  uint64_t keyX[4];
+  uint64_t keyY[4];
+  volatile int32_t  pid[SHM_MAX_CLIENT];
+  volatile uint64_t kangaroo[SHM_MAX_CLIENT];
+  volatile uint64_t resPos[SHM_MAX_CLIENT];  // Range being reserved or written by each process
+  volatile uint64_t resLen[SHM_MAX_CLIENT];  // 0 when none
+  uint64_t pad0[8];
+  volatile uint64_t head;        // Next cell to reserve (producers)
+  uint64_t pad1[7];
+  volatile uint64_t tail;        // Next cell to read (consumer)
+  uint64_t pad2[7];
+
+} SHM_HEADER;
+
+typedef struct {
+
+  volatile uint64_t seq;
+  DP dp;
+
+} SHM_CELL;
+
+#define SHM_CELLS(h) ((SHM_CELL *)((uint8_t *)(h) + sizeof(SHM_HEADER)))
+
+#ifndef WIN64
+
+static bool IsAlive(int32_t pid) {
+  return kill(pid,0) == 0 || errno == EPERM;
+}
+
+// Skip the cells from tail reserved by dead processes, published ones are still read into dps.
+// Nothing is skipped while a live process has a reservation covering tail, and the skip stops at
+// the first range reserved by a live process. Returns the new tail.
+static uint64_t SkipDeadWriters(SHM_HEADER *h,uint64_t tail,std::vector<DP> &dps,uint64_t *nbSkipped) {
+
+  SHM_CELL *cells = SHM_CELLS(h);
+  uint64_t mask = h->size - 1;
+  uint64_t end = tail;
+  uint64_t limit = __atomic_load_n(&h->head,__ATOMIC_ACQUIRE);
+
+  for(int i = 0; i < SHM_MAX_CLIENT; i++) {
+    int32_t pid = h->pid[i];
+    uint64_t len = __atomic_load_n(&h->resLen[i],__ATOMIC_ACQUIRE);
+    if(pid == 0 || len == 0)
+      continue;
+    uint64_t pos = __atomic_load_n(&h->resPos[i],__ATOMIC_ACQUIRE);
+    bool covers = (pos <= tail) && (tail < pos + len);
+    if(IsAlive(pid)) {
+      if(covers)
+        return tail;
+      if(pos > tail && pos < limit)
+        limit = pos;
+    } else if(covers && pos + len > end) {
+      end = pos + len;
+    }
+  }
+  if(end > limit)
+    end = limit;
+
+  for(uint64_t pos = tail; pos < end; pos++) {
+    SHM_CELL *c = cells + (pos & mask);
+    if(__atomic_load_n(&c->seq,__ATOMIC_ACQUIRE) == pos + 1)
+      dps.push_back(c->dp);
+    else
+      (*nbSkipped)++;
+    __atomic_store_n(&c->seq,pos + h->size,__ATOMIC_RELEASE);
+  }
+
+  return end;
+
+}
+
+void *_shmReader(void *lpParam) {
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->ShmReader();
+  return 0;
+}
+
+// Create the ring and start the consumer thread (aggregator)
+void Kangaroo::StartShm() {
+
+  string name = "/" + shmName;
+  size_t mapSize = sizeof(SHM_HEADER) + (size_t)SHM_RING_SIZE * sizeof(SHM_CELL);
+
+  // A ring left by a previous run is replaced, its clients attach again
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(),O_CREAT | O_EXCL | O_RDWR,0600);
+  if(fd < 0) {
+    ::printf("Error: cannot create shared memory %s: %s\n",name.c_str(),strerror(errno));
+    exit(-1);
+  }
+  if(ftruncate(fd,mapSize) != 0) {
+    ::printf("Error: cannot allocate shared memory %s: %s\n",name.c_str(),strerror(errno));
+    close(fd);
+    shm_unlink(name.c_str());
+    exit(-1);
+  }
+  void *m = mmap(NULL,mapSize,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    ::printf("Error: cannot map shared memory %s: %s\n",name.c_str(),strerror(errno));
+    shm_unlink(name.c_str());
+    exit(-1);
+  }
+
+  SHM_HEADER *h = (SHM_HEADER *)m;
+  SHM_CELL *cells = SHM_CELLS(h);
+  h->size = SHM_RING_SIZE;
+  h->ownerPid = (int32_t)getpid();
+  h->dpSize = initDPSize;
+  h->status = SHM_OK;
+  ::memcpy(h->rangeStart,rangeStart.bits64,32);
+  ::memcpy(h->rangeEnd,rangeEnd.bits64,32);
+  ::memcpy(h->keyX,keysToSearch[keyIdx].x.bits64,32);
+  ::memcpy(h->keyY,keysToSearch[keyIdx].y.bits64,32);
+  for(uint64_t i = 0; i < h->size; i++)
+    cells[i].seq = i;
+  h->magic = SHM_MAGIC;
+  __atomic_store_n(&h->ready,1,__ATOMIC_RELEASE);
+
+  shm = m;
+  shmMapSize = mapSize;
+  ::printf("Shared memory ring: %s (%d DP)\n",name.c_str(),SHM_RING_SIZE);
+  if(!serverMode && keysToSearch.size() > 1)
+    ::printf("Warning: processes attached to %s only search the first key\n",name.c_str());
+
+  TH_PARAM *p = (TH_PARAM *)malloc(sizeof(TH_PARAM));
+  memset(p,0,sizeof(TH_PARAM));
+  LaunchThread(_shmReader,p);
+
+}
+
+// Add DP read from the ring
+void Kangaroo::ShmInsert(std::vector<DP> &dps) {
+
+  if(serverMode) {
+    // Same path as DP received from the network
+    DP *dp = (DP *)malloc(sizeof(DP) * dps.size());
+    ::memcpy(dp,dps.data(),sizeof(DP) * dps.size());
+    DispatchDP(dp,(uint32_t)dps.size());
+    return;
+  }
+
+  // Standalone: a backup holds saveMutex while the solver threads are paused
+  LOCK(saveMutex);
+  LOCK(ghMutex);
+  for(size_t i = 0; i < dps.size() && !endOfSearch; i++) {
+    if(!AddToTable(dps[i].h,&dps[i].x,&dps[i].d))
+      collisionInSameHerd++;
+  }
+  UNLOCK(ghMutex);
+  UNLOCK(saveMutex);
+
+}
+
+// Sum the kangaroos of the attached processes, release the slots of dead ones
+void Kangaroo::ShmCountKangaroos() {
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  uint64_t total = 0;
+  for(int i = 0; i < SHM_MAX_CLIENT; i++) {
+    int32_t pid = h->pid[i];
+    if(pid == 0)
+      continue;
+    if(IsAlive(pid)) {
+      total += h->kangaroo[i];
+    } else {
+      h->kangaroo[i] = 0;
+      // The slot is kept until the consumer went past the reservation of the dead process
+      if(h->resLen[i] > 0 && h->resPos[i] + h->resLen[i] > h->tail)
+        continue;
+      h->resLen[i] = 0;
+      __atomic_compare_exchange_n(&h->pid[i],&pid,0,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+    }
+  }
+
+  LOCK(ghMutex);
+  totalRW += total - shmRW;
+  UNLOCK(ghMutex);
+  shmRW = total;
+
+}
+
+// Consumer thread of the aggregator
+void Kangaroo::ShmReader() {
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  SHM_CELL *cells = SHM_CELLS(h);
+  uint64_t mask = h->size - 1;
+  uint64_t tail = h->tail;
+  std::vector<DP> dps;
+  double lastCount = 0.0;
+  double stallStart = 0.0;
+  uint64_t lost = 0;
+
+  while(!endOfSearch) {
+
+    double t = Timer::get_tick();
+
+    while(dps.size() < SHM_READ_MAX) {
+      SHM_CELL *c = cells + (tail & mask);
+      if(__atomic_load_n(&c->seq,__ATOMIC_ACQUIRE) != tail + 1)
+        break;
+      dps.push_back(c->dp);
+      __atomic_store_n(&c->seq,tail + h->size,__ATOMIC_RELEASE);
+      tail++;
+    }
+    __atomic_store_n(&h->tail,tail,__ATOMIC_RELEASE);
+
+    if(dps.size() > 0) {
+      stallStart = 0.0;
+      ShmInsert(dps);
+      dps.clear();
+    } else {
+      if(__atomic_load_n(&h->head,__ATOMIC_ACQUIRE) != tail) {
+        // Reserved but not published, skip the reservation if its writer died
+        if(stallStart == 0.0) {
+          stallStart = t;
+        } else if(t - stallStart > SHM_STALL) {
+          uint64_t nbSkipped = 0;
+          uint64_t end = SkipDeadWriters(h,tail,dps,&nbSkipped);
+          stallStart = 0.0;
+          if(end != tail) {
+            tail = end;
+            __atomic_store_n(&h->tail,tail,__ATOMIC_RELEASE);
+            if(lost == 0 && nbSkipped > 0)
+              ::printf("\nWarning: %.0f shared memory cells of a dead process skipped\n",(double)nbSkipped);
+            lost += nbSkipped;
+            continue;
+          }
+        }
+      }
+      Timer::SleepMillis(1);
+    }
+
+    h->status = serverMode ? GetServerStatus() : SHM_OK;
+
+    if(t - lastCount > SEND_PERIOD) {
+      ShmCountKangaroos();
+      lastCount = t;
+    }
+
+  }
+
+  h->status = SHM_END;
+  shm_unlink(("/" + shmName).c_str());
+  // Clients still attached see an orphaned ring (see ShmValid)
+  __atomic_store_n(&h->magic,0,__ATOMIC_RELEASE);
+
+}
+
+// Map the ring of the aggregator and take a process slot (client)
+bool Kangaroo::ShmAttach() {
+
+  string name = "/" + shmName;
+  int fd = shm_open(name.c_str(),O_RDWR,0);
+  if(fd < 0) {
+    lastError = "Cannot open shared memory " + name + ": " + string(strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(SHM_HEADER)) {
+    lastError = "Invalid shared memory " + name;
+    close(fd);
+    return false;
+  }
+  void *m = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    lastError = "Cannot map shared memory " + name + ": " + string(strerror(errno));
+    return false;
+  }
+
+  SHM_HEADER *h = (SHM_HEADER *)m;
+  if(!__atomic_load_n(&h->ready,__ATOMIC_ACQUIRE) || h->magic != SHM_MAGIC || !IsAlive(h->ownerPid) ||
+     (size_t)st.st_size < sizeof(SHM_HEADER) + h->size * sizeof(SHM_CELL)) {
+    lastError = "Shared memory " + name + " is not ready";
+    munmap(m,st.st_size);
+    return false;
+  }
+
+  int slot = -1;
+  int32_t me = (int32_t)getpid();
+  for(int i = 0; i < SHM_MAX_CLIENT && slot < 0; i++) {
+    int32_t free = 0;
+    if(__atomic_compare_exchange_n(&h->pid[i],&free,me,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+      slot = i;
+  }
+  if(slot < 0) {
+    lastError = "Too many processes attached to " + name;
+    munmap(m,st.st_size);
+    return false;
+  }
+  h->kangaroo[slot] = totalRW;
+
+  shm = m;
+  shmMapSize = st.st_size;
+  shmIno = (uint64_t)st.st_ino;
+  shmCheckTime = Timer::get_tick();
+  shmSlot = slot;
+  isConnected = true;
+  serverStatus = "OK";
+  return true;
+
+}
+
+void Kangaroo::ShmDetach() {
+
+  if(shm == NULL)
+    return;
+  // DP the aggregator did not read are sent again to the next ring
+  ShmAck(true);
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  h->kangaroo[shmSlot] = 0;
+  h->pid[shmSlot] = 0;
+  munmap(shm,shmMapSize);
+  shm = NULL;
+  isConnected = false;
+
+}
+
+// Configuration from the ring header (client)
+bool Kangaroo::ShmConfig() {
+
+  if(!ShmAttach()) {
+    ::printf("Cannot connect to server: %s\n%s\n",serverIp.c_str(),lastError.c_str());
+    return false;
+  }
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  Point key;
+  key.Clear();
+  key.z.SetInt32(1);
+  ::memcpy(rangeStart.bits64,h->rangeStart,32);
+  ::memcpy(rangeEnd.bits64,h->rangeEnd,32);
+  ::memcpy(key.x.bits64,h->keyX,32);
+  ::memcpy(key.y.bits64,h->keyY,32);
+  initDPSize = h->dpSize;
+
+  // Writing to the ring is cheap, send small batches
+  serverVersion = 0;
+  batchTarget = BATCH_TARGET_MIN;
+
+  ::printf("Succesfully attached to shared memory: /%s\n",shmName.c_str());
+
+  keysToSearch.clear();
+  keysToSearch.push_back(key);
+  return true;
+
+}
+
+// False when the ring is no longer served: aggregator dead or ended, or ring replaced by a restarted
+// aggregator (the name is checked every SHM_CHECK seconds)
+bool Kangaroo::ShmValid() {
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  if(__atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != SHM_MAGIC || !IsAlive(h->ownerPid))
+    return false;
+
+  double t = Timer::get_tick();
+  if(t - shmCheckTime < SHM_CHECK)
+    return true;
+  shmCheckTime = t;
+
+  struct stat st;
+  int fd = shm_open(("/" + shmName).c_str(),O_RDONLY,0);
+  if(fd < 0)
+    return false;
+  bool same = fstat(fd,&st) == 0 && (uint64_t)st.st_ino == shmIno;
+  close(fd);
+  return same;
+
+}
+
+// Acknowledge the published DP the aggregator has read. all: the ring is left, the unread ones are
+// moved back to the send queue.
+void Kangaroo::ShmAck(bool all) {
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  uint64_t tail = __atomic_load_n(&h->tail,__ATOMIC_ACQUIRE);
+  size_t n = 0;
+  while(n < shmPendingPos.size() && shmPendingPos[n] < tail)
+    n++;
+  if(n > 0) {
+    AckDP(shmPending.data(),n);
+    shmPending.erase(shmPending.begin(),shmPending.begin() + n);
+    shmPendingPos.erase(shmPendingPos.begin(),shmPendingPos.begin() + n);
+  }
+
+  if(all && shmPending.size() > 0) {
+    EnqueueDP(shmPending.data(),(uint32_t)shmPending.size());
+    shmPending.clear();
+    shmPendingPos.clear();
+  }
+
+}
+
+// Publish DP in the ring, DP which cannot be written are left in dps (client)
+bool Kangaroo::ShmSend(std::vector<DP> &dps,bool final) {
+
+  if(isConnected && !ShmValid()) {
+    ShmDetach();
+    serverStatus = "Fault";
+  }
+
+  if(!isConnected) {
+    if(final)
+      return false;
+    // Aggregator restarted, attach to the new ring
+    Timer::SleepMillis(1000);
+    if(!ShmAttach())
+      return false;
+    ::printf("\nAttached again to shared memory: /%s\n",shmName.c_str());
+  }
+
+  SHM_HEADER *h = (SHM_HEADER *)shm;
+  SHM_CELL *cells = SHM_CELLS(h);
+  uint64_t mask = h->size - 1;
+  size_t sent = 0;
+
+  while(sent < dps.size() && (!endOfSearch || final)) {
+
+    uint64_t pos = __atomic_load_n(&h->head,__ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&h->tail,__ATOMIC_ACQUIRE);
+    uint64_t free = h->size - (pos - tail);
+    uint64_t n = (std::min)((uint64_t)(dps.size() - sent),free);
+
+    if(n == 0 || __atomic_load_n(&cells[(pos + n - 1) & mask].seq,__ATOMIC_ACQUIRE) != pos + n - 1) {
+      // Ring full (or another process moved head)
+      if(n == 0 && !ShmValid()) {
+        ShmDetach();
+        serverStatus = "Fault";
+        break;
+      }
+      if(n == 0) serverStatus = "Full";
+      Timer::SleepMillis(1);
+      continue;
+    }
+
+    // Record the reservation before taking it, the consumer skips it if this process dies
+    __atomic_store_n(&h->resPos[shmSlot],pos,__ATOMIC_RELEASE);
+    __atomic_store_n(&h->resLen[shmSlot],n,__ATOMIC_RELEASE);
+    if(!__atomic_compare_exchange_n(&h->head,&pos,pos + n,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&h->resLen[shmSlot],0,__ATOMIC_RELEASE);
+      continue;
+    }
+
+    for(uint64_t i = 0; i < n; i++) {
+      SHM_CELL *c = cells + ((pos + i) & mask);
+      c->dp = dps[sent + i];
+      __atomic_store_n(&c->seq,pos + i + 1,__ATOMIC_RELEASE);
+      shmPending.push_back(dps[sent + i]);
+      shmPendingPos.push_back(pos + i);
+    }
+    __atomic_store_n(&h->resLen[shmSlot],0,__ATOMIC_RELEASE);
+    sent += n;
+
+  }
+
+  dps.erase(dps.begin(),dps.begin() + sent);
+  if(shm)
+    ShmAck(false);
+
+  if(shm) {
+    switch(h->status) {
+    case SHM_OK:
+      serverStatus = "OK";
+      break;
+    case SHM_END:
+      serverStatus = "END";
+      endOfSearch = true;
+      break;
+    case SHM_BACKUP:
+      serverStatus = "Backup";
+      break;
+    }
+  }
+
+  return sent > 0;
+
+}
+
+#else
+
+void Kangaroo::StartShm() {
+  ::printf("Error: -shm is not supported on Windows\n");
+  exit(-1);
+}
+
+bool Kangaroo::ShmConfig() {
+  ::printf("Error: -c shm:name is not supported on Windows\n");
+  return false;
+}
+
+bool Kangaroo::ShmSend(std::vector<DP> &dps,bool final) {
+  return false;
+}
+
+void Kangaroo::ShmDetach() {
+}
+
+#endif
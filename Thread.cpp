@@ -161,6 +161,139 @@ string Kangaroo::GetTimeStr(double dTime) {
 
 }
 
+#ifdef WIN64
+DWORD WINAPI _sendDP(LPVOID lpParam);
+#else
+void *_sendDP(void *lpParam);
+#endif
+
+#ifdef WIN64
+DWORD WINAPI _insertDP(LPVOID lpParam) {
+#else
+void *_insertDP(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->InsertDP(p);
+  p->isRunning = false;
+  return 0;
+}
+
+#ifdef WIN64
+DWORD WINAPI _replicate(LPVOID lpParam) {
+#else
+void *_replicate(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->ReplicateThread(p);
+  p->isRunning = false;
+  return 0;
+}
+
+#ifdef WIN64
+DWORD WINAPI _validateDP(LPVOID lpParam) {
+#else
+void *_validateDP(void *lpParam) {
+#endif
+  TH_PARAM *p = (TH_PARAM *)lpParam;
+  p->obj->ValidateDP(p);
+  p->isRunning = false;
+  return 0;
+}
+
+// Server insert thread, owns 1/SERVER_INSERT of the hash buckets of the server (see DispatchDP)
+void Kangaroo::InsertDP(TH_PARAM *p) {
+
+  int id = p->threadId;
+  vector<DP> dps;
+  vector<DP> added;
+  uint64_t dead = 0;
+  Int cDist;
+  uint32_t cType;
+  double insertWait = 0.0;
+  double globalWait = 0.0;
+  double t;
+  double tQueue;
+
+  while(!endOfSearch) {
+
+    LOCK(queueMutex);
+    dps.swap(insertQueue[id]);
+    insertQueued -= dps.size();
+    tQueue = insertQueueTime[id];
+    insertQueueTime[id] = 0.0;
+    UNLOCK(queueMutex);
+
+    if(dps.size() == 0) {
+      Timer::SleepMillis(10);
+      continue;
+    }
+
+    // Insert by chunk, a backup waits for the chunk in progress only
+    for(size_t i = 0; i < dps.size() && !endOfSearch; i += 4096) {
+
+      size_t end = (std::min)(i + 4096,dps.size());
+
+      t = Timer::get_tick();
+      LOCK(insertMutex[id]);
+      insertWait += Timer::get_tick() - t;
+
+      for(size_t j = i; j < end && !endOfSearch; j++) {
+
+        DP *dp = &dps[j];
+        switch(hashTable.Add(dp->h,&dp->x,&dp->d,&cDist,&cType)) {
+
+        case ADD_OK:
+          if(useJournal) added.push_back(*dp);
+          break;
+
+        case ADD_DUPLICATE:
+          dead++;
+          break;
+
+        case ADD_COLLISION: {
+          Int dist;
+          uint32_t kType;
+          HashTable::CalcCollision(dp->d,&dist,&kType);
+          LOCK(ghMutex);
+          if(!endOfSearch && !CollisionCheck(&cDist,cType,&dist,kType))
+            dead++;
+          UNLOCK(ghMutex);
+        } break;
+
+        }
+
+      }
+
+      t = Timer::get_tick();
+      LOCK(ghMutex);
+      globalWait += Timer::get_tick() - t;
+      collisionInSameHerd += dead;
+      journalDP.insert(journalDP.end(),added.begin(),added.end());
+      insertLockWait += insertWait;
+      globalLockWait += globalWait;
+      UNLOCK(ghMutex);
+      insertWait = 0.0;
+      globalWait = 0.0;
+      dead = 0;
+      added.clear();
+
+      UNLOCK(insertMutex[id]);
+
+    }
+
+    // Age of the oldest DP of the batch when the batch is inserted
+    double lag = Timer::get_tick() - tQueue;
+    LOCK(queueMutex);
+    insertLag = lag;
+    if(lag > insertLagMax) insertLagMax = lag;
+    UNLOCK(queueMutex);
+
+    dps.clear();
+
+  }
+
+}
+
 // Wait for end of server and dispay stats
 void Kangaroo::ProcessServer() {
 
@@ -169,6 +302,8 @@ void Kangaroo::ProcessServer() {
   t0 = Timer::get_tick();
   startTime = t0;
   double lastSave = 0;
+  double lastStat = t0;
+  uint64_t lastReceived = 0;
 
   // Acquire mutex ownership
 #ifndef WIN64
@@ -178,40 +313,93 @@ void Kangaroo::ProcessServer() {
   ghMutex = CreateMutex(NULL,FALSE,NULL);
 #endif
 
-  while(!endOfSearch) {
+  // Launch insert threads (DP are inserted continuously as they arrive)
+  // or the sender thread in relay mode. With -jobs, each job has its own insert threads.
+  int nbThread = relayMode ? 1 : (jobs.size() > 0 ? 0 : SERVER_INSERT);
+  TH_PARAM params[SERVER_INSERT];
+  THREAD_HANDLE thHandles[SERVER_INSERT];
+  memset(params,0,sizeof(params));
+  insertRunning = !relayMode && nbThread > 0;
+  for(int i = 0; i < nbThread; i++) {
+    params[i].threadId = i;
+    params[i].isRunning = true;
+    thHandles[i] = LaunchThread(relayMode ? _sendDP : _insertDP,params + i);
+  }
 
-    t0 = Timer::get_tick();
-
-    LOCK(ghMutex);
-    // Get back all dps
-    localCache.clear();
-    for(int i=0;i<(int)recvDP.size();i++)
-      localCache.push_back(recvDP[i]);
-    recvDP.clear();
-    UNLOCK(ghMutex);
-
-    // Add to hashTable
-    for(int i = 0; i<(int)localCache.size() && !endOfSearch; i++) {
-      DP_CACHE dp = localCache[i];
-      for(int j = 0; j<(int)dp.nbDP && !endOfSearch; j++) {
-        uint64_t h = dp.dp[j].h;
-        if(!AddToTable(h,&dp.dp[j].x,&dp.dp[j].d)) {
-          // Collision inside the same herd
-          collisionInSameHerd++;
-        }
-      }
-      free(dp.dp);
-    }
+  // Sampled validation of the client DPs (-vs)
+  int nbValid = (validRate > 0.0 && !relayMode) ? VALID_THREAD : 0;
+  TH_PARAM vParams[VALID_THREAD];
+  THREAD_HANDLE vHandles[VALID_THREAD];
+  memset(vParams,0,sizeof(vParams));
+  for(int i = 0; i < nbValid; i++) {
+    vParams[i].threadId = i;
+    vParams[i].isRunning = true;
+    vHandles[i] = LaunchThread(_validateDP,vParams + i);
+  }
 
-    t1 = Timer::get_tick();
+  // Replication to the standby servers (-standby)
+  int nbRepl = (standbys.size() > 0) ? 1 : 0;
+  TH_PARAM rParam;
+  THREAD_HANDLE rHandle;
+  memset(&rParam,0,sizeof(rParam));
+  if(nbRepl) {
+    rParam.isRunning = true;
+    rHandle = LaunchThread(_replicate,&rParam);
+  }
 
-    double toSleep = SEND_PERIOD - (t1-t0);
-    if(toSleep<0) toSleep = 0.0;
-    Timer::SleepMillis((uint32_t)(toSleep*1000.0));
+  while(!endOfSearch) {
+
+    Timer::SleepMillis((uint32_t)(SERVER_TICK*1000.0));
 
     t1 = Timer::get_tick();
+    if(t1 - lastStat < SEND_PERIOD)
+      continue;
+
+    // Batch size advertised to clients, sized on the received DP rate
+    uint64_t received = dpReceived;
+    for(size_t i = 0; i < jobs.size(); i++)
+      received += jobs[i]->dpReceived;
+    double target = (double)(received - lastReceived) / (t1 - lastStat) / SERVER_REQUEST_RATE;
+    batchAdvertised = (uint32_t)(std::max)((double)BATCH_TARGET_MIN,(std::min)(target,(double)BATCH_TARGET_MAX));
+    lastReceived = received;
+    lastStat = t1;
+
+    if(relayMode) {
+      if(!endOfSearch)
+        printf("\r[Client %d][Kang 2^%.2f][DP Sent 2^%.2f][Dup %.0f][Upstream %s][%s]  ",
+          connectedClient,
+          log2((double)totalRW),
+          log2((double)relaySent),
+          (double)relayDup,
+          serverStatus.c_str(),
+          GetTimeStr(t1 - startTime).c_str()
+          );
+      continue;
+    }
 
-    if(!endOfSearch)
+    if(jobs.size() > 0) {
+      // Jobs are saved by their own thread, the server ends with the last job
+      int nbOpen = 0;
+      std::string info = "";
+      char tmp[64];
+      for(size_t i = 0; i < jobs.size(); i++) {
+        Kangaroo *j = jobs[i];
+        if(j->endOfSearch) {
+          sprintf(tmp,"[Job %d END]",(int)i);
+        } else {
+          nbOpen++;
+          sprintf(tmp,"[Job %d %d 2^%.2f/2^%.2f]",(int)i,j->connectedClient,log2((double)j->hashTable.GetNbItem()),
+            log2(j->expectedNbOp / pow(2.0,j->dpSize)));
+        }
+        info += std::string(tmp);
+      }
+      endOfSearch = (nbOpen == 0);
+      if(!endOfSearch)
+        printf("\r[Client %d]%s[%s]  ",connectedClient,info.c_str(),GetTimeStr(t1 - startTime).c_str());
+      continue;
+    }
+
+    if(!endOfSearch && jobId < 0)
       printf("\r[Client %d][Kang 2^%.2f][DP Count 2^%.2f/2^%.2f][Dead %.0f][%s][%s]  ",
         connectedClient,
         log2((double)totalRW),
@@ -224,13 +412,44 @@ void Kangaroo::ProcessServer() {
 
     if(workFile.length() > 0 && !endOfSearch) {
       if((t1 - lastSave) > saveWorkPeriod) {
+        // Wait for the chunks in progress and block insert threads
+        for(int i = 0; i < SERVER_INSERT; i++)
+          LOCK(insertMutex[i]);
         SaveServerWork();
+        for(int i = 0; i < SERVER_INSERT; i++)
+          UNLOCK(insertMutex[i]);
         lastSave = t1;
       }
     }
 
   }
 
+  JoinThreads(thHandles,nbThread);
+  FreeHandles(thHandles,nbThread);
+  JoinThreads(vHandles,nbValid);
+  FreeHandles(vHandles,nbValid);
+
+  // Last DP are streamed by the replication thread, the standbys find the same collision and stop
+  JoinThreads(&rHandle,nbRepl);
+  FreeHandles(&rHandle,nbRepl);
+
+  // All jobs are done, wait for their last backup
+  if(jobThreads.size() > 0) {
+    JoinThreads(jobThreads.data(),(int)jobThreads.size());
+    FreeHandles(jobThreads.data(),(int)jobThreads.size());
+    jobThreads.clear();
+  }
+
+  if(insertRunning) {
+    insertRunning = false;
+    if(workFile.length() > 0 && !endFromPeer)
+      SaveServerWork();
+  }
+
+  // Key solved here, stop the other shards
+  if(shards.size() > 1 && !relayMode && !endFromPeer)
+    BroadcastEnd();
+
 }
 
 // Wait for end of threads and display stats
@@ -298,6 +517,9 @@ void Kangaroo::Process(TH_PARAM *params,std::string unit) {
     }
     avgKeyRate /= (double)(nbSample);
     avgGpuKeyRate /= (double)(nbSample);
+    avgRate = avgKeyRate;
+    avgGpuRate = avgGpuKeyRate;
+    opCount = count + offsetCount;
     double expectedTime = expectedNbOp / avgKeyRate;
 
     // Display stats
@@ -46,9 +46,18 @@ void printUsage() {
   printf(" -op prvfile: Specify file to save private key in hex format\n");
   printf(" -wi workInterval: Periodic interval (in seconds) for saving work\n");
   printf(" -ws: Save kangaroos in the work file\n");
+  printf(" -wsc: Save kangaroos in the work file using compressed points and distances\n");
+  printf(" -wpack: Save (or merge into) work files using the packed hashtable format\n");
   printf(" -wsplit: Split work file of server and reset hashtable\n");
+  printf(" -wpart: Save work file of server as a partitioned work file (directory), written in parallel\n");
+  printf(" -wj: Append new DPs to a journal (workfile.jnl) and save a full work file only occasionally\n");
+  printf(" -wbg: Write full work files from a forked process, threads are only paused for the fork\n");
+  printf(" -wcompact workfile: Fold the journal of workfile into workfile\n");
   printf(" -wm file1 file2 destfile: Merge work file\n");
   printf(" -wmdir dir destfile: Merge directory of work files\n");
+  printf(" -wmdaemon dir partname: Merge the work files written in dir (-wsplit) into a partitioned work file as they appear\n");
+  printf(" -wmrate MBps: I/O limit of the merge daemon, default is 64MB/s (0 for no limit)\n");
+  printf(" -wio n: Maximum number of partitions read or written at the same time (default is no limit)\n");
   printf(" -wt timeout: Save work timeout in millisec (default is 3000ms)\n");
   printf(" -winfo file1: Work file info file\n");
   printf(" -wexport file1: Export Work file\n");
@@ -57,7 +66,19 @@ void printUsage() {
   printf(" -m maxStep: number of operations before give up the search (maxStep*expected operation)\n");
   printf(" -s: Start in server mode\n");
   printf(" -c server_ip: Start in client mode and connect to server server_ip\n");
+  printf("    or -c host1:port1,host2:port2,...: Connect to the first reachable server of a failover list\n");
+  printf(" -dl dpBit: Client local DP size, collisions between own kangaroos are solved locally\n");
   printf(" -sp port: Server port, default is 17403\n");
+  printf(" -vs rate: Fraction of the client DPs validated by the server (e.g. 0.01), default is 0 (disabled)\n");
+  printf(" -vq rate: Error rate above which a client is quarantined, default is 0.05\n");
+  printf(" -relay port: Start in relay mode, accept clients on port and forward to the server given by -c\n");
+  printf(" -shard i host1:port1,host2:port2,...: Start server as shard i of the given shard map\n");
+  printf(" -standby host1:port1,...: Stream accepted DPs to standby servers started with the same input file\n");
+  printf(" -shm name: Aggregate the DPs of local processes started with -c shm:name (server, relay or standalone)\n");
+  printf(" -metrics port: Expose metrics in Prometheus text format on http://host:port/metrics\n");
+  printf(" -jobs jobFile: Start server with several jobs, one per line: inputFile dpBits [workFile|-] [weight] [priority]\n");
+  printf(" -load nbClient,dpPerSec,batchSize[,plantSec]: Load test the server given by -c with simulated clients\n");
+  printf(" -lkey privKey: Private key (hex) of the server key, used to plant a collision after plantSec\n");
   printf(" -nt timeout: Network timeout in millisec (default is 3000ms)\n");
   printf(" -o fileName: output result to fileName\n");
   printf(" -l: List cuda enabled devices\n");
@@ -150,10 +171,18 @@ static string checkWorkFile = "";
 static string iWorkFile = "";
 static uint32_t savePeriod = 60;
 static bool saveKangaroo = false;
+static bool compactKangaroo = false;
+static bool packTable = false;
+static bool savePart = false;
 static string merge1 = "";
 static string merge2 = "";
 static string mergeDest = "";
 static string mergeDir = "";
+static string daemonDir = "";
+static double daemonRate = MERGE_DAEMON_RATE;
+static int ioLimit = 0;
+static double validRate = VALID_RATE;
+static double validMaxError = VALID_MAX_ERROR;
 static string infoFile = "";
 static string exportFile = "";
 static double maxStep = 0.0;
@@ -161,10 +190,23 @@ static int wtimeout = 3000;
 static int ntimeout = 3000;
 static int port = 17403;
 static bool serverMode = false;
+static int relayPort = 0;
+static int shardId = -1;
+static string shardMap = "";
+static string jobFile = "";
+static int metricsPort = 0;
+static string standbyList = "";
+static string shmName = "";
+static int localDP = 0;
+static vector<int> loadSpec;
+static string loadKey = "";
 static string serverIP = "";
 static string outputFile = "";
 static bool splitWorkFile = false;
 static string prvFile = "";
+static bool useJournal = false;
+static bool saveBackground = false;
+static string compactFile = "";
 
 int main(int argc, char* argv[]) {
 
@@ -195,6 +237,10 @@ int main(int argc, char* argv[]) {
       CHECKARG("-d",1);
       dp = getInt("dpSize",argv[a]);
       a++;
+    } else if(strcmp(argv[a],"-dl") == 0) {
+      CHECKARG("-dl",1);
+      localDP = getInt("localDPSize",argv[a]);
+      a++;
     } else if (strcmp(argv[a], "-h") == 0) {
       printUsage();
     } else if(strcmp(argv[a],"-l") == 0) {
@@ -231,6 +277,20 @@ int main(int argc, char* argv[]) {
       CHECKARG("-wmdir",2);
       mergeDest = string(argv[a]);
       a++;
+    } else if(strcmp(argv[a],"-wmdaemon") == 0) {
+      CHECKARG("-wmdaemon",1);
+      daemonDir = string(argv[a]);
+      CHECKARG("-wmdaemon",2);
+      mergeDest = string(argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-wmrate") == 0) {
+      CHECKARG("-wmrate",1);
+      daemonRate = getDouble("mergeRate",argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-wio") == 0) {
+      CHECKARG("-wio",1);
+      ioLimit = getInt("ioLimit",argv[a]);
+      a++;
     }  else if(strcmp(argv[a],"-wcheck") == 0) {
       CHECKARG("-wcheck",1);
       checkWorkFile = string(argv[a]);
@@ -270,9 +330,29 @@ int main(int argc, char* argv[]) {
     } else if(strcmp(argv[a],"-ws") == 0) {
       a++;
       saveKangaroo = true;
+    } else if(strcmp(argv[a],"-wsc") == 0) {
+      a++;
+      saveKangaroo = true;
+      compactKangaroo = true;
+    } else if(strcmp(argv[a],"-wpack") == 0) {
+      a++;
+      packTable = true;
+    } else if(strcmp(argv[a],"-wpart") == 0) {
+      a++;
+      savePart = true;
     } else if(strcmp(argv[a],"-wsplit") == 0) {
       a++;
       splitWorkFile = true;
+    } else if(strcmp(argv[a],"-wj") == 0) {
+      a++;
+      useJournal = true;
+    } else if(strcmp(argv[a],"-wbg") == 0) {
+      a++;
+      saveBackground = true;
+    } else if(strcmp(argv[a],"-wcompact") == 0) {
+      CHECKARG("-wcompact",1);
+      compactFile = string(argv[a]);
+      a++;
     } else if(strcmp(argv[a],"-wpartcreate") == 0) {
       CHECKARG("-wpartcreate",1);
       workFile = string(argv[a]);
@@ -285,10 +365,55 @@ int main(int argc, char* argv[]) {
       CHECKARG("-c",1);
       serverIP = string(argv[a]);
       a++;
+    } else if(strcmp(argv[a],"-relay") == 0) {
+      CHECKARG("-relay",1);
+      relayPort = getInt("relayPort",argv[a]);
+      serverMode = true;
+      a++;
+    } else if(strcmp(argv[a],"-shard") == 0) {
+      CHECKARG("-shard",1);
+      shardId = getInt("shardIndex",argv[a]);
+      CHECKARG("-shard",2);
+      shardMap = string(argv[a]);
+      serverMode = true;
+      a++;
+    } else if(strcmp(argv[a],"-standby") == 0) {
+      CHECKARG("-standby",1);
+      standbyList = string(argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-shm") == 0) {
+      CHECKARG("-shm",1);
+      shmName = string(argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-metrics") == 0) {
+      CHECKARG("-metrics",1);
+      metricsPort = getInt("metricsPort",argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-jobs") == 0) {
+      CHECKARG("-jobs",1);
+      jobFile = string(argv[a]);
+      serverMode = true;
+      a++;
+    } else if(strcmp(argv[a],"-load") == 0) {
+      CHECKARG("-load",1);
+      getInts("load",loadSpec,string(argv[a]),',');
+      a++;
+    } else if(strcmp(argv[a],"-lkey") == 0) {
+      CHECKARG("-lkey",1);
+      loadKey = string(argv[a]);
+      a++;
     } else if(strcmp(argv[a],"-sp") == 0) {
       CHECKARG("-sp",1);
       port = getInt("serverPort",argv[a]);
       a++;
+    } else if(strcmp(argv[a],"-vs") == 0) {
+      CHECKARG("-vs",1);
+      validRate = getDouble("validRate",argv[a]);
+      a++;
+    } else if(strcmp(argv[a],"-vq") == 0) {
+      CHECKARG("-vq",1);
+      validMaxError = getDouble("validMaxError",argv[a]);
+      a++;
     } else if(strcmp(argv[a],"-gpu") == 0) {
       gpuEnable = true;
       a++;
@@ -315,6 +440,51 @@ int main(int argc, char* argv[]) {
 
   }
 
+  if(relayPort > 0 && serverIP.length() == 0) {
+    printf("Error: -relay requires the upstream server address (-c)\n");
+    exit(-1);
+  }
+
+  if(relayPort > 0 && shardMap.length() > 0) {
+    printf("Error: -relay and -shard cannot be used together\n");
+    exit(-1);
+  }
+
+  if(jobFile.length() > 0 && (relayPort > 0 || shardMap.length() > 0 || serverIP.length() > 0)) {
+    printf("Error: -jobs cannot be used with -relay, -shard or -c\n");
+    exit(-1);
+  }
+
+  if(standbyList.length() > 0 && (relayPort > 0 || shardMap.length() > 0 || jobFile.length() > 0 || !serverMode)) {
+    printf("Error: -standby requires a single server (-s) without -relay, -shard or -jobs\n");
+    exit(-1);
+  }
+
+  if(shmName.length() > 0 && ((serverIP.length() > 0 && relayPort == 0) || shardMap.length() > 0 || jobFile.length() > 0)) {
+    printf("Error: -shm cannot be used with -c (use -c shm:name to attach), -shard or -jobs\n");
+    exit(-1);
+  }
+
+  if(serverIP.compare(0,4,"shm:") == 0 && (serverMode || loadSpec.size() > 0)) {
+    printf("Error: -c shm:name is only available for clients\n");
+    exit(-1);
+  }
+
+  if(savePart && (!serverMode || (workFile.length() == 0 && jobFile.length() == 0))) {
+    printf("Error: -wpart requires a server (-s) with a work file (-w)\n");
+    exit(-1);
+  }
+
+  if(localDP > 0 && (serverIP.length() == 0 || serverMode || relayPort > 0 || loadSpec.size() > 0)) {
+    printf("Error: -dl is only available for clients (-c)\n");
+    exit(-1);
+  }
+
+  if(loadSpec.size() > 0 && (serverIP.length() == 0 || serverMode)) {
+    printf("Error: -load requires a server address (-c) and cannot be used with server options\n");
+    exit(-1);
+  }
+
   if(gridSize.size() == 0) {
     for(int i = 0; i < gpuId.size(); i++) {
       gridSize.push_back(0);
@@ -325,15 +495,39 @@ int main(int argc, char* argv[]) {
     exit(-1);
   }
 
+  KANGAROO_OPT opt;
+  opt.useJournal = useJournal;
+  opt.saveBackground = saveBackground;
+  opt.compactKangaroo = compactKangaroo;
+  opt.packTable = packTable;
+  opt.savePart = savePart;
+  opt.ioLimit = ioLimit;
+  opt.relayPort = relayPort;
+  opt.shardId = shardId;
+  opt.shardMap = shardMap;
+  opt.metricsPort = metricsPort;
+  opt.standbyList = standbyList;
+  opt.shmName = shmName;
+  opt.localDPSize = localDP;
+  opt.validRate = validRate;
+  opt.validMaxError = validMaxError;
+
   Kangaroo *v = new Kangaroo(secp,dp,gpuEnable,workFile,iWorkFile,savePeriod,saveKangaroo,
-                             maxStep,wtimeout,port,ntimeout,serverIP,outputFile,splitWorkFile,prvFile);
+                             maxStep,wtimeout,port,ntimeout,serverIP,outputFile,splitWorkFile,prvFile,opt);
   if(checkFlag) {
     v->Check(gpuId,gridSize);
     exit(0);
+  } else if(loadSpec.size() > 0) {
+    if( !v->LoadTest(loadSpec,loadKey) )
+      exit(-1);
+    exit(0);
   } else {
     if(checkWorkFile.length() > 0) {
       v->CheckWorkFile(nbCPUThread,checkWorkFile);
       exit(0);
+    } if(compactFile.length() > 0) {
+      v->CompactWork(compactFile);
+      exit(0);
     } if(infoFile.length()>0) {
       v->WorkInfo(infoFile);
       exit(0);
@@ -342,10 +536,16 @@ int main(int argc, char* argv[]) {
     } else if(mergeDir.length() > 0) {
       v->MergeDir(mergeDir,mergeDest);
       exit(0);
+    } else if(daemonDir.length() > 0) {
+      v->MergeDaemon(daemonDir,mergeDest,daemonRate);
+      exit(0);
     } else if(merge1.length()>0) {
       v->MergeWork(merge1,merge2,mergeDest);
       exit(0);
-    } if(iWorkFile.length()>0) {
+    } if(jobFile.length()>0) {
+      if( !v->LoadJobs(jobFile) )
+        exit(-1);
+    } else if(iWorkFile.length()>0) {
       if( !v->LoadWork(iWorkFile) )
         exit(-1);
     } else if(configFile.length()>0) {